@@ -1,15 +1,24 @@
 import json
 
+_WHITESPACE = ' \t\n\r'
+
 
 def _matches_format(path_or_file):
+    # Only look at the start of the file; the report is parsed once, when it
+    # is loaded.
     if isinstance(path_or_file, str):
-        path_or_file = open(path_or_file)
-
+        path_or_file = open(path_or_file, 'rb')
+        close = True
+    else:
+        close = False
     try:
-        json.load(path_or_file)
-        return True
-    except Exception:
-        return False
+        prefix = path_or_file.read(64)
+    finally:
+        if close:
+            path_or_file.close()
+    if isinstance(prefix, bytes):
+        prefix = prefix.decode('utf-8-sig', 'ignore')
+    return prefix.lstrip(_WHITESPACE)[:1] in ('{', '[')
 
 
 def _load_format(path_or_file):
@@ -2,15 +2,19 @@ import plistlib
 
 
 def _matches_format(path_or_file):
-    try:
-        if isinstance(path_or_file, str):
-            with open(path_or_file, 'rb') as fp:
-                plistlib.load(fp)
-        else:
-            plistlib.load(path_or_file)
+    # Only look at the start of the file, for the binary plist magic or the
+    # XML declaration; the plist is parsed once, when it is loaded.
+    if isinstance(path_or_file, str):
+        with open(path_or_file, 'rb') as fp:
+            prefix = fp.read(64)
+    else:
+        prefix = path_or_file.read(64)
+    if isinstance(prefix, str):
+        prefix = prefix.encode()
+    if prefix.startswith(b'bplist00'):
         return True
-    except Exception:
-        return False
+    prefix = prefix.lstrip(b'\xef\xbb\xbf').lstrip()
+    return prefix.startswith((b'<?xml', b'<!DOCTYPE plist', b'<plist'))
 
 
 def _load_format(path_or_file):
@@ -324,6 +324,33 @@ def action_post_run(config, datafiles, select_machine, merge):
             sys.stderr.write('\n')
 
 
+@click.command("export-columnar")
+@_pass_config
+@click.argument("output", type=click.Path())
+@click.option("--format", "fmt", type=click.Choice(['arrow', 'parquet']),
+              default='arrow', show_default=True,
+              help="Arrow IPC stream or Parquet file")
+@click.option("--profiles", is_flag=True,
+              help="export the functions of the profiles, not the samples")
+def action_export_columnar(config, output, fmt, profiles):
+    """Export all samples or profiles to a columnar file."""
+    if os.path.exists(output):
+        _fatal("'%s' already exists" % output)
+
+    url = ('{lnt_url}/api/db_{database}/v4/{testsuite}/export'
+           .format(**config.dict))
+    url_params = {
+        'kind': 'profiles' if profiles else 'samples',
+        'format': fmt,
+    }
+    response = config.session.get(url, params=url_params, stream=True)
+    _check_response(response)
+    with open(output, "wb") as destfile:
+        for chunk in response.iter_content(chunk_size=1 << 20):
+            destfile.write(chunk)
+    sys.stdout.write("%s created.\n" % output)
+
+
 @click.command('create-config')
 def action_create_config():
     """Create example configuration."""
@@ -346,6 +373,7 @@ class AdminCLI(click.MultiCommand):
     dependencies.'''
     _commands = [
         action_create_config,
+        action_export_columnar,
         action_get_machine,
         action_get_run,
         action_list_machines,
@@ -30,6 +30,13 @@ db_dir = %(db_dir)r
 # Profile directory, where profiles are kept.
 profile_dir = %(profile_dir)r
 
+# Profiles imported without disassembly are disassembled on first view, using
+# this objdump on binaries found under binary_cache_root. binary_cache_root may
+# also be a build-id store (.build-id/xx/yyyy... or <build-id>/executable).
+# Without a binary_cache_root, nothing is disassembled.
+# objdump = 'objdump'
+# binary_cache_root = '/path/to/binaries'
+
 # Secret key for this server instance.
 secret_key = %(secret_key)r
 
@@ -412,10 +412,30 @@ def action_profile():
 @action_profile.command("upgrade")
 @click.argument("input", type=click.Path(exists=True))
 @click.argument("output", type=click.Path())
-def command_update(input, output):
-    """upgrade a profile to the latest version"""
+@click.option("--jobs", "-j", type=int,
+              help="number of profiles to upgrade at once if INPUT is a "
+                   "directory [default: one per CPU]")
+def command_update(input, output, jobs):
+    """upgrade a profile, or every profile in a directory, to the latest
+    version"""
+    import os
     import lnt.testing.profile.profile as profile
-    profile.Profile.fromFile(input).upgrade().save(filename=output)
+    if not os.path.isdir(input):
+        if not profile.Profile.upgradeFile(input, output):
+            raise click.ClickException("could not read profile %s" % input)
+        return
+
+    results = profile.Profile.upgradeDirectory(input, output, jobs)
+    failed = sorted((path, result) for path, result in results.items()
+                    if result is not True and result is not False)
+    for path, error in failed:
+        logger.error("could not upgrade %s: %s" % (path, error))
+    upgraded = sum(1 for result in results.values() if result is True)
+    skipped = sum(1 for result in results.values() if result is False)
+    print("upgraded %d profiles, skipped %d other files" % (upgraded, skipped))
+    if failed:
+        raise click.ClickException("could not upgrade %d profiles" %
+                                   len(failed))
 
 
 @action_profile.command("getVersion")
@@ -120,6 +120,11 @@ class Config:
 
         ignore_regressions = data.get('ignore_regressions', False)
 
+        # Used to disassemble profiles imported without disassembly.
+        objdump = data.get('objdump', os.getenv('CMAKE_OBJDUMP', 'objdump'))
+        binaryCacheRoot = data.get('binary_cache_root',
+                                   os.getenv('LNT_BINARY_CACHE_ROOT', ''))
+
         return Config(data.get('name', 'LNT'), data['zorgURL'],
                       dbDir, os.path.join(baseDir, tempDir),
                       os.path.join(baseDir, profileDir), secretKey,
@@ -127,7 +132,8 @@ class Config:
                                                  default_email_config,
                                                  0))
                            for k, v in data['databases'].items()]),
-                      blacklist, schemasDir, api_auth_token, ignore_regressions)
+                      blacklist, schemasDir, api_auth_token, ignore_regressions,
+                      objdump, binaryCacheRoot)
 
     @staticmethod
     def dummy_instance():
@@ -162,7 +168,9 @@ class Config:
                  blacklist,
                  schemasDir,
                  api_auth_token=None,
-                 ignore_regressions=False):
+                 ignore_regressions=False,
+                 objdump='objdump',
+                 binaryCacheRoot=''):
         self.name = name
         self.zorgURL = zorgURL
         self.dbDir = dbDir
@@ -178,6 +186,8 @@ class Config:
             db.config = self
         self.api_auth_token = api_auth_token
         self.ignore_regressions = ignore_regressions
+        self.objdump = objdump
+        self.binaryCacheRoot = binaryCacheRoot
 
     def get_database(self, name):
         """
@@ -0,0 +1,190 @@
+"""
+Export of the samples of a test suite, and of the functions of their
+profiles, as Arrow IPC streams or Parquet files, for analysis outside of
+LNT.
+
+The rows are read from the database with a server-side cursor, a chunk at a
+time, without creating any ORM object, and every chunk is written as one
+record batch (or Parquet row group) as soon as it is read, so the memory
+used does not depend on the size of the export. This needs pyarrow, which
+is only imported when exporting.
+"""
+import os
+
+from lnt.testing.profile.profile import Profile
+from lnt.util import logger
+
+FORMATS = ('arrow', 'parquet')
+KINDS = ('samples', 'profiles')
+
+# The number of rows in each record batch or row group.
+CHUNK_ROWS = 65536
+
+
+def _pyarrow():
+    try:
+        import pyarrow
+        import pyarrow.ipc
+        import pyarrow.parquet
+    except ImportError:
+        raise ValueError("Columnar export needs the pyarrow module")
+    return pyarrow
+
+
+class _Sink(object):
+    """A file that keeps what is written to it until it is taken."""
+    def __init__(self):
+        self.chunks = []
+        self.pos = 0
+        self.closed = False
+
+    def write(self, data):
+        self.chunks.append(bytes(data))
+        self.pos += len(data)
+        return len(data)
+
+    def tell(self):
+        return self.pos
+
+    def flush(self):
+        pass
+
+    def close(self):
+        self.closed = True
+
+    def take(self):
+        data = b''.join(self.chunks)
+        self.chunks = []
+        return data
+
+
+def _sampleColumns(ts, pa):
+    """Return the (column, name, arrow type) of the samples export."""
+    types = {'Real': pa.float64(), 'Integer': pa.int64(),
+             'Status': pa.int64(), 'Hash': pa.string()}
+    columns = [(ts.Sample.id, 'sample_id', pa.int64()),
+               (ts.Sample.run_id, 'run_id', pa.int64()),
+               (ts.Run.start_time, 'start_time', pa.timestamp('us')),
+               (ts.Machine.name, 'machine', pa.string()),
+               (ts.Test.name, 'test', pa.string())]
+    columns += [(f.column, f.name, pa.string()) for f in ts.Order.fields]
+    columns += [(f.column, f.name, types.get(f.type.name, pa.float64()))
+                for f in ts.sample_fields]
+    return columns
+
+
+def _streamRows(session, query, chunk_rows):
+    """Yield the rows of query, chunk_rows at a time."""
+    connection = session.connection().execution_options(stream_results=True)
+    result = connection.execute(query.statement)
+    try:
+        while True:
+            rows = result.fetchmany(chunk_rows)
+            if not rows:
+                return
+            yield rows
+    finally:
+        result.close()
+
+
+def _samples(session, ts, pa, chunk_rows):
+    columns = _sampleColumns(ts, pa)
+    schema = pa.schema([(name, type) for _, name, type in columns])
+    q = session.query(*[c.label(name) for c, name, _ in columns]) \
+        .select_from(ts.Sample) \
+        .join(ts.Test, ts.Sample.test_id == ts.Test.id) \
+        .join(ts.Run, ts.Sample.run_id == ts.Run.id) \
+        .join(ts.Machine, ts.Run.machine_id == ts.Machine.id) \
+        .join(ts.Order, ts.Run.order_id == ts.Order.id) \
+        .order_by(ts.Sample.id)
+
+    def batches():
+        for rows in _streamRows(session, q, chunk_rows):
+            yield pa.RecordBatch.from_arrays(
+                [pa.array([row[i] for row in rows], type=type)
+                 for i, (_, _, type) in enumerate(columns)],
+                schema=schema)
+    return schema, batches()
+
+
+def _profiles(session, ts, pa, chunk_rows):
+    schema = pa.schema([('sample_id', pa.int64()), ('run_id', pa.int64()),
+                        ('machine', pa.string()), ('test', pa.string()),
+                        ('function', pa.string()), ('counter', pa.string()),
+                        ('percentage', pa.float64())])
+    q = session.query(ts.Sample.id, ts.Sample.run_id, ts.Machine.name,
+                      ts.Test.name, ts.Profile.filename) \
+        .select_from(ts.Sample) \
+        .join(ts.Profile, ts.Sample.profile_id == ts.Profile.id) \
+        .join(ts.Test, ts.Sample.test_id == ts.Test.id) \
+        .join(ts.Run, ts.Sample.run_id == ts.Run.id) \
+        .join(ts.Machine, ts.Run.machine_id == ts.Machine.id) \
+        .order_by(ts.Sample.id)
+    profile_dir = ts.v4db.config.profileDir
+
+    def batch(columns):
+        return pa.RecordBatch.from_arrays(
+            [pa.array(c, type=field.type) for c, field in zip(columns, schema)],
+            schema=schema)
+
+    def batches():
+        columns = [[] for _ in schema]
+        for rows in _streamRows(session, q, chunk_rows):
+            for sample_id, run_id, machine, test, filename in rows:
+                try:
+                    # Only the functions are read, not their instructions.
+                    functions = Profile.peekFile(
+                        os.path.join(profile_dir, filename),
+                        functions=True).get('functions', {})
+                except Exception:
+                    logger.warning("Could not read profile %s", filename)
+                    continue
+                for name, f in sorted(functions.items()):
+                    for counter, value in sorted(f.get('counters', {}).items()):
+                        for c, v in zip(columns, (sample_id, run_id, machine,
+                                                  test, name, counter, value)):
+                            c.append(v)
+                if len(columns[0]) >= chunk_rows:
+                    yield batch(columns)
+                    columns = [[] for _ in schema]
+        if columns[0]:
+            yield batch(columns)
+    return schema, batches()
+
+
+def export(session, ts, kind='samples', fmt='arrow', chunk_rows=CHUNK_ROWS):
+    """
+    Export the samples of test suite ts (kind 'samples'), or the functions
+    of their profiles (kind 'profiles'), in format fmt: 'arrow' for an Arrow
+    IPC stream or 'parquet' for a Parquet file. Return a generator of the
+    bytes of the export, a record batch (or row group) at a time.
+
+    Samples have a column for their ID, run ID, run start time, machine
+    name, test name, each order field and each sample field. Profiles have a
+    row for each counter of each function, with the percentage of the
+    counter it takes, the sample and run IDs, machine and test name.
+    """
+    if kind not in KINDS:
+        raise ValueError("Unknown kind of export: %s" % kind)
+    if fmt not in FORMATS:
+        raise ValueError("Unknown export format: %s" % fmt)
+    pa = _pyarrow()
+    schema, batches = (_samples if kind == 'samples' else _profiles)(
+        session, ts, pa, chunk_rows)
+
+    def generate():
+        sink = _Sink()
+        f = pa.PythonFile(sink, mode='w')
+        if fmt == 'arrow':
+            writer = pa.ipc.new_stream(f, schema)
+        else:
+            writer = pa.parquet.ParquetWriter(f, schema)
+        for b in batches:
+            if fmt == 'arrow':
+                writer.write_batch(b)
+            else:
+                writer.write_table(pa.Table.from_batches([b]))
+            yield sink.take()
+        writer.close()
+        yield sink.take()
+    return generate()
@@ -0,0 +1,22 @@
+"""This upgrade adds the Attribution column to FieldChangeV2, which records
+the functions whose profiles changed the most along with the change.
+"""
+
+from sqlalchemy import Binary, Column, select
+from lnt.server.db.migrations.util import introspect_table
+from lnt.server.db.util import add_column
+
+
+def upgrade(engine):
+    """Add the Attribution column to FieldChangeV2 for each of the test-suites.
+    """
+
+    test_suite = introspect_table(engine, 'TestSuite')
+
+    with engine.begin() as trans:
+        db_keys = list(trans.execute(select([test_suite])))
+
+    for suite in db_keys:
+        with engine.begin() as trans:
+            add_column(trans, '{}_FieldChangeV2'.format(suite[2]),
+                       Column('Attribution', Binary))
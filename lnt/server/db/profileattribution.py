@@ -0,0 +1,128 @@
+"""
+Attribute a change in a test's metric to the functions of its profiles.
+
+For a FieldChange of a test that has profiles on both sides of the change,
+the functions of the profile of the last run before it and of the run it was
+found in are compared. Each function is credited with the part of the metric
+its share of a counter accounts for after the change, less the part it
+accounted for before; the functions that moved the metric the most are
+stored on the FieldChange.
+
+Only changes of the fields in ATTRIBUTED_FIELDS are attributed: the profile
+of a run says where its execution time went, not its compile time or code
+size.
+"""
+import os
+import time
+
+from lnt.testing.profile.profile import Profile, rankingCounter
+from lnt.util import logger
+
+# The number of functions stored for each change.
+TOP_FUNCTIONS = 10
+
+# How many runs before the change to look for a profile in.
+LOOKBACK = 10
+
+# The names of the fields whose changes are attributed; their values must be
+# proportional to the counters the profiles sample.
+ATTRIBUTED_FIELDS = ('execution_time',)
+
+
+def _counters(functions):
+    return set(c for f in functions.values() for c in f.get('counters', {}))
+
+
+def attribute(before, after, old_value, new_value, deadline=None,
+              top=TOP_FUNCTIONS, absolute=()):
+    """
+    Compare before and after, the functions of two profiles as returned by
+    ProfileImpl.getFunctions(), of samples whose metric went from old_value
+    to new_value. They are compared by the counter both have that
+    rankingCounter() picks, leaving out those in absolute (see
+    ProfileImpl.getAbsoluteCounters()). Return a dict with the counter
+    compared, whether all the
+    functions could be compared before deadline (a time.time() value), and
+    the top functions by the absolute value of the change of the metric
+    attributed to them, as dicts of function, before and after (percentages
+    of the counter) and delta (in units of the metric).
+    """
+    counter = rankingCounter(_counters(before) & _counters(after), absolute)
+    result = {'counter': counter, 'complete': True, 'functions': []}
+    if counter is None:
+        return result
+
+    old_value = old_value or 0.0
+    new_value = new_value or 0.0
+    deltas = []
+    for i, name in enumerate(set(before) | set(after)):
+        if deadline is not None and i % 1024 == 0 and \
+                time.time() > deadline:
+            result['complete'] = False
+            break
+        b = before.get(name, {}).get('counters', {}).get(counter, 0.0)
+        a = after.get(name, {}).get('counters', {}).get(counter, 0.0)
+        delta = new_value * a / 100.0 - old_value * b / 100.0
+        if delta:
+            deltas.append((abs(delta), name, b, a, delta))
+
+    deltas.sort(key=lambda d: (-d[0], d[1]))
+    result['functions'] = [
+        {'function': name, 'before': b, 'after': a, 'delta': delta}
+        for _, name, b, a, delta in deltas[:top]]
+    return result
+
+
+def _peekProfile(ts, filename, deadline):
+    if time.time() > deadline:
+        return None
+    try:
+        # Only the functions are read, not their instructions.
+        return Profile.peekFile(
+            os.path.join(ts.v4db.config.profileDir, filename), functions=True)
+    except Exception:
+        logger.warning("Could not read profile %s", filename)
+        return None
+
+
+def attribute_field_change(session, ts, fc, budget):
+    """
+    Attribute field change fc to the functions of its profiles, spending no
+    more than budget seconds. Return True if fc is of one of
+    ATTRIBUTED_FIELDS, had profiles on both sides and its attribution was
+    set.
+    """
+    if fc.field.name not in ATTRIBUTED_FIELDS:
+        return False
+    deadline = time.time() + budget
+    after = session.query(ts.Profile.filename) \
+        .join(ts.Sample, ts.Sample.profile_id == ts.Profile.id) \
+        .filter(ts.Sample.run_id == fc.run_id) \
+        .filter(ts.Sample.test_id == fc.test_id) \
+        .first()
+    if after is None:
+        return False
+
+    previous = [r.id for r in ts.get_previous_runs_on_machine(
+        session, fc.run, LOOKBACK)]
+    if not previous:
+        return False
+    profiles = dict(session.query(ts.Sample.run_id, ts.Profile.filename)
+                    .join(ts.Profile, ts.Sample.profile_id == ts.Profile.id)
+                    .filter(ts.Sample.run_id.in_(previous))
+                    .filter(ts.Sample.test_id == fc.test_id)
+                    .all())
+    before = next((profiles[r] for r in previous if r in profiles), None)
+    if before is None:
+        return False
+
+    before = _peekProfile(ts, before, deadline)
+    after = _peekProfile(ts, after[0], deadline)
+    if before is None or after is None:
+        return False
+    absolute = set(before.get('absolute-counters', [])) | \
+        set(after.get('absolute-counters', []))
+    fc.attribution = attribute(before.get('functions', {}),
+                               after.get('functions', {}), fc.old_value,
+                               fc.new_value, deadline, absolute=absolute)
+    return True
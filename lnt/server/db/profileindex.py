@@ -0,0 +1,381 @@
+"""
+An inverted index of the hot functions of the profiles of a test suite, to
+find the profiles in which a function takes a given share of some counter
+without opening any of them.
+
+The index maps each function name to postings lists, one per counter, of
+(percentage, profile ID) pairs sorted by percentage, so that a range of
+percentages is found with two binary searches. It is kept in a directory of
+immutable segment files. Every submission adds a small segment, and
+segments are merged a level at a time (FANOUT segments of one level into
+one segment of the next) so that a query only has to look at a few of them.
+Merging is left to a deferred rule (rule_merge_profile_index), so that
+submissions do not wait for it.
+
+A segment is laid out as follows, all integers being uint32s and all numbers
+in the byte order of the server:
+
+  magic           b'LNTPIDX2'
+  num_counters, num_functions, num_lists, num_postings
+  counters        for each: length, UTF-8 name
+  functions       sorted by name; for each: offset and length of the name,
+                  first list, # lists
+  names           the UTF-8 function names, in the same order
+  lists           sorted by function then counter; for each: counter index,
+                  first posting, # postings
+  percentages     num_postings float32s, sorted within each list
+  profile IDs     num_postings uint32s, in the same order
+
+The function table has fixed-size entries, so that a function is found by a
+binary search of the mapped file.
+"""
+import bisect
+import errno
+import heapq
+import mmap
+import os
+import re
+import struct
+import tempfile
+import threading
+from array import array
+
+try:
+    import fcntl
+except ImportError:  # pragma: no cover
+    fcntl = None
+
+MAGIC = b'LNTPIDX2'
+
+# The number of segments of one level that are merged into one segment of
+# the next level.
+FANOUT = 8
+
+# Indexes by path, so that their segments stay open between queries.
+_indexes = {}
+_indexes_lock = threading.Lock()
+
+_SEGMENT_RE = re.compile(r'^L(\d+)-(\d+)\.idx$')
+_U32 = struct.Struct('=I')
+_HEADER = struct.Struct('=4I')
+_FUNCTION = struct.Struct('=4I')
+_LIST = struct.Struct('=3I')
+
+
+def suiteDataPath(ts, kind):
+    """
+    Return the directory that data of the given kind derived from the
+    profiles of test suite ts is kept in, inside the profile directory.
+    """
+    db = ts.v4db
+    name = re.sub(r'[^\w.-]', '_', db.path.rstrip('/').rsplit('/', 1)[-1])
+    return os.path.join(db.config.profileDir, kind, name, ts.name)
+
+
+class Segment(object):
+    """
+    A read-only view of one segment file, or of another file in the same
+    format whose magic is magic (see lnt.server.db.profiletimeseries).
+    """
+    def __init__(self, path, magic=MAGIC):
+        with open(path, 'rb') as f:
+            self.buf = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        if self.buf[:len(magic)] != magic:
+            self.buf.close()
+            raise ValueError("%s is not a profile index segment" % path)
+        off = len(magic)
+        n_counters, n_functions, n_lists, n_postings = \
+            _HEADER.unpack_from(self.buf, off)
+        off += _HEADER.size
+
+        self.counters = []
+        for _ in range(n_counters):
+            name, off = self._readString(off)
+            self.counters.append(name)
+
+        self.n_functions = n_functions
+        self.functions_offset = off
+        off += n_functions * _FUNCTION.size
+        self.names_offset = off
+        if n_functions:
+            name_off, name_len, _, _ = self._function(n_functions - 1)
+            off += name_off + name_len
+
+        self.lists_offset = off
+        off += n_lists * _LIST.size
+        self.view = memoryview(self.buf)
+        self.percentages = self.view[off:off + 4 * n_postings].cast('f')
+        off += 4 * n_postings
+        self.profile_ids = self.view[off:off + 4 * n_postings].cast('I')
+
+    def _readString(self, off):
+        n, = _U32.unpack_from(self.buf, off)
+        off += _U32.size
+        return self.buf[off:off + n].decode('utf-8'), off + n
+
+    def _function(self, i):
+        return _FUNCTION.unpack_from(self.buf,
+                                     self.functions_offset + i * _FUNCTION.size)
+
+    def _name(self, name_off, name_len):
+        start = self.names_offset + name_off
+        return self.buf[start:start + name_len]
+
+    def _find(self, function):
+        """Return (first list, # lists) for function."""
+        # The names are sorted by code point, which is the order of their
+        # UTF-8 encodings.
+        key = function.encode('utf-8')
+        lo, hi = 0, self.n_functions
+        while lo < hi:
+            mid = (lo + hi) // 2
+            name_off, name_len, first, count = self._function(mid)
+            name = self._name(name_off, name_len)
+            if name == key:
+                return first, count
+            if name < key:
+                lo = mid + 1
+            else:
+                hi = mid
+        return 0, 0
+
+    def functions(self):
+        """Return the names of the functions of the segment, sorted."""
+        return [self._name(*self._function(i)[:2]).decode('utf-8')
+                for i in range(self.n_functions)]
+
+    def lists(self, function):
+        """Yield (counter, first posting, # postings) for function."""
+        first, count = self._find(function)
+        for i in range(first, first + count):
+            counter, start, n = _LIST.unpack_from(
+                self.buf, self.lists_offset + i * _LIST.size)
+            yield self.counters[counter], start, n
+
+    def postings(self):
+        """Yield (function, counter, percentage, profile ID) for all
+        postings, in sorted order."""
+        for function in self.functions():
+            for counter, start, n in self.lists(function):
+                for i in range(start, start + n):
+                    yield (function, counter, self.percentages[i],
+                           self.profile_ids[i])
+
+    def close(self):
+        self.percentages.release()
+        self.profile_ids.release()
+        self.view.release()
+        self.buf.close()
+
+
+def writeSegment(path, postings, magic=MAGIC):
+    """
+    Write postings, an iterable of (function, counter, percentage, profile
+    ID) sorted by function and counter, to a new segment file at path. The
+    postings of a function and counter are kept in the order they come in;
+    the index sorts them by percentage.
+    """
+    counters, counter_ids = [], {}
+    functions, lists = [], []
+    percentages, profile_ids = array('f'), array('I')
+    last = None
+    for function, counter, percentage, profile_id in postings:
+        if (function, counter) != last:
+            if last is None or last[0] != function:
+                functions.append([function, len(lists), 0])
+            if counter not in counter_ids:
+                counter_ids[counter] = len(counters)
+                counters.append(counter)
+            functions[-1][2] += 1
+            lists.append([counter_ids[counter], len(percentages), 0])
+            last = (function, counter)
+        lists[-1][2] += 1
+        percentages.append(percentage)
+        profile_ids.append(profile_id)
+
+    # Write the segment under a temporary name, so that readers never see
+    # it half written.
+    fd, tmp = tempfile.mkstemp(dir=os.path.dirname(path), suffix='.tmp')
+    with os.fdopen(fd, 'wb') as f:
+        f.write(magic)
+        f.write(_HEADER.pack(len(counters), len(functions), len(lists),
+                             len(percentages)))
+        for counter in counters:
+            name = counter.encode('utf-8')
+            f.write(_U32.pack(len(name)) + name)
+        names = [function.encode('utf-8') for function, _, _ in functions]
+        name_off = 0
+        for name, (_, first, count) in zip(names, functions):
+            f.write(_FUNCTION.pack(name_off, len(name), first, count))
+            name_off += len(name)
+        f.write(b''.join(names))
+        for entry in lists:
+            f.write(_LIST.pack(*entry))
+        percentages.tofile(f)
+        profile_ids.tofile(f)
+    os.replace(tmp, path)
+
+
+class ProfileIndex(object):
+    """The profile index kept in a directory."""
+    def __init__(self, path):
+        self.path = path
+        # Open segments by file name, kept between queries. Segments that
+        # were merged are closed once no query uses them any more.
+        self._segments = {}
+        self._lock = threading.Lock()
+
+    @staticmethod
+    def forTestSuite(ts):
+        """
+        Return the index of the profiles of test suite ts, kept in the
+        profile directory of its database.
+        """
+        path = suiteDataPath(ts, '_index')
+        with _indexes_lock:
+            if path not in _indexes:
+                _indexes[path] = ProfileIndex(path)
+            return _indexes[path]
+
+    def _listSegments(self):
+        try:
+            names = os.listdir(self.path)
+        except OSError as e:
+            if e.errno == errno.ENOENT:
+                return []
+            raise
+        segments = []
+        for name in names:
+            m = _SEGMENT_RE.match(name)
+            if m:
+                segments.append((int(m.group(1)), int(m.group(2)), name))
+        return sorted(segments)
+
+    def _openSegments(self):
+        """Return the current segments, opening those added since the index
+        was last read."""
+        with self._lock:
+            for _ in range(3):
+                names = [s[2] for s in self._listSegments()]
+                try:
+                    for name in names:
+                        if name not in self._segments:
+                            self._segments[name] = \
+                                Segment(os.path.join(self.path, name))
+                except (IOError, OSError) as e:
+                    # Removed by a merge after it was listed; look again.
+                    if e.errno != errno.ENOENT:
+                        raise
+                    continue
+                break
+            for name in set(self._segments) - set(names):
+                del self._segments[name]
+            return [self._segments[name] for name in names
+                    if name in self._segments]
+
+    def search(self, function, counter=None, min_percentage=0.0,
+               max_percentage=100.0):
+        """
+        Return a dict mapping each counter (or only 'counter') to a dict of
+        profile IDs to the percentage of that counter taken by 'function' in
+        the profile, for the profiles in which it is between min_percentage
+        and max_percentage (both inclusive).
+        """
+        result = {}
+        for segment in self._openSegments():
+            for c, start, n in segment.lists(function):
+                if counter is not None and c != counter:
+                    continue
+                percentages = segment.percentages
+                lo = bisect.bisect_left(percentages, min_percentage,
+                                        start, start + n)
+                hi = bisect.bisect_right(percentages, max_percentage,
+                                         lo, start + n)
+                # A profile merged while it was being read may be seen
+                # twice; it has the same percentage in both segments.
+                hits = result.setdefault(c, {})
+                for i in range(lo, hi):
+                    hits[segment.profile_ids[i]] = percentages[i]
+        return result
+
+    def add(self, profiles):
+        """
+        Add profiles, an iterable of (profile ID, functions) where functions
+        is as returned by ProfileImpl.getFunctions(), to the index as one new
+        segment. The segments are merged by merge().
+        """
+        # Percentages are stored with the precision they are searched with.
+        postings = sorted((name, counter, array('f', [value])[0], profile_id)
+                          for profile_id, functions in profiles
+                          for name, f in functions.items()
+                          for counter, value in f.get('counters', {}).items())
+        if not postings:
+            return
+        os.makedirs(self.path, exist_ok=True)
+        with FileLock(os.path.join(self.path, 'lock')):
+            segments = self._listSegments()
+            seq = max([s[1] for s in segments] + [0]) + 1
+            writeSegment(os.path.join(self.path, 'L0-%d.idx' % seq),
+                          postings)
+
+    def merge(self):
+        """
+        Merge the oldest FANOUT segments of a level into one of the next
+        level, for as long as a level has that many. Segments are added by
+        add() while this runs; queries may see a profile both in the segments
+        being merged and in the new one.
+        """
+        if not os.path.isdir(self.path):
+            return
+        # Merges are run one at a time, but do not keep segments from being
+        # added: new segments are all of level 0, and have names no merge
+        # uses.
+        with FileLock(os.path.join(self.path, 'merge.lock')):
+            self._merge()
+
+    def _merge(self):
+        while True:
+            segments = self._listSegments()
+            by_level = {}
+            for level, _, name in segments:
+                by_level.setdefault(level, []).append(name)
+            full = [level for level, names in sorted(by_level.items())
+                    if len(names) >= FANOUT]
+            if not full:
+                return
+            level = full[0]
+            names = by_level[level][:FANOUT]
+            seq = max(s[1] for s in segments) + 1
+            segments = [Segment(os.path.join(self.path, name))
+                        for name in names]
+            try:
+                writeSegment(
+                    os.path.join(self.path, 'L%d-%d.idx' % (level + 1, seq)),
+                    heapq.merge(*[s.postings() for s in segments]))
+            finally:
+                for s in segments:
+                    s.close()
+            for name in names:
+                os.remove(os.path.join(self.path, name))
+
+
+class FileLock(object):
+    """
+    An exclusive lock on a file (created if needed), held while the index is
+    written to, or a shared one if shared is true.
+    """
+    def __init__(self, path, shared=False):
+        self.path = path
+        self.shared = shared
+
+    def __enter__(self):
+        self.f = open(self.path, 'a')
+        if fcntl:
+            fcntl.flock(self.f, fcntl.LOCK_SH if self.shared
+                        else fcntl.LOCK_EX)
+        return self
+
+    def __exit__(self, *args):
+        if fcntl:
+            fcntl.flock(self.f, fcntl.LOCK_UN)
+        self.f.close()
@@ -0,0 +1,205 @@
+"""
+Time series of how hot the hottest functions of a test's profiles are, by
+machine and test, so that a function's share of a counter can be graphed
+over orders without loading any profile.
+
+At import, the TOP_FUNCTIONS hottest functions of each profile (by the
+counter lnt.testing.profile.profile.rankingCounter() picks) get a point
+appended to one series per counter. All the series of a test on a machine
+are kept in two files under <root>/<machine ID>/:
+
+  <test ID>.ts    a file in the format of the segments of the profile index
+                  (see lnt.server.db.profileindex) but with magic b'LNTPTS01':
+                  a table of the functions sorted by name, then for each
+                  function one list per counter, of (float32 value, uint32
+                  run ID) records in the order they were imported.
+  <test ID>.log   the points imported since the .ts file was last written,
+                  as records of uint32 run ID, float32 value, uint32 length
+                  of the counter name, uint32 length of the function name,
+                  then the UTF-8 counter and function names.
+
+Once the log grows past COMPACT_SIZE bytes, it is merged into a new .ts
+file. The log is locked while it is written to or merged, and shared while
+both files are read.
+"""
+import errno
+import os
+import struct
+
+from lnt.server.db.profileindex import FileLock, Segment, suiteDataPath, \
+    writeSegment
+from lnt.testing.profile.profile import rankingCounter
+
+# The number of functions of each profile that are recorded, hottest first.
+TOP_FUNCTIONS = 10
+
+# The size of the log past which it is merged into the series.
+COMPACT_SIZE = 64 * 1024
+
+MAGIC = b'LNTPTS01'
+
+_RECORD = struct.Struct('=IfII')
+
+
+def _readLog(path):
+    """Yield (function, counter, run ID, value) for the records of a log."""
+    try:
+        with open(path, 'rb') as fd:
+            data = fd.read()
+    except IOError as e:
+        if e.errno == errno.ENOENT:
+            return
+        raise
+    off = 0
+    while off + _RECORD.size <= len(data):
+        run_id, value, counter_len, name_len = _RECORD.unpack_from(data, off)
+        off += _RECORD.size
+        if off + counter_len + name_len > len(data):
+            break
+        counter = data[off:off + counter_len].decode('utf-8')
+        off += counter_len
+        name = data[off:off + name_len].decode('utf-8')
+        off += name_len
+        yield name, counter, run_id, value
+
+
+def _openSeries(path):
+    try:
+        return Segment(path, MAGIC)
+    except (IOError, OSError) as e:
+        if e.errno == errno.ENOENT:
+            return None
+        raise
+
+
+class ProfileTimeSeries(object):
+    """The time series kept in a directory."""
+    def __init__(self, path):
+        self.path = path
+
+    @staticmethod
+    def forTestSuite(ts):
+        """
+        Return the time series of the profiles of test suite ts, kept in the
+        profile directory of its database.
+        """
+        return ProfileTimeSeries(suiteDataPath(ts, '_timeseries'))
+
+    def _testPath(self, machine_id, test_id):
+        return os.path.join(self.path, str(machine_id), str(test_id))
+
+    def add(self, machine_id, test_id, run_id, functions, absolute=()):
+        """
+        Record the hottest of functions, as returned by
+        ProfileImpl.getFunctions(), for the profile of test test_id in run
+        run_id on machine machine_id. absolute are the names of the counters
+        that are not percentages (see ProfileImpl.getAbsoluteCounters()).
+        """
+        counter = rankingCounter(
+            set(c for f in functions.values() for c in f.get('counters', {})),
+            absolute)
+        if counter is None:
+            return
+        hot = sorted(functions.items(),
+                     key=lambda kv: kv[1].get('counters', {}).get(counter,
+                                                                  0.0),
+                     reverse=True)[:TOP_FUNCTIONS]
+        records = []
+        for name, f in hot:
+            name = name.encode('utf-8')
+            for counter, value in f.get('counters', {}).items():
+                counter = counter.encode('utf-8')
+                records.append(_RECORD.pack(run_id, value, len(counter),
+                                            len(name)) + counter + name)
+        if not records:
+            return
+
+        path = self._testPath(machine_id, test_id)
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        with FileLock(path + '.log'):
+            with open(path + '.log', 'ab') as fd:
+                fd.write(b''.join(records))
+                size = fd.tell()
+            if size > COMPACT_SIZE:
+                self._compact(path)
+
+    def _compact(self, path):
+        """Merge the log of the test at path into its series. The log must
+        be locked."""
+        series = {}
+        segment = _openSeries(path + '.ts')
+        if segment is not None:
+            try:
+                for function in segment.functions():
+                    for counter, start, n in segment.lists(function):
+                        series[(function, counter)] = [
+                            (segment.profile_ids[i], segment.percentages[i])
+                            for i in range(start, start + n)]
+            finally:
+                segment.close()
+        for function, counter, run_id, value in _readLog(path + '.log'):
+            series.setdefault((function, counter), []).append((run_id, value))
+        writeSegment(path + '.ts',
+                     ((function, counter, value, run_id)
+                      for (function, counter), points in sorted(series.items())
+                      for run_id, value in points),
+                     MAGIC)
+        with open(path + '.log', 'wb'):
+            pass
+
+    def functions(self, machine_id, test_id):
+        """Return the names of the functions with series for a test."""
+        path = self._testPath(machine_id, test_id)
+        if not os.path.exists(path + '.log'):
+            return []
+        with FileLock(path + '.log', shared=True):
+            names = set()
+            segment = _openSeries(path + '.ts')
+            if segment is not None:
+                names.update(segment.functions())
+                segment.close()
+            names.update(name for name, _, _, _ in _readLog(path + '.log'))
+        return sorted(names)
+
+    def get(self, machine_id, test_id, function, counter):
+        """
+        Return the series of counter for function, as a list of (run ID,
+        value) in the order they were imported.
+        """
+        path = self._testPath(machine_id, test_id)
+        if not os.path.exists(path + '.log'):
+            return []
+        result = []
+        with FileLock(path + '.log', shared=True):
+            segment = _openSeries(path + '.ts')
+            if segment is not None:
+                for c, start, n in segment.lists(function):
+                    if c == counter:
+                        result = [(segment.profile_ids[i],
+                                   segment.percentages[i])
+                                  for i in range(start, start + n)]
+                segment.close()
+            result.extend((run_id, value)
+                          for name, c, run_id, value in
+                          _readLog(path + '.log')
+                          if name == function and c == counter)
+        return result
+
+
+def downsample(points, n):
+    """
+    Reduce points, a list of [x, y, metadata] as returned by the graph API,
+    to at most n points by averaging consecutive runs of them. Each point
+    keeps the x and metadata of the last of the points it replaces, and gets
+    their minimum, maximum and number in its metadata.
+    """
+    if n <= 0 or len(points) <= n:
+        return points
+    result = []
+    for i in range(n):
+        bucket = points[i * len(points) // n:(i + 1) * len(points) // n]
+        values = [p[1] for p in bucket]
+        meta = dict(bucket[-1][2], min=min(values), max=max(values),
+                    count=len(values))
+        result.append([bucket[-1][0], sum(values) / len(values), meta])
+    return result
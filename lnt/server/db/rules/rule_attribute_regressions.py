@@ -0,0 +1,36 @@
+"""
+Post submission hook to attribute the field changes found in a run to the
+functions of the test's profiles (see lnt.server.db.profileattribution).
+"""
+import time
+
+from lnt.server.db.profileattribution import attribute_field_change
+from lnt.util import logger
+
+# Seconds spent at most on one field change, and on all of those of a run;
+# the changes left over once it is spent are not attributed.
+CHANGE_BUDGET = 1.0
+RUN_BUDGET = 10.0
+
+
+def attribute_regressions(session, ts, run_id):
+    config = ts.v4db.config
+    if config is None or not config.profileDir:
+        return
+
+    changes = session.query(ts.FieldChange) \
+        .filter(ts.FieldChange.run_id == run_id) \
+        .filter(ts.FieldChange.attribution_data.is_(None)) \
+        .all()
+    deadline = time.time() + RUN_BUDGET
+    for i, fc in enumerate(changes):
+        left = deadline - time.time()
+        if left <= 0:
+            logger.warning("Left %d field changes of run %d unattributed",
+                           len(changes) - i, run_id)
+            break
+        attribute_field_change(session, ts, fc, min(CHANGE_BUDGET, left))
+    session.commit()
+
+
+post_submission_hook = attribute_regressions
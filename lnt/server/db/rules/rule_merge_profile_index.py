@@ -0,0 +1,17 @@
+"""
+Post submission hook to merge the segments that submissions added to the
+profile index (see lnt.server.db.profileindex). Merging can take a while, so
+it is done in the background, once for a burst of submissions.
+"""
+from lnt.server.db.profileindex import ProfileIndex
+
+
+def merge_profile_index(session, ts, run_id):
+    config = ts.v4db.config
+    if config is None or not config.profileDir:
+        return
+    ProfileIndex.forTestSuite(ts).merge()
+
+
+post_submission_hook = merge_profile_index
+deferrable = True
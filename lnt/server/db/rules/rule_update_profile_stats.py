@@ -1,6 +1,7 @@
 """
 Post submission hook to write the current state of the profiles directory. This
-gets fed into the profile/admin page.
+gets fed into the profile/admin page. Walking the directory is slow, so it is
+only done once for a burst of submissions.
 """
 import glob
 import json
@@ -46,3 +47,4 @@ def update_profile_stats(session, ts, run_id):
 
 
 post_submission_hook = update_profile_stats
+deferrable = True
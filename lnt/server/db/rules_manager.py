@@ -1,8 +1,22 @@
 """
 Define facilities for automatically applying rules to data.
+
+Besides its hooks, a rule script may define:
+
+depends_on -- the names of the rules whose post submission hooks must have
+              run before its own. Post submission hooks that do not depend on
+              each other are run concurrently, each with its own session.
+deferrable -- if true, its post submission hook is not run while the run is
+              being submitted but a little later, in the background, and only
+              once for all the runs submitted in the meantime (with the ID of
+              the last one).
 """
+import atexit
 import os
 import re
+import threading
+import time
+from concurrent.futures import ThreadPoolExecutor
 
 from typing import Callable, Dict, List
 
@@ -59,6 +73,19 @@ HOOKS = {
 DESCRIPTIONS = {}
 HOOKS_LOADED = False
 
+# The rule name, dependencies and deferrability of each hook.
+RULES = {}  # type: Dict[Callable, Dict]
+
+# Timing of the post submission hooks, by rule name.
+STATS = {}  # type: Dict[str, Dict]
+_stats_lock = threading.Lock()
+
+# The most post submission hooks run at once.
+MAX_WORKERS = 4
+
+# How long deferred hooks wait for more submissions before running.
+DEFER_DELAY = 10.0
+
 
 def register_hooks():
     """Exec all the rules files.  Gather the hooks from them
@@ -73,16 +100,152 @@ def register_hooks():
         for hook_name in HOOKS.keys():
             if hook_name in globals:
                 HOOKS[hook_name].append(globals[hook_name])
+                RULES[globals[hook_name]] = {
+                    'name': name,
+                    'depends_on': list(globals.get('depends_on', [])),
+                    'deferrable': bool(globals.get('deferrable', False)),
+                }
     HOOKS_LOADED = True
     return HOOKS
 
 
+def _rule(func):
+    return RULES.get(func, {'name': func.__name__, 'depends_on': [],
+                            'deferrable': False})
+
+
+def _schedule(funcs):
+    """
+    Order funcs, post submission hooks, in stages: lists of hooks that only
+    depend on hooks of earlier stages.
+    """
+    by_name = {_rule(f)['name']: f for f in funcs}
+    pending = list(funcs)
+    done = set()
+    stages = []
+    while pending:
+        stage = [f for f in pending
+                 if all(d in done or d not in by_name
+                        for d in _rule(f)['depends_on'])]
+        if not stage:
+            logger.warning("Rules %s depend on each other; running them "
+                           "one at a time" %
+                           ", ".join(_rule(f)['name'] for f in pending))
+            stages.extend([f] for f in pending)
+            break
+        stages.append(stage)
+        done.update(_rule(f)['name'] for f in stage)
+        pending = [f for f in pending if f not in stage]
+    return stages
+
+
+def _run_hook(func, session, ts, run_id):
+    """Run one post submission hook, keeping track of how long it takes."""
+    start = time.time()
+    try:
+        func(session, ts, run_id)
+    finally:
+        elapsed = time.time() - start
+        with _stats_lock:
+            stats = STATS.setdefault(_rule(func)['name'], {
+                'calls': 0, 'total': 0.0, 'max': 0.0, 'last': 0.0})
+            stats['calls'] += 1
+            stats['total'] += elapsed
+            stats['max'] = max(stats['max'], elapsed)
+            stats['last'] = elapsed
+
+
+def _run_hook_in_session(func, ts, run_id):
+    session = ts.v4db.make_session()
+    try:
+        _run_hook(func, session, ts, run_id)
+    finally:
+        session.close()
+
+
 def post_submission_hooks(session, ts, run_id):
     """Run all the post submission hooks on the submitted run."""
     if not HOOKS_LOADED:
         logger.error("Running Hooks without loading them first.")
+    funcs = []
     for func in HOOKS['post_submission_hook']:
-        func(session, ts, run_id)
+        if _rule(func)['deferrable']:
+            _defer(func, ts, run_id)
+        else:
+            funcs.append(func)
+
+    # SQLite serializes writers anyway, so do not bother with threads.
+    if ts.v4db.engine.dialect.name == 'sqlite':
+        for func in funcs:
+            _run_hook(func, session, ts, run_id)
+        return
+
+    with ThreadPoolExecutor(max_workers=MAX_WORKERS) as pool:
+        for stage in _schedule(funcs):
+            if len(stage) == 1:
+                _run_hook(stage[0], session, ts, run_id)
+                continue
+            futures = [pool.submit(_run_hook_in_session, func, ts, run_id)
+                       for func in stage]
+            # Raise the first error, once all the hooks of the stage are done.
+            for future in futures:
+                future.exception()
+            for future in futures:
+                future.result()
+
+
+# Deferred post submission hooks, by (database path, test suite, rule): the
+# database settings, test suite name, hook and ID of the last run.
+_deferred = {}
+_deferred_cond = threading.Condition()
+_deferred_thread = None
+_last_deferred = 0.0
+
+
+def _defer(func, ts, run_id):
+    global _deferred_thread, _last_deferred
+    settings = ts.v4db.settings()
+    key = (settings['path'], ts.name, _rule(func)['name'])
+    with _deferred_cond:
+        _deferred[key] = (settings, ts.name, func, run_id)
+        _last_deferred = time.time()
+        if _deferred_thread is None:
+            _deferred_thread = threading.Thread(target=_deferred_loop,
+                                                name='lnt-deferred-rules')
+            _deferred_thread.daemon = True
+            _deferred_thread.start()
+        _deferred_cond.notify()
+
+
+def _deferred_loop():
+    while True:
+        with _deferred_cond:
+            while not _deferred or \
+                    time.time() - _last_deferred < DEFER_DELAY:
+                _deferred_cond.wait(DEFER_DELAY if _deferred else None)
+        run_deferred_hooks()
+
+
+def run_deferred_hooks():
+    """Run the deferred post submission hooks that are waiting now."""
+    with _deferred_cond:
+        pending = list(_deferred.values())
+        _deferred.clear()
+    if not pending:
+        return
+    import lnt.server.db.v4db
+    for settings, ts_name, func, run_id in pending:
+        db = lnt.server.db.v4db.V4DB(**settings)
+        try:
+            _run_hook_in_session(func, db.testsuite[ts_name], run_id)
+        except Exception:
+            logger.exception("Deferred rule %s failed" % _rule(func)['name'])
+        finally:
+            db.close()
+
+
+# Do not lose the hooks that were deferred by a short-lived process.
+atexit.register(run_deferred_hooks)
 
 
 def is_useful_change(session, ts, field_change):
@@ -19,6 +19,8 @@ from sqlalchemy.orm.exc import ObjectDeletedError
 from lnt.util import logger
 
 from . import testsuite
+from .profileindex import ProfileIndex
+from .profiletimeseries import ProfileTimeSeries
 import lnt.testing.profile.profile as profile
 import lnt
 from lnt.server.ui.util import convert_revision
@@ -459,17 +461,23 @@ class TestSuiteDB(object):
                 self.created_time = datetime.datetime.now()
                 self.accessed_time = datetime.datetime.now()
 
+                profileDir = None
+                prefix = ''
                 if config is not None:
                     profileDir = config.config.profileDir
                     prefix = 't-%s-s-' % os.path.basename(testid)
-                    self.filename = \
-                        profile.Profile.saveFromRendered(encoded,
-                                                         profileDir=profileDir,
-                                                         prefix=prefix)
 
-                p = profile.Profile.fromRendered(encoded)
+                # Save the profile and read its counters in one go, without
+                # decoding or deserializing it a second time.
+                filename, summary = \
+                    profile.Profile.ingestRendered(encoded,
+                                                   profileDir=profileDir,
+                                                   prefix=prefix)
+                if config is not None:
+                    self.filename = filename
+
                 s = ','.join('%s=%s' % (k, v)
-                             for k, v in p.getTopLevelCounters().items())
+                             for k, v in summary['counters'].items())
                 self.counters = s[:512]
 
             def getTopLevelCounters(self):
@@ -617,6 +625,10 @@ class TestSuiteDB(object):
                               ForeignKey(testsuite.SampleField.id))
             # Could be from many runs, but most recent one is interesting.
             run_id = Column("RunID", Integer, ForeignKey(Run.id))
+            # The functions whose profiles changed the most between the two
+            # orders, as a JSON encoded blob (see
+            # lnt.server.db.profileattribution).
+            attribution_data = Column("Attribution", Binary)
 
             start_order = relation(Order, primaryjoin='FieldChange.'
                                    'start_order_id==Order.id')
@@ -640,6 +652,17 @@ class TestSuiteDB(object):
                                     (self.start_order, self.end_order,
                                      self.test, self.machine, self.field))
 
+            @property
+            def attribution(self):
+                """dictionary access to the BLOB encoded attribution data"""
+                if self.attribution_data is None:
+                    return None
+                return json.loads(self.attribution_data)
+
+            @attribution.setter
+            def attribution(self, data):
+                self.attribution_data = json.dumps(data).encode("utf-8")
+
             def __json__(self):
                 return {
                     'id': self.id,
@@ -651,6 +674,7 @@ class TestSuiteDB(object):
                     'machine_id': self.machine_id,
                     'field_id': self.field_id,
                     'run_id': self.run_id,
+                    'attribution': self.attribution,
                 }
 
         Machine.fieldchanges = relation(FieldChange, back_populates='machine',
@@ -1130,6 +1154,41 @@ class TestSuiteDB(object):
         self._importSampleValues(session, data['tests'], run, config)
         return run
 
+    def indexProfiles(self, session, run_id):
+        """
+        Add the functions of the profiles of run run_id to the profile index
+        (see lnt.server.db.profileindex) and their hottest functions to the
+        profile time series (see lnt.server.db.profiletimeseries). The run
+        must have been committed.
+        """
+        config = self.v4db.config
+        if config is None or not config.profileDir:
+            return
+        profiles = session.query(self.Profile.id, self.Profile.filename,
+                                 self.Sample.test_id, self.Run.machine_id) \
+            .join(self.Sample, self.Sample.profile_id == self.Profile.id) \
+            .join(self.Run, self.Run.id == self.Sample.run_id) \
+            .filter(self.Sample.run_id == run_id) \
+            .distinct().all()
+
+        timeseries = ProfileTimeSeries.forTestSuite(self)
+        entries = []
+        for profile_id, filename, test_id, machine_id in profiles:
+            if not filename:
+                continue
+            try:
+                # Only the functions are read, not their instructions.
+                summary = profile.Profile.peekFile(
+                    os.path.join(config.profileDir, filename), functions=True)
+            except Exception:
+                logger.warning("Could not index profile %s", filename)
+                continue
+            functions = summary.get('functions', {})
+            entries.append((profile_id, functions))
+            timeseries.add(machine_id, test_id, run_id, functions,
+                           summary.get('absolute-counters', []))
+        ProfileIndex.forTestSuite(self).add(entries)
+
     # Simple query support (mostly used by templates)
 
     def machines(self, session, name=None):
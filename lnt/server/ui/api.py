@@ -1,4 +1,5 @@
 import lnt.util.ImportData
+import lnt.server.db.columnar
 import sqlalchemy
 from flask import current_app, g, Response, make_response, stream_with_context
 from flask import json, jsonify
@@ -7,6 +8,8 @@ from flask_restful import Resource, abort
 from sqlalchemy.orm import joinedload
 from sqlalchemy.orm.exc import NoResultFound
 
+from lnt.server.db.profileindex import ProfileIndex
+from lnt.server.db.profiletimeseries import ProfileTimeSeries, downsample
 from lnt.server.ui.util import convert_revision
 from lnt.server.ui.decorators import in_db
 from lnt.testing import PASS
@@ -415,6 +418,140 @@ class SamplesData(Resource):
         return result
 
 
+class Export(Resource):
+    """Export the samples or profiles of a test suite in a columnar format."""
+    method_decorators = [in_db]
+
+    @staticmethod
+    def get():
+        """
+        Stream the samples (or, with kind=profiles, the functions of their
+        profiles) as an Arrow IPC stream, or a Parquet file with
+        format=parquet.
+        """
+        session = request.session
+        ts = request.get_testsuite()
+        kind = request.args.get('kind', 'samples')
+        fmt = request.args.get('format', 'arrow')
+        try:
+            stream = lnt.server.db.columnar.export(session, ts, kind, fmt)
+        except ValueError as e:
+            abort(400, msg=str(e))
+        return Response(stream_with_context(stream),
+                        mimetype="application/octet-stream")
+
+
+class ProfileSearch(Resource):
+    """Find the profiles in which a function is hot."""
+    method_decorators = [in_db]
+
+    @staticmethod
+    def get():
+        """
+        Find the samples whose profiles have a function taking between 'min'
+        and 'max' percent of a counter ('counter', or any), most first:
+        profile/search?function=main&counter=cycles&min=5&limit=100
+        """
+        session = request.session
+        ts = request.get_testsuite()
+        function = request.args.get('function')
+        if not function:
+            abort(400, msg='No function found in args. '
+                           'Should be "profile/search?function=main" etc.')
+        counter = request.args.get('counter')
+        try:
+            min_percentage = float(request.args.get('min', 0.0))
+            max_percentage = float(request.args.get('max', float('inf')))
+            limit = int(request.args.get('limit', 1000))
+        except ValueError:
+            abort(400, msg='min and max must be numbers, limit an integer.')
+
+        hits = ProfileIndex.forTestSuite(ts).search(
+            function, counter, min_percentage, max_percentage)
+        hits = sorted(((percentage, profile_id, c)
+                       for c, profiles in hits.items()
+                       for profile_id, percentage in profiles.items()),
+                      reverse=True)[:limit]
+
+        # Profiles of deleted runs may still be in the index; they have no
+        # samples any more.
+        samples = {}
+        profile_ids = sorted({h[1] for h in hits})
+        for i in range(0, len(profile_ids), 500):
+            q = session.query(ts.Sample.id,
+                              ts.Sample.profile_id,
+                              ts.Sample.run_id,
+                              ts.Test.name.label('test'),
+                              ts.Machine.name.label('machine')) \
+                .join(ts.Test) \
+                .join(ts.Run) \
+                .join(ts.Machine) \
+                .filter(ts.Sample.profile_id.in_(profile_ids[i:i + 500]))
+            for sample in q:
+                samples.setdefault(sample.profile_id, []).append(sample)
+
+        result = common_fields_factory()
+        result['profiles'] = [
+            {'sample_id': sample.id, 'run_id': sample.run_id,
+             'test': sample.test, 'machine': sample.machine,
+             'function': function, 'counter': c, 'percentage': percentage}
+            for percentage, profile_id, c in hits
+            for sample in samples.get(profile_id, [])]
+        return result
+
+
+class ProfileGraph(Resource):
+    """Time series of the hottest functions of a test's profiles."""
+    method_decorators = [in_db]
+
+    @staticmethod
+    def get(machine_id, test_id):
+        """
+        Get the share of a counter ('counter', cycles by default) taken by
+        'function' in the profiles of a test on a machine, in the same shape
+        as the graph API, averaged down to at most 'points' points if given.
+        Without a function, list the functions that have a time series.
+        """
+        session = request.session
+        ts = request.get_testsuite()
+        timeseries = ProfileTimeSeries.forTestSuite(ts)
+        function = request.args.get('function')
+        if not function:
+            result = common_fields_factory()
+            result['functions'] = timeseries.functions(machine_id, test_id)
+            return result
+        counter = request.args.get('counter', 'cycles')
+        try:
+            limit = int(request.args.get('limit', 0))
+            points = int(request.args.get('points', 0))
+        except ValueError:
+            abort(400, msg='limit and points must be integers.')
+
+        series = timeseries.get(machine_id, test_id, function, counter)
+        runs = {}
+        run_ids = sorted({run_id for run_id, _ in series})
+        for i in range(0, len(run_ids), 500):
+            q = session.query(ts.Run.id, ts.Order.llvm_project_revision,
+                              ts.Run.start_time) \
+                .join(ts.Order) \
+                .filter(ts.Run.machine_id == machine_id) \
+                .filter(ts.Run.id.in_(run_ids[i:i + 500]))
+            for rid, rev, time in q:
+                runs[rid] = (rev, time)
+
+        # Points of deleted runs are left out.
+        samples = [
+            [runs[rid][0], val,
+             {'label': runs[rid][0], 'date': str(runs[rid][1]),
+              'runID': str(rid)}]
+            for rid, val in series if rid in runs
+        ]
+        samples.sort(key=lambda x: convert_revision(x[0]))
+        if limit:
+            samples = samples[-limit:]
+        return downsample(samples, points)
+
+
 class Graph(Resource):
     """List all the machines and give summary information."""
     method_decorators = [in_db]
@@ -542,6 +679,10 @@ def load_api_resources(api):
     api.add_resource(SampleData, ts_path("samples/<sample_id>"))
     api.add_resource(Schema, ts_path("schema"), ts_path("schema/"))
     api.add_resource(Order, ts_path("orders/<int:order_id>"))
+    api.add_resource(Export, ts_path("export"))
+    api.add_resource(ProfileSearch, ts_path("profile/search"))
+    api.add_resource(ProfileGraph,
+                     ts_path("profile/graph/<int:machine_id>/<int:test_id>"))
     graph_url = "graph/<int:machine_id>/<int:test_id>/<int:field_index>"
     api.add_resource(Graph, ts_path(graph_url))
     regression_url = \
@@ -2,13 +2,16 @@ from flask import abort
 from flask import request
 from sqlalchemy.orm.exc import NoResultFound
 
-from flask import render_template, current_app
+from flask import render_template, current_app, make_response
+import hashlib
 import os
 import json
 import urllib
+from lnt.server.ui import profile_wire
 from lnt.server.ui.decorators import v4_route, frontend
 from lnt.server.ui.globals import v4_url_for
 from lnt.server.ui.views import ts_data
+from lnt.testing.profile.profile import CODE_VERSION, Profile
 
 
 def _get_sample(session, ts, run_id, test_id):
@@ -110,15 +113,61 @@ def v4_profile_ajax_getCodeForFunction():
     runid = request.args.get('runid')
     testid = request.args.get('testid')
     f = urllib.parse.unquote(request.args.get('f'))
+    # format=binary selects the encoding of profile_wire instead of JSON,
+    # and delta=1 its delta encoding of addresses.
+    binary = request.args.get('format') == 'binary'
+    delta = request.args.get('delta') == '1'
 
-    profileDir = current_app.old_config.profileDir
+    config = current_app.old_config
+    profileDir = config.profileDir
 
     sample = _get_sample(session, ts, runid, testid)
     if not sample or not sample.profile:
         abort(404)
 
+    # A stored profile never changes, so neither does the code of its
+    # functions, as long as the server's code and settings stay the same.
+    key = [sample.profile.id, sample.profile.filename, f, binary, delta,
+           profile_wire.VERSION, CODE_VERSION, config.objdump,
+           config.binaryCacheRoot, os.getenv('LNT_DISASSEMBLER', 'objdump')]
+    etag = hashlib.sha1(json.dumps(key).encode('utf-8')).hexdigest()
+    # Only the header of the profile is read to know whether its code is
+    # disassembled here, so that a revalidation costs little.
+    detail = Profile.peekFile(os.path.join(profileDir,
+                                           sample.profile.filename),
+                              detail=True)['detail']
+    deferred = detail == 'addresses'
+    if not deferred and request.if_none_match.contains(etag):
+        return _immutable(make_response('', 304), etag)
+
     p = sample.profile.load(profileDir)
-    return json.dumps([x for x in p.getCodeForFunction(f)])
+    if detail == 'functions':
+        # Function-level profiles carry no per-instruction data.
+        code = []
+    else:
+        # Profiles imported with detail 'addresses' are disassembled here,
+        # on first view, from the binaries under binary_cache_root.
+        code = p.getCodeForFunction(f, objdump=config.objdump,
+                                    binaryCacheRoot=config.binaryCacheRoot)
+    if binary:
+        response = make_response(profile_wire.encodeCode(code, delta))
+        response.mimetype = profile_wire.MIME_TYPE
+    else:
+        response = make_response(json.dumps([x for x in code]))
+    if deferred:
+        # The binary may only be added to binary_cache_root later, so the
+        # code is revalidated against a hash of the response every time.
+        response.headers['Cache-Control'] = 'private, no-cache'
+        response.add_etag()
+        return response.make_conditional(request)
+    return _immutable(response, etag)
+
+
+def _immutable(response, etag):
+    response.set_etag(etag)
+    response.headers['Cache-Control'] = \
+        'private, max-age=31536000, immutable'
+    return response
 
 
 @v4_route("/profile/<int:testid>/<int:run1_id>")
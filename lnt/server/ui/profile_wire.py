@@ -0,0 +1,151 @@
+"""
+A compact binary encoding of the code of a profiled function, as returned by
+ProfileImpl.getCodeForFunction(), for the profile viewer.
+
+The JSON encoding of the same (counters, address, text) tuples repeats every
+counter name on every instruction. Here each column is stored once as a typed
+array instead, and identical instruction texts are stored only once. All
+integers and floats are little-endian, and every array starts at a multiple
+of its element size, so that a client can read it in place:
+
+  header          magic b'LNTC', version and flags (uint8s), 2 reserved
+                  bytes, then # instructions, # counters, # texts and the
+                  size of the text table (uint32s)
+  counters        for each: length (uint16), UTF-8 name; padded to 8 bytes
+  values          for each counter, # instructions float64s; NaN where the
+                  instruction has no value for the counter
+  addresses       # instructions uint64s or, if FLAG_DELTA is set, the first
+                  address (uint64) followed by the difference of each other
+                  address to the one before it (int32s)
+  text indexes    # instructions uint32s
+  text offsets    # texts + 1 uint32s, into the text table
+  text table      the UTF-8 texts, one after the other
+"""
+import struct
+import sys
+from array import array
+
+MAGIC = b'LNTC'
+VERSION = 1
+
+# The addresses are stored as differences to the address before them.
+FLAG_DELTA = 1
+
+MIME_TYPE = 'application/x-lnt-profile-code'
+
+_HEADER = struct.Struct('<4sBBHIIII')
+_U16 = struct.Struct('<H')
+_U64 = struct.Struct('<Q')
+_NAN = float('nan')
+
+
+def _bytes(a):
+    """Return the contents of array a in little-endian byte order."""
+    if sys.byteorder != 'little':
+        a = array(a.typecode, a)
+        a.byteswap()
+    return a.tobytes()
+
+
+def _array(typecode, data, off, n):
+    a = array(typecode)
+    a.frombytes(data[off:off + n * a.itemsize])
+    if sys.byteorder != 'little':
+        a.byteswap()
+    return a, off + n * a.itemsize
+
+
+def encodeCode(code, delta=False):
+    """
+    Encode code, an iterable of (counters, address, text) tuples, to bytes.
+    If delta is true, the addresses are stored as differences where they all
+    fit in 32 bits.
+    """
+    code = list(code)
+    n = len(code)
+    names = sorted(set(name for counters, _, _ in code for name in counters))
+    columns = {name: array('d', [_NAN]) * n for name in names}
+    addresses = array('Q')
+    text_ids = {}
+    text_indexes = array('I')
+    offsets = array('I', [0])
+    texts = []
+    for i, (counters, address, text) in enumerate(code):
+        for name, value in counters.items():
+            columns[name][i] = value
+        addresses.append(address)
+        if text not in text_ids:
+            text_ids[text] = len(texts)
+            texts.append(text.encode('utf-8'))
+            offsets.append(offsets[-1] + len(texts[-1]))
+        text_indexes.append(text_ids[text])
+
+    flags = 0
+    if delta and n:
+        deltas = [b - a for a, b in zip(addresses, addresses[1:])]
+        if all(-2**31 <= d < 2**31 for d in deltas):
+            flags |= FLAG_DELTA
+
+    out = [_HEADER.pack(MAGIC, VERSION, flags, 0, n, len(names), len(texts),
+                        offsets[-1])]
+    size = _HEADER.size
+    for name in names:
+        encoded = name.encode('utf-8')
+        out.append(_U16.pack(len(encoded)) + encoded)
+        size += _U16.size + len(encoded)
+    out.append(b'\0' * (-size % 8))
+    out.extend(_bytes(columns[name]) for name in names)
+    if flags & FLAG_DELTA:
+        out.append(_U64.pack(addresses[0]))
+        out.append(_bytes(array('i', deltas)))
+    else:
+        out.append(_bytes(addresses))
+    out.append(_bytes(text_indexes))
+    out.append(_bytes(offsets))
+    out.extend(texts)
+    return b''.join(out)
+
+
+def decodeCode(data):
+    """
+    Decode bytes produced by encodeCode() back to a list of (counters,
+    address, text) tuples.
+    """
+    magic, version, flags, _, n, n_counters, n_texts, text_size = \
+        _HEADER.unpack_from(data, 0)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError("not an encoded profile function")
+    off = _HEADER.size
+    names = []
+    for _ in range(n_counters):
+        length, = _U16.unpack_from(data, off)
+        off += _U16.size
+        names.append(data[off:off + length].decode('utf-8'))
+        off += length
+    off += -off % 8
+    columns = []
+    for _ in names:
+        column, off = _array('d', data, off, n)
+        columns.append(column)
+    if flags & FLAG_DELTA:
+        address, = _U64.unpack_from(data, off)
+        deltas, off = _array('i', data, off + _U64.size, max(n - 1, 0))
+        addresses = [address]
+        for d in deltas:
+            address += d
+            addresses.append(address)
+    else:
+        addresses, off = _array('Q', data, off, n)
+    text_indexes, off = _array('I', data, off, n)
+    offsets, off = _array('I', data, off, n_texts + 1)
+    texts = [data[off + offsets[i]:off + offsets[i + 1]].decode('utf-8')
+             for i in range(n_texts)]
+
+    code = []
+    for i in range(n):
+        counters = {}
+        for name, column in zip(names, columns):
+            if column[i] == column[i]:
+                counters[name] = column[i]
+        code.append((counters, addresses[i], texts[text_indexes[i]]))
+    return code
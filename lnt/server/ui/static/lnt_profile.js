@@ -480,24 +480,55 @@ Profile.prototype = {
     _fetch_and_display: function(fname, then) {
         this.function_name = fname;
         var this_ = this;
-        $.ajax(g_urls.getCodeForFunction, {
-            dataType: "json",
-            data: {'runid': this.runid, 'testid': this.testid,
-                   'f': encodeURIComponent(fname)},
-            success: function(data) {
-                this_.data = data;
-                this_._display();
-            },
-            error: function(xhr, textStatus, errorThrown) {
-                pf_flash_error('accessing URL ' + g_urls.getCodeForFunction +
-                               '; ' + errorThrown);
+        var data = {'runid': this.runid, 'testid': this.testid,
+                    'f': encodeURIComponent(fname)};
+        var error = function(xhr, textStatus, errorThrown) {
+            pf_flash_error('accessing URL ' + g_urls.getCodeForFunction +
+                           '; ' + errorThrown);
+        };
+        if (!window.DataView || !window.TextDecoder) {
+            $.ajax(g_urls.getCodeForFunction, {
+                dataType: "json",
+                data: data,
+                success: function(data) {
+                    this_.data = data;
+                    this_._display();
+                },
+                error: error
+            });
+            return;
+        }
+
+        // Fetch the code in the binary encoding, which is much smaller and
+        // quicker to decode than the JSON one for large functions. jQuery
+        // cannot return an ArrayBuffer, so do it by hand.
+        data['format'] = 'binary';
+        data['delta'] = '1';
+        var xhr = new XMLHttpRequest();
+        xhr.open('GET', g_urls.getCodeForFunction + '?' + $.param(data));
+        xhr.responseType = 'arraybuffer';
+        xhr.onload = function() {
+            if (xhr.status != 200) {
+                error(xhr, 'error', xhr.statusText);
+                return;
             }
-        });
+            this_.data = pf_decode_code(xhr.response);
+            this_._display();
+        };
+        xhr.onerror = function() {
+            error(xhr, 'error', xhr.statusText);
+        };
+        xhr.send();
     },
 
     _display: function() {
         try {
-            if (startsWith(this.displayType, 'cfg')) {
+            if (this.data.length == 0) {
+                $(this.element).html(
+                    '<center><i>No instruction-level data is available ' +
+                    'for this function.<br>The profile may have been ' +
+                    'imported at function level only.</i></center>');
+            } else if (startsWith(this.displayType, 'cfg')) {
                 var instructionSet = this.displayType.split('-')[1];
                 this._display_cfg(instructionSet);
             } else
@@ -1440,6 +1471,73 @@ function pf_flash_warning(msg) {
     $('#flashes').append(txt);
 }
 
+// pf_decode_code - decode the binary encoding of getCodeForFunction (see
+// profile_wire.py) to the same list of [counters, address, text] as its
+// JSON encoding.
+function pf_decode_code(buffer) {
+    var view = new DataView(buffer);
+    var decoder = new TextDecoder('utf-8');
+    // Read a little-endian uint64 as a number, like JSON.parse does.
+    var getUint64 = function(off) {
+        return view.getUint32(off, true) +
+            view.getUint32(off + 4, true) * 4294967296;
+    };
+    if (decoder.decode(new Uint8Array(buffer, 0, 4)) != 'LNTC' ||
+        view.getUint8(4) != 1)
+        throw new Error('unknown encoding of profile code');
+    var flags = view.getUint8(5);
+    var n = view.getUint32(8, true);
+    var nCounters = view.getUint32(12, true);
+    var nTexts = view.getUint32(16, true);
+    var off = 24;
+
+    var names = [];
+    for (var i = 0; i < nCounters; ++i) {
+        var len = view.getUint16(off, true);
+        names.push(decoder.decode(new Uint8Array(buffer, off + 2, len)));
+        off += 2 + len;
+    }
+    off += (8 - off % 8) % 8;
+
+    var code = [];
+    for (var i = 0; i < n; ++i)
+        code.push([{}, 0, '']);
+    for (var c = 0; c < nCounters; ++c) {
+        for (var i = 0; i < n; ++i, off += 8) {
+            var value = view.getFloat64(off, true);
+            if (!isNaN(value))
+                code[i][0][names[c]] = value;
+        }
+    }
+    if (flags & 1) {
+        var address = n ? getUint64(off) : 0;
+        off += 8;
+        for (var i = 0; i < n; ++i) {
+            if (i > 0) {
+                address += view.getInt32(off, true);
+                off += 4;
+            }
+            code[i][1] = address;
+        }
+    } else {
+        for (var i = 0; i < n; ++i, off += 8)
+            code[i][1] = getUint64(off);
+    }
+
+    var textsOff = off + 4 * n;
+    var tableOff = textsOff + 4 * (nTexts + 1);
+    var texts = [];
+    for (var t = 0; t < nTexts; ++t) {
+        var start = view.getUint32(textsOff + 4 * t, true);
+        var end = view.getUint32(textsOff + 4 * (t + 1), true);
+        texts.push(decoder.decode(
+            new Uint8Array(buffer, tableOff + start, end - start)));
+    }
+    for (var i = 0; i < n; ++i, off += 4)
+        code[i][2] = texts[view.getUint32(off, true)];
+    return code;
+}
+
 var g_counter;
 var g_all_counters = [];
 // FIXME: misnomer?
@@ -1776,8 +1776,11 @@ You must define a summary report configuration first.""")
 
 @frontend.route('/rules')
 def rules():
-    discovered_rules = lnt.server.db.rules_manager.DESCRIPTIONS
-    return render_template("rules.html", rules=discovered_rules)
+    rules_manager = lnt.server.db.rules_manager
+    discovered_rules = rules_manager.DESCRIPTIONS
+    options = {r['name']: r for r in rules_manager.RULES.values()}
+    return render_template("rules.html", rules=discovered_rules,
+                           options=options, stats=rules_manager.STATS)
 
 
 @frontend.route('/log')
@@ -46,6 +46,110 @@
 // ProfileV1 form (see profile.py and profilev1impl.py). The only difference is
 // that all counters are absolute.
 //
+// If importPerf is called with detail='functions', the per-PC lookup and
+// objdump disassembly are skipped entirely: only the per-symbol totals are
+// emitted, and the resulting profile is marked as function-level.
+//
+// With detail='addresses', the per-PC counters are emitted but disassembly is
+// still skipped. Instead each function records the binary it came from (and
+// its build-id, if perf recorded one) together with its address range, so that
+// the text can be produced later with cPerf.disassemble() when the profile is
+// actually viewed.
+//
+// cPerf.iterFunctions() does the same as importPerf(), but returns an iterator
+// that emits (and disassembles) one function at a time, as a (name, function)
+// pair. Only the top-level data (its 'info') is created up front, so a caller
+// that writes each function out as it comes (see ProfileV2Writer) never holds
+// more than one function's worth of Python objects.
+//
+// With columnar=True, no Python object is created per instruction. Instead,
+// every function gets three cPerf.Column objects, which expose contiguous
+// uint64 arrays through the buffer protocol (so memoryview() or numpy can view
+// them without copying):
+//
+//   'addresses'      - one address per instruction.
+//   'counter-matrix' - instructions x counters, with columns in the order of
+//                      the top-level 'counter-names' list.
+//   'text-offsets'   - one offset per instruction into the top-level
+//                      'text-pool' bytes object (NUL-terminated strings).
+//
+// Disassembly
+// -----------
+//
+// If cPerf was built against LLVM (setup.py defines HAVE_LLVM_DISASSEMBLER
+// when it finds llvm-config) and disassembler='auto' is asked for,
+// instructions are decoded in-process with the LLVM-C disassembler, straight
+// from the ELF file's loadable segments. This avoids a fork and text parsing
+// per symbol, and works for every target LLVM was built with, whatever the
+// host. Binaries that are not little-endian ELF files for a known machine
+// fall back to running objdump. The text differs from objdump's, so that it
+// cannot be compared with that of profiles imported before: objdump remains
+// the default.
+//
+// Group reads
+// -----------
+//
+// If samples read the counters of their event group (PERF_SAMPLE_READ with
+// PERF_FORMAT_ID), each member of the group is attributed to the sample's PC
+// with what it counted since the previous read, instead of the sample counting
+// its period for the sampling event only. Every counter of the group is then
+// known exactly per instruction, which is what ratios such as IPC need (these
+// are derived in perf.py).
+//
+// Sample weights
+// --------------
+//
+// If samples carry a weight (PERF_SAMPLE_WEIGHT or PERF_SAMPLE_WEIGHT_STRUCT,
+// as recorded by 'perf mem' and other load-latency sampling), the weights are
+// collected in log-bucketed histograms per PC. Every kept function and every
+// instruction with weighted samples then gets 'latency-mean', 'latency-p50'
+// and 'latency-p99' counters, and so does the profile as a whole. These are
+// listed in the result's 'absolute-counters', as they are not event counts
+// and must not be turned into percentages.
+//
+// Data objects
+// ------------
+//
+// With dataObjects=True, the data address (PERF_SAMPLE_ADDR) of each sample is
+// aggregated as well, against the non-executable mappings perf recorded
+// ('perf record -d' or 'perf mem record'). Addresses in file-backed mappings
+// are resolved to the STT_OBJECT symbols of the binary, with the same sorted
+// walk over symbols as code; all other addresses (heap, stack, anonymous
+// memory) and those outside any object are grouped by 4K page. Each data
+// object above the 0.5% threshold is emitted in the result's 'data-objects'
+// with its event counters and, if perf recorded PERF_SAMPLE_DATA_SRC, the
+// number of samples served by each level of the memory hierarchy ('L1', 'L2',
+// 'RAM', 'L3-miss', ...).
+//
+// JIT code
+// --------
+//
+// Samples that fall outside any file-backed mapping (or in an anonymous one)
+// are looked up in the symbols the process's JIT published: perf's
+// /tmp/perf-<pid>.map files, and jitdump files, whose location perf records
+// because the JIT maps them executable. All JIT code of a process is gathered
+// in one pseudo-map named "[jit-<pid>]", so it is subject to the 1% threshold
+// as a whole. jitdump code-load records carry the code itself, which is
+// disassembled like any other symbol (objdump is given it as a raw binary).
+// Functions only named in a perf map have no code, so only their sampled
+// addresses are emitted. Both files are looked for under binaryCacheRoot.
+//
+// ProfileV2 files
+// ---------------
+// If cPerf was built with libbz2 (setup.py defines HAVE_BZLIB when it finds
+// it), cPerf.serializeProfileV2() writes a ProfileV2 file from the data of any
+// profile, byte for byte as ProfileV2.serialize() would in Python. The
+// per-instruction sections are encoded in one pass over each function's code
+// and then compressed concurrently, without holding the GIL.
+//
+// Input
+// -----
+// Regular files are mapped, and their data section read with readahead
+// hints. Files on network filesystems or too large to map are read with
+// pread() in chunks, a thread reading the next chunk meanwhile; pipes (and
+// "-", the standard input) are read into memory as a whole. See
+// PerfInput::open().
+//
 // [1]: Perf will start sampling from the moment the perf wrapper tool is
 // invoked, and its samples will continue until the perf wrapper tool exits.
 // This means that it will often take one or two samples in intermediate
@@ -60,31 +164,57 @@
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #define _CRT_SECURE_NO_WARNINGS
-#define strtok_r strtok_s
 #include <windows.h>
 #include <BaseTsd.h>
+#include <io.h>
 typedef SSIZE_T ssize_t;
 #define PROT_EXEC 4
 #endif
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <condition_variable>
 #include <cstring>
 #include <exception>
 #include <fcntl.h>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <set>
 #include <sstream>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #ifndef _WIN32
+#include <spawn.h>
 #include <sys/mman.h>
 #include <sys/wait.h>
 #include <unistd.h>
+extern char **environ;
+#endif
+#ifdef __linux__
+#include <sys/vfs.h>
+#elif defined(__APPLE__)
+#include <sys/mount.h>
 #endif
 #include <sys/stat.h>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#ifdef HAVE_LLVM_DISASSEMBLER
+#include <llvm-c/Disassembler.h>
+#include <llvm-c/Target.h>
+#endif
+#ifdef HAVE_BZLIB
+#include <bzlib.h>
+#endif
 
 //===----------------------------------------------------------------------===//
 // Helpers
@@ -114,28 +244,189 @@ uint64_t TakeU64(unsigned char *&Buf) {
   return X;
 }
 
-// Forks, execs Cmd under a shell and returns
-// a file descriptor reading the command's stdout.
-FILE *ForkAndExec(std::string Cmd) {
+// Append the words of S, separated by spaces, to Args. Tools such as objdump
+// are given as a command line of this form, e.g. "python fake-objdump.py".
+// As in the shell, a word may be quoted to hold spaces.
+static void appendWords(std::vector<std::string> &Args, const std::string &S) {
+  std::string Word;
+  bool InWord = false;
+  char Quote = 0;
+  for (char C : S) {
+    if (Quote) {
+      if (C == Quote)
+        Quote = 0;
+      else
+        Word += C;
+    } else if (C == '\'' || C == '"') {
+      Quote = C;
+      InWord = true;
+    } else if (C == ' ' || C == '\t') {
+      if (InWord)
+        Args.push_back(Word);
+      Word.clear();
+      InWord = false;
+    } else {
+      Word += C;
+      InWord = true;
+    }
+  }
+  if (InWord)
+    Args.push_back(Word);
+}
+
+// Reads lines from a file descriptor into a buffer that is reused from one
+// line to the next. Lines are returned in place, without their newline.
+class LineScanner {
+public:
+  explicit LineScanner(int FD = -1) : FD(FD), Buf(1 << 16) {}
+
+  void reset(int NewFD) {
+    FD = NewFD;
+    Begin = End = 0;
+    AtEOF = false;
+  }
+
+  // Return the next line, NUL-terminated, or nullptr at the end of the input.
+  // It stays valid until the next call.
+  char *nextLine() {
+    size_t Scanned = Begin;
+    while (true) {
+      char *NL = (char *)memchr(&Buf[Scanned], '\n', End - Scanned);
+      if (NL) {
+        *NL = '\0';
+        char *Line = &Buf[Begin];
+        Begin = NL + 1 - &Buf[0];
+        return Line;
+      }
+      if (AtEOF) {
+        if (Begin == End)
+          return nullptr;
+        // The last line has no newline.
+        Buf[End] = '\0';
+        char *Line = &Buf[Begin];
+        Begin = End;
+        return Line;
+      }
+      // Move the start of the line to the front, growing the buffer if the
+      // line fills it, then read more of it.
+      Scanned = End - Begin;
+      if (Begin) {
+        memmove(&Buf[0], &Buf[Begin], End - Begin);
+        End -= Begin;
+        Begin = 0;
+      }
+      if (Buf.size() - End < 2)
+        Buf.resize(Buf.size() * 2);
+      ssize_t N = FD < 0 ? 0 : readSome(&Buf[End], Buf.size() - End - 1);
+      if (N <= 0)
+        AtEOF = true;
+      else
+        End += N;
+    }
+  }
+
+private:
+  ssize_t readSome(char *P, size_t N) {
 #ifdef _WIN32
-  Cmd = "cmd.exe /c " + Cmd;
-  FILE *Stream = _popen(Cmd.c_str(), "rt");
+    return _read(FD, P, (unsigned)N);
 #else
-  int P[2];
-  pipe(P);
-
-  FILE *Stream = fdopen(P[0], "r");
-  
-  if (fork() == 0) {
-    dup2(P[1], 1);
-    close(P[0]);
-    execl("/bin/sh", "sh", "-c", Cmd.c_str(), (char *)NULL);
-  } else {
-    close(P[1]);
+    ssize_t R;
+    do
+      R = read(FD, P, N);
+    while (R < 0 && errno == EINTR);
+    return R;
+#endif
   }
+
+  int FD;
+  std::vector<char> Buf;
+  size_t Begin = 0, End = 0;
+  bool AtEOF = false;
+};
+
+// A tool run with its standard output read a line at a time. It is run
+// directly with posix_spawn, without a shell, and its errors are discarded.
+class Subprocess {
+public:
+  Subprocess() {}
+  Subprocess(const std::vector<std::string> &Args) { start(Args); }
+  ~Subprocess() { close(); }
+
+  bool start(const std::vector<std::string> &Args) {
+    close();
+#ifdef _WIN32
+    std::string Cmd = "cmd.exe /c";
+    for (auto &A : Args)
+      Cmd += " " + A;
+    Stream = _popen((Cmd + " 2> NUL").c_str(), "rb");
+    if (!Stream)
+      return false;
+    Lines.reset(_fileno(Stream));
+#else
+    if (Args.empty())
+      return false;
+    int P[2];
+    if (pipe(P) != 0)
+      return false;
+#ifdef F_SETPIPE_SZ
+    // objdump writes much more than the default 64 KiB at a time.
+    fcntl(P[1], F_SETPIPE_SZ, 1 << 20);
 #endif
-  return Stream;
-}
+    std::vector<char *> Argv;
+    for (auto &A : Args)
+      Argv.push_back(const_cast<char *>(A.c_str()));
+    Argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t Actions;
+    posix_spawn_file_actions_init(&Actions);
+    posix_spawn_file_actions_adddup2(&Actions, P[1], 1);
+    posix_spawn_file_actions_addclose(&Actions, P[0]);
+    posix_spawn_file_actions_addclose(&Actions, P[1]);
+    posix_spawn_file_actions_addopen(&Actions, 2, "/dev/null", O_WRONLY, 0);
+    int Err = posix_spawnp(&Pid, Argv[0], &Actions, nullptr, Argv.data(),
+                           environ);
+    posix_spawn_file_actions_destroy(&Actions);
+    ::close(P[1]);
+    if (Err != 0) {
+      ::close(P[0]);
+      Pid = -1;
+      return false;
+    }
+    FD = P[0];
+    Lines.reset(FD);
+#endif
+    return true;
+  }
+
+  // Return the next line of output (see LineScanner::nextLine).
+  char *nextLine() { return Lines.nextLine(); }
+
+  void close() {
+#ifdef _WIN32
+    if (Stream)
+      _pclose(Stream);
+    Stream = nullptr;
+#else
+    if (FD >= 0)
+      ::close(FD);
+    FD = -1;
+    if (Pid > 0)
+      while (waitpid(Pid, nullptr, 0) < 0 && errno == EINTR)
+        ;
+    Pid = -1;
+#endif
+    Lines.reset(-1);
+  }
+
+private:
+#ifdef _WIN32
+  FILE *Stream = nullptr;
+#else
+  pid_t Pid = -1;
+  int FD = -1;
+#endif
+  LineScanner Lines;
+};
 
 #ifdef _WIN32
 ssize_t getline(char** lineptr, size_t* n, FILE* stream) {
@@ -182,19 +473,47 @@ void Assert(bool Expr, const char *ExprStr, const char *File, int Line) {
 // Perf structures. Taken from https://lwn.net/Articles/644919/
 //===----------------------------------------------------------------------===//
 
+// Where a sample was taken: the low bits of perf_event_header.misc.
+#define PERF_RECORD_MISC_CPUMODE_MASK 7
+#define PERF_RECORD_MISC_KERNEL 1
+#define PERF_RECORD_MISC_HYPERVISOR 3
+#define PERF_RECORD_MISC_MMAP_DATA (1U << 13)
+#define PERF_RECORD_MISC_MMAP_BUILD_ID (1U << 14)
+#define PERF_RECORD_MISC_BUILD_ID_SIZE (1U << 15)
+
 #define PERF_RECORD_MMAP 1
+#define PERF_RECORD_COMM 3
 #define PERF_RECORD_SAMPLE 9
 #define PERF_RECORD_MMAP2 10
+#define PERF_RECORD_FINISHED_ROUND 68
+#define PERF_RECORD_FINISHED_INIT 82
 
 #define PERF_SAMPLE_IP    (1U << 0)
 #define PERF_SAMPLE_TID   (1U << 1)
 #define PERF_SAMPLE_TIME  (1U << 2)
 #define PERF_SAMPLE_ADDR  (1U << 3)
+#define PERF_SAMPLE_READ  (1U << 4)
+#define PERF_SAMPLE_CALLCHAIN (1U << 5)
 #define PERF_SAMPLE_ID    (1U << 6)
 #define PERF_SAMPLE_CPU   (1U << 7)
 #define PERF_SAMPLE_PERIOD (1U << 8)
 #define PERF_SAMPLE_STREAM_ID (1U << 9)
+#define PERF_SAMPLE_RAW   (1U << 10)
+#define PERF_SAMPLE_BRANCH_STACK (1U << 11)
+#define PERF_SAMPLE_REGS_USER (1U << 12)
+#define PERF_SAMPLE_STACK_USER (1U << 13)
+#define PERF_SAMPLE_WEIGHT (1U << 14)
+#define PERF_SAMPLE_DATA_SRC (1U << 15)
 #define PERF_SAMPLE_IDENTIFIER (1U << 16)
+#define PERF_SAMPLE_WEIGHT_STRUCT (1U << 24)
+
+#define PERF_FORMAT_TOTAL_TIME_ENABLED (1U << 0)
+#define PERF_FORMAT_TOTAL_TIME_RUNNING (1U << 1)
+#define PERF_FORMAT_ID (1U << 2)
+#define PERF_FORMAT_GROUP (1U << 3)
+#define PERF_FORMAT_LOST (1U << 4)
+
+#define PERF_SAMPLE_BRANCH_HW_INDEX (1U << 17)
 
 struct perf_file_section {
   uint64_t offset; /* offset from start of file */
@@ -225,6 +544,9 @@ struct perf_event_attr {
     uint64_t bp_addr;
     uint64_t bp_len;
     uint64_t branch_sample_type;
+    // Only present if size says so (PERF_ATTR_SIZE_VER3 and later).
+    uint64_t sample_regs_user;
+    uint32_t sample_stack_user;
 };
 
 struct perf_event_header {
@@ -241,7 +563,24 @@ struct perf_event_sample {
   uint32_t pid, tid;
   uint64_t time;
   uint64_t id;
+  uint32_t cpu;
   uint64_t period;
+  // Sample weight, e.g. the latency of a memory access. Zero if not sampled.
+  uint64_t weight;
+  // The data address accessed, and where in the memory hierarchy it was
+  // found (see perf_mem_data_src). Zero if not sampled.
+  uint64_t addr;
+  uint64_t data_src;
+  // The counter values of PERF_SAMPLE_READ (a perf_read_format), or nullptr
+  // if not sampled.
+  unsigned char *read;
+};
+
+struct perf_event_comm {
+  struct perf_event_header header;
+
+  uint32_t pid, tid;
+  char comm[1];
 };
 
 struct perf_event_mmap_common {
@@ -258,12 +597,21 @@ struct perf_event_mmap {
 
 struct perf_event_mmap2 {
   struct perf_event_mmap_common mmap_common;
+  // With PERF_RECORD_MISC_MMAP_BUILD_ID, these 24 bytes instead hold
+  // u8 build_id_size, u8 reserved[3], u8 build_id[20].
   uint32_t maj, min;
   uint64_t ino, ino_generation;
   uint32_t prot, flags;
   char filename[1];
 };
 
+struct build_id_event {
+  struct perf_event_header header;
+  int32_t pid;
+  uint8_t build_id[24];
+  char filename[1];
+};
+
 struct perf_trace_event_type {
   uint64_t event_id;
   char str[64];
@@ -335,12 +683,24 @@ static const char* sw_event_names[PERF_COUNT_SW_MAX] = {
 // Readers for objdump output
 //===----------------------------------------------------------------------===//
 
+class JITCode;
+class SymTabOutput;
+
 struct Map {
   Map(uint64_t Start, uint64_t End, const char *Filename)
     : Start(Start), End(End), Filename(Filename) {}
 
   uint64_t Start, End;
   const char *Filename;
+  // The build-id of the binary, in hex, if perf recorded one.
+  std::string BuildID;
+  // For the pseudo-map holding a process's JIT-compiled code, its symbols.
+  JITCode *JIT = nullptr;
+  // For the pseudo-maps of the kernel and the hypervisor, their symbols.
+  SymTabOutput *Symbols = nullptr;
+  // The code of the map cannot be read (the kernel without a vmlinux image,
+  // the hypervisor), so only sampled addresses are emitted for it.
+  bool NoCode = false;
 
   // Mapping-related adjustments. Here FileOffset(func) is the offset of func
   // in the ELF file, VAddr(func) is the virtual address associated with this
@@ -352,304 +712,2009 @@ struct Map {
   uint64_t VAddrToFileOffset; // VAddr(func) + VAddrToFileOffset == FileOffset(func)
 };
 
+// What is needed from an event's attributes to parse its samples.
+struct EventLayout {
+  uint64_t SampleType = 0;
+  uint64_t ReadFormat = 0;
+  uint64_t BranchSampleType = 0;
+  uint64_t SampleRegsUser = 0;
+  // Whether records other than samples end with the sample's TID, TIME, ID,
+  // STREAM_ID, CPU and IDENTIFIER fields (perf_event_attr.sample_id_all).
+  bool SampleIDAll = false;
+
+  EventLayout() {}
+  EventLayout(const perf_event_attr *Attr) {
+    SampleType = Attr->sample_type;
+    ReadFormat = Attr->read_format;
+    SampleIDAll = Attr->flags & (1ULL << 18);
+    if (Attr->size >= offsetof(perf_event_attr, branch_sample_type) + 8)
+      BranchSampleType = Attr->branch_sample_type;
+    if (Attr->size >= offsetof(perf_event_attr, sample_regs_user) + 8)
+      SampleRegsUser = Attr->sample_regs_user;
+  }
+};
+
 struct EventDesc {
   uint64_t Start;
   uint64_t End;
   size_t MapId;
 };
 
-struct Symbol {
-  uint64_t Start;
-  uint64_t End;
-  std::string Name;
+// Records of the data section waiting to be processed in time order. They
+// stay where the input has them (see PerfInput::stableRecords); only their
+// time and address are queued, in a heap of at most Limit entries allocated
+// once.
+class OrderedEvents {
+public:
+  explicit OrderedEvents(size_t Limit) : Limit(Limit) { Heap.reserve(Limit); }
 
-  bool operator<(const Symbol &Other) const { return Start < Other.Start; }
-  bool operator==(const Symbol &Other) const {
-    return Start == Other.Start && End == Other.End && Name == Other.Name;
+  bool full() const { return Heap.size() >= Limit; }
+
+  void push(uint64_t Time, unsigned char *Buf) {
+    Heap.push_back({Time, Buf});
+    std::push_heap(Heap.begin(), Heap.end(), later);
   }
-};
 
-class SymTabOutput : public std::vector<Symbol> {
-public:
-  std::string Objdump, BinaryCacheRoot;
+  // Pass the records up to Time to Process, oldest first. Records of the
+  // same time are passed in file order.
+  template <typename F> void flush(uint64_t Time, F Process) {
+    while (!Heap.empty() && Heap.front().Time <= Time) {
+      std::pop_heap(Heap.begin(), Heap.end(), later);
+      unsigned char *Buf = Heap.back().Buf;
+      Heap.pop_back();
+      Process(Buf);
+    }
+  }
 
-  SymTabOutput(std::string Objdump, std::string BinaryCacheRoot)
-    : Objdump(Objdump), BinaryCacheRoot(BinaryCacheRoot) {}
+  // Pass the oldest half of the records to Process, to make room.
+  template <typename F> void flushHalf(F Process) {
+    while (Heap.size() > Limit / 2) {
+      std::pop_heap(Heap.begin(), Heap.end(), later);
+      unsigned char *Buf = Heap.back().Buf;
+      Heap.pop_back();
+      Process(Buf);
+    }
+  }
 
-  void fetchExecSegment(Map *M, uint64_t *FileOffset, uint64_t *VAddr) {
-    std::string Cmd = Objdump + " -p -C " +
-                      BinaryCacheRoot + std::string(M->Filename) +
-#ifdef _WIN32
-                      " 2> NUL";
-#else
-                      " 2>/dev/null";
-#endif
-    auto Stream = ForkAndExec(Cmd);
+private:
+  struct Entry {
+    uint64_t Time;
+    unsigned char *Buf;
+  };
 
-    char *Line = nullptr, *PrevLine = nullptr;
-    size_t LineLen = 0;
-    *FileOffset = *VAddr = 0;
-    while (true) {
-      if (PrevLine)
-        free (PrevLine);
-      if (Line)
-        PrevLine = strdup (Line);
-      ssize_t Len = getline(&Line, &LineLen, Stream);
-      if (Len == -1)
-        break;
+  static bool later(const Entry &A, const Entry &B) {
+    return A.Time != B.Time ? A.Time > B.Time : A.Buf > B.Buf;
+  }
 
-      if (!strstr(Line, "flags r-x") && !strstr(Line, "flags rwx"))
-        continue;
+  size_t Limit;
+  std::vector<Entry> Heap;
+};
 
-      /* Format is weird.. but we did find the section so punt.  */
-      const char *OFFSET_LABEL = "off ";
-      const char *VADDR_LABEL = "vaddr ";
-      char *pos_offset = strstr(PrevLine, OFFSET_LABEL);
-      char *pos_vaddr = strstr(PrevLine, VADDR_LABEL);
-      if (!pos_offset || !pos_vaddr)
-        break;
+// The most records queued to be processed in time order. Recordings with
+// longer rounds are processed a half-queue at a time, which is only
+// approximately in time order.
+static const size_t MaxQueuedEvents = 1 << 20;
 
-      pos_offset += strlen(OFFSET_LABEL);
-      pos_vaddr += strlen(VADDR_LABEL);
-      *FileOffset = strtoull(pos_offset, NULL, 16);
-      *VAddr = strtoull(pos_vaddr, NULL, 16);
+// Copies of queued records, for inputs that reuse the memory records are read
+// into. Copies are made in large blocks, each of which is reused once all the
+// records in it have been released. Every copy is preceded by the address of
+// its block.
+class RecordArena {
+public:
+  unsigned char *copy(const unsigned char *Rec, size_t Size) {
+    size_t Need = Prefix + ((Size + 7) & ~(size_t)7);
+    if (!Current || Current->Used + Need > Current->Size)
+      newBlock(Need);
+    unsigned char *P = Current->Data.get() + Current->Used;
+    memcpy(P, &Current, sizeof(Block *));
+    memcpy(P + Prefix, Rec, Size);
+    Current->Used += Need;
+    ++Current->Live;
+    return P + Prefix;
+  }
 
-      break;
+  void release(unsigned char *Rec) {
+    Block *B;
+    memcpy(&B, Rec - Prefix, sizeof(Block *));
+    if (--B->Live == 0 && B != Current) {
+      B->Used = 0;
+      Free.push_back(B);
     }
-    if (Line)
-      free(Line);
-    if (PrevLine)
-      free(PrevLine);
+  }
 
-#ifdef _WIN32
-    _pclose(Stream);
-#else
-    fclose(Stream);
-    wait(NULL);
-#endif
+private:
+  struct Block {
+    std::unique_ptr<unsigned char[]> Data;
+    size_t Size, Used, Live;
+  };
+  static const size_t Prefix = 8, BlockSize = 4 << 20;
+
+  // Make Current a block with room for Need bytes. The block it replaces is
+  // free once its last record is released.
+  void newBlock(size_t Need) {
+    if (Current && Current->Live == 0) {
+      Current->Used = 0;
+      if (Current->Size >= Need)
+        return;
+      Free.push_back(Current);
+    }
+    Current = nullptr;
+    if (!Free.empty() && Free.back()->Size >= Need) {
+      Current = Free.back();
+      Free.pop_back();
+      return;
+    }
+    size_t Size = std::max(Need, BlockSize);
+    Blocks.emplace_back(new Block{std::unique_ptr<unsigned char[]>(
+                                      new unsigned char[Size]),
+                                  Size, 0, 0});
+    Current = Blocks.back().get();
   }
 
-  void fetchSymbols(Map *M) {
-    std::string Cmd = Objdump + " -t -T -C " +
-                      BinaryCacheRoot + std::string(M->Filename) +
-#ifdef _WIN32
-                      " 2> NUL";
-#else
-                      " 2>/dev/null";
-#endif
-    auto Stream = ForkAndExec(Cmd);
+  std::vector<std::unique_ptr<Block>> Blocks;
+  std::vector<Block *> Free;
+  Block *Current = nullptr;
+};
 
-    char *Line = nullptr;
-    size_t LineLen = 0;
-    while (true) {
-      ssize_t Len = getline(&Line, &LineLen, Stream);
-      if (Len == -1)
-        break;
+//===----------------------------------------------------------------------===//
+// Reading perf.data files
+//===----------------------------------------------------------------------===//
 
-      std::stringstream SS(Line);
+// Where a perf.data file is read from. Besides the data section, the reader
+// needs the header and a few small sections around it (the attributes, the
+// table of feature sections after the data, build-ids and event
+// descriptions): section() returns these, and they stay valid for the life of
+// the input. The data section is then read once, in order, a record at a
+// time.
+class PerfInput {
+public:
+  virtual ~PerfInput() {}
 
-      std::string Start;
-      if (!std::getline(SS, Start, ' '))
-        continue;
-      char* EndPtr = NULL;
-      uint64_t NStart = strtoull(Start.c_str(), &EndPtr, 16);
-      if (EndPtr == Start.c_str())
-        continue;
+  // Return the Size bytes of the file at Offset.
+  virtual unsigned char *section(uint64_t Offset, uint64_t Size) = 0;
 
-      char GlobLoc;          // Local -> 'l', Global -> 'g', Neither -> ' '
-      if (!SS.get(GlobLoc))
-        continue;
-      char Weak;             // Weak?
-      if (!SS.get(Weak))
-        continue;
-      char Space;
-      if (!SS.get(Space))    // Constructor. Not supported yet.
-        continue;
-      if (!SS.get(Space))    // Warning. Not supported yet.
-        continue;
-      char IFunc;            // Indirect reference to another symbol.
-      if (!SS.get(IFunc))
-        continue;
-      char Debug;            // Debugging (d) or dynamic (D) symbol.
-      if (!SS.get(Debug))
-        continue;
-      char FileFunc;         // Name of function (F), file (f) or object (O).
-      if (!SS.get(FileFunc))
-        continue;
-      if (FileFunc != 'F')
-        continue;
-      if (!SS.get(Space))
-        continue;
+  // Start reading the Size bytes of records at Offset.
+  virtual void startData(uint64_t Offset, uint64_t Size) = 0;
 
-      std::string Section;
-      if (!std::getline(SS, Section, '\t'))
-        continue;
-      if (Section != ".text")
-        continue;
+  // Return the next record, or nullptr after the last one.
+  virtual unsigned char *nextRecord() = 0;
 
-      std::string Extent;
-      if (!std::getline(SS, Extent, ' '))
-        continue;
-      uint64_t NExtent = strtoull(Extent.c_str(), &EndPtr, 16);
-      if (EndPtr == Extent.c_str())
-        continue;
+  // Whether records stay valid for the life of the input. If not, each one
+  // is only valid until the next call to nextRecord().
+  virtual bool stableRecords() const { return true; }
 
-      std::string Func;
-      while (std::getline(SS, Func, ' ') && Func.empty());  // Skip spaces.
-      if (Func.empty())
-        continue;
-      // Note Func includes the symbol table visibility if any.
-      std::string FuncRest;
-      if (std::getline(SS, FuncRest)) // Read the rest line if any.
-        Func += std::string(" ") + FuncRest;
-      if (Func.back() == '\n')
-        Func.pop_back();
-      push_back({NStart, NStart + NExtent, Func});
-    }
-    if (Line)
-      free(Line);
+  static std::unique_ptr<PerfInput> open(const std::string &Filename);
+};
 
-#ifdef _WIN32
-    _pclose(Stream);
-#else
-    fclose(Stream);
-    wait(NULL);
-#endif
-  }
+// Return the record at Next if it lies before End. A truncated last record
+// is ignored, as if the file ended before it.
+static unsigned char *recordAt(unsigned char *Next, unsigned char *End) {
+  if ((size_t)(End - Next) < sizeof(perf_event_header))
+    return nullptr;
+  perf_event_header *E = (perf_event_header *)Next;
+  assert(E->size && "empty perf record");
+  return E->size <= (size_t)(End - Next) ? Next : nullptr;
+}
 
-  void reset(Map *M) {
-    clear();
+// An input held in memory as a whole.
+class MemoryInput : public PerfInput {
+public:
+  unsigned char *section(uint64_t Offset, uint64_t Size) override {
+    assert(Offset <= BufferLen && Size <= BufferLen - Offset &&
+           "section beyond the end of the perf.data file");
+    return Buffer + Offset;
+  }
 
-    // Take possible difference between "offset" and "virtual address" of
-    // the executable segment into account.
-    uint64_t FileOffset, VAddr;
-    fetchExecSegment(M, &FileOffset, &VAddr);
-    M->VAddrToFileOffset = FileOffset - VAddr;
+  void startData(uint64_t Offset, uint64_t Size) override {
+    Next = section(Offset, Size);
+    End = Next + Size;
+  }
 
-    // Fetch both dynamic and static symbols, sort and unique them.
-    fetchSymbols(M);
-    
-    std::sort(begin(), end());
-    auto NewEnd = std::unique(begin(), end());
-    erase(NewEnd, end());
+  unsigned char *nextRecord() override {
+    unsigned char *Rec = recordAt(Next, End);
+    if (Rec)
+      Next += ((perf_event_header *)Rec)->size;
+    return Rec;
   }
 
 protected:
-  int splitLine(const std::string& line, std::vector<std::string>& output, char delim = ' ') {
-    std::stringstream ss(line);
-    std::string token;
-    while (std::getline(ss, token, delim)) {
-        output.push_back(token);
-    }
-    return (int)output.size();
-  }
+  unsigned char *Buffer = nullptr;
+  size_t BufferLen = 0;
+  unsigned char *Next = nullptr, *End = nullptr;
 };
 
-class ObjdumpOutput {
+// A file mapped into memory. The data section is read sequentially, so the
+// kernel is told so, and asked to read ahead a window at a time: on network
+// filesystems, faulting pages in one by one is very slow.
+class MmapInput : public MemoryInput {
 public:
-  std::string Objdump, BinaryCacheRoot;
-  FILE *Stream;
-  const char *ThisText;
-  uint64_t ThisAddress;
-  uint64_t EndAddress;
-  char *Line;
-  size_t LineLen;
-
-  ObjdumpOutput(std::string Objdump, std::string BinaryCacheRoot)
-    : Objdump(Objdump), BinaryCacheRoot(BinaryCacheRoot), Stream(nullptr),
-      Line(NULL), LineLen(0) {}
-  ~ObjdumpOutput() {
-    if (Stream) {
 #ifdef _WIN32
-      _pclose(Stream);
+  MmapInput(HANDLE hFile, HANDLE hMapFile, unsigned char *P, size_t Len)
+      : hFile(hFile), hMapFile(hMapFile) {
+    Buffer = P;
+    BufferLen = Len;
+  }
+  ~MmapInput() {
+    ::UnmapViewOfFile(Buffer);
+    ::CloseHandle(hMapFile);
+    ::CloseHandle(hFile);
+  }
 #else
-      fclose(Stream);
-      wait(NULL);
-#endif
+  MmapInput(unsigned char *P, size_t Len) {
+    Buffer = P;
+    BufferLen = Len;
+  }
+  ~MmapInput() { munmap(Buffer, BufferLen); }
+
+  void startData(uint64_t Offset, uint64_t Size) override {
+    MemoryInput::startData(Offset, Size);
+    advise(Next, End - Next, MADV_SEQUENTIAL);
+    advise(Next, ReadaheadWindow, MADV_WILLNEED);
+    ReadaheadMark = Next;
+  }
+
+  unsigned char *nextRecord() override {
+    // Once the previous window is reached, ask for the next one.
+    if (Next >= ReadaheadMark && ReadaheadMark < End) {
+      ReadaheadMark += ReadaheadWindow;
+      advise(ReadaheadMark, ReadaheadWindow, MADV_WILLNEED);
     }
-    if (Line)
-      free(Line);
+    return MemoryInput::nextRecord();
   }
+#endif
 
-  void reset(Map *M, uint64_t Start, uint64_t Stop) {
-    ThisAddress = 0;
-    ThisText = "";
-    if (Stream) {
+private:
 #ifdef _WIN32
-      _pclose(Stream);
+  HANDLE hFile, hMapFile;
 #else
-      fclose(Stream);
-      wait(NULL);
-#endif
-    }
+  static const size_t ReadaheadWindow = 8 << 20;
+
+  // madvise() the pages of [P, P + Len) that are within the data section.
+  void advise(unsigned char *P, size_t Len, int Advice) {
+    if (P >= End)
+      return;
+    Len = std::min(Len, (size_t)(End - P));
+    uintptr_t PageMask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+    uintptr_t Start = (uintptr_t)P & ~PageMask;
+    madvise((void *)Start, (uintptr_t)P + Len - Start, Advice);
+  }
 
-    char buf1[32], buf2[32];
-    sprintf(buf1, "%#" PRIx64, Start);
-    sprintf(buf2, "%#" PRIx64, Stop + 4);
+  unsigned char *ReadaheadMark = nullptr;
+#endif
+};
 
-    std::string Cmd = Objdump + " -d --no-show-raw-insn --start-address=" +
-                      std::string(buf1) + " --stop-address=" +
-                      std::string(buf2) + " " +
-                      BinaryCacheRoot + std::string(M->Filename) +
+// Read N bytes from FD at Offset, or at the current position if Offset is
+// negative. Returns the number of bytes read, which is less than N at the end
+// of the file, or -1 on error.
+static ssize_t readFully(int FD, unsigned char *Buf, size_t N,
+                         int64_t Offset = -1) {
+  size_t Done = 0;
+  while (Done < N) {
 #ifdef _WIN32
-                      " 2> NUL";
+    assert(Offset < 0);
+    int R = _read(FD, Buf + Done, (unsigned)std::min<size_t>(N - Done, 1 << 30));
 #else
-                      " 2>/dev/null";
+    ssize_t R = Offset < 0 ? read(FD, Buf + Done, N - Done)
+                           : pread(FD, Buf + Done, N - Done, Offset + Done);
+    if (R < 0 && errno == EINTR)
+      continue;
 #endif
-    Stream = ForkAndExec(Cmd);
+    if (R < 0)
+      return -1;
+    if (R == 0)
+      break;
+    Done += R;
+  }
+  return Done;
+}
 
-    EndAddress = Stop;
-  };
+// A pipe (or anything else that cannot be mapped or read at an offset), read
+// into memory as a whole: the sections that describe the events and binaries
+// of the data section come after it in the file.
+class PipeInput : public MemoryInput {
+public:
+  explicit PipeInput(int FD) {
+    Data.resize(1 << 20);
+    size_t Len = 0;
+    while (true) {
+      if (Len == Data.size())
+        Data.resize(Data.size() * 2);
+      ssize_t R = readFully(FD, Data.data() + Len, Data.size() - Len);
+      assert(R >= 0 && "cannot read perf.data");
+      if (R == 0)
+        break;
+      Len += R;
+    }
+    Buffer = Data.data();
+    BufferLen = Len;
+  }
 
-  std::string getText() { return ThisText; }
+private:
+  std::vector<unsigned char> Data;
+};
 
-  uint64_t next() {
-    getLine();
-    return ThisAddress;
+#ifndef _WIN32
+// A file read with pread(), for files that are too large to map or on
+// filesystems where mapping them is slow. The data section is read a chunk at
+// a time into one of two buffers, while a thread reads the next chunk into
+// the other. Records are only valid until the next one is read.
+class PreadInput : public PerfInput {
+public:
+  PreadInput(int FD, uint64_t FileSize) : FD(FD), FileSize(FileSize) {}
+
+  ~PreadInput() {
+    if (Prefetcher.joinable()) {
+      {
+        std::lock_guard<std::mutex> L(Lock);
+        Stop = true;
+      }
+      Changed.notify_all();
+      Prefetcher.join();
+    }
+    close(FD);
   }
 
-  void getLine() {
+  unsigned char *section(uint64_t Offset, uint64_t Size) override {
+    assert(Offset <= FileSize && Size <= FileSize - Offset &&
+           "section beyond the end of the perf.data file");
+    Sections.emplace_back(new unsigned char[Size ? Size : 1]);
+    // Not inside the assert: the standalone build may compile it out.
+    ssize_t N = readFully(FD, Sections.back().get(), Size, Offset);
+    (void) N;
+    assert(N == (ssize_t)Size && "cannot read perf.data");
+    return Sections.back().get();
+  }
+
+  void startData(uint64_t Offset, uint64_t Size) override {
+    assert(Offset <= FileSize && Size <= FileSize - Offset &&
+           "data section beyond the end of the perf.data file");
+    for (auto &B : Buffers)
+      B.reset(new unsigned char[Headroom + ChunkSize]);
+    NextOffset = Offset;
+    DataEnd = Offset + Size;
+    Next = End = Buffers[1].get() + Headroom;
+    Prefetcher = std::thread([this] { prefetch(); });
+    request(0);
+  }
+
+  unsigned char *nextRecord() override {
     while (true) {
-      ssize_t Len = getline(&Line, &LineLen, Stream);
-      if (Len == -1) {
-        ThisAddress = EndAddress;
-        ThisText = "";
-        return;
+      if (unsigned char *Rec = recordAt(Next, End)) {
+        Next += ((perf_event_header *)Rec)->size;
+        return Rec;
       }
-      char *TokBuf;
-      char *One = strtok_r(Line, ":", &TokBuf);
-      char *Two = strtok_r(NULL, "\n", &TokBuf);
-      if (!One || !Two)
-        continue;
-      char *EndPtr = NULL;
-      uint64_t Address = strtoull(One, &EndPtr, 16);
-      if (EndPtr != &One[strlen(One)])
-        continue;
-
-      ThisAddress = Address;
-      ThisText = Two;
-      break;
+      if (!nextChunk())
+        return nullptr;
     }
   }
-};
 
-//===----------------------------------------------------------------------===//
-// PerfReader
-//===----------------------------------------------------------------------===//
+  bool stableRecords() const override { return false; }
 
-class PerfReader {
-public:
-  PerfReader(const std::string &Filename, std::string Objdump,
-             std::string BinaryCacheRoot);
-  ~PerfReader();
+private:
+  // Chunks are preceded by room for the start of a record that did not fit
+  // in the previous chunk (records are at most 64 KiB).
+  static const size_t ChunkSize = 4 << 20, Headroom = 1 << 16;
+
+  // Ask for the next chunk to be read into buffer I.
+  void request(int I) {
+    if (NextOffset >= DataEnd)
+      return;
+    std::lock_guard<std::mutex> L(Lock);
+    Pending = I;
+    PendingOffset = NextOffset;
+    PendingSize = std::min<uint64_t>(ChunkSize, DataEnd - NextOffset);
+    PendingResult = -2;
+    NextOffset += PendingSize;
+    Changed.notify_all();
+  }
 
-  void readHeader();
-  void readAttrs();
+  // Move on to the chunk being read, carrying over what is left of the
+  // current one, and start reading the following one.
+  bool nextChunk() {
+    int I;
+    ssize_t Result;
+    {
+      std::unique_lock<std::mutex> L(Lock);
+      if (Pending < 0)
+        return false;
+      Changed.wait(L, [this] { return PendingResult != -2; });
+      I = Pending;
+      Result = PendingResult;
+      Pending = -1;
+    }
+    assert(Result == (ssize_t)PendingSize && "cannot read perf.data");
+    unsigned char *Data = Buffers[I].get() + Headroom;
+    size_t Left = End - Next;
+    assert(Left <= Headroom && "perf record larger than 64 KiB");
+    memmove(Data - Left, Next, Left);
+    Next = Data - Left;
+    End = Data + Result;
+    request(1 - I);
+    return true;
+  }
+
+  void prefetch() {
+    std::unique_lock<std::mutex> L(Lock);
+    while (true) {
+      Changed.wait(L, [this] { return Stop || PendingResult == -2; });
+      if (Stop)
+        return;
+      unsigned char *Dst = Buffers[Pending].get() + Headroom;
+      uint64_t Offset = PendingOffset;
+      size_t Size = PendingSize;
+      L.unlock();
+      ssize_t R = readFully(FD, Dst, Size, Offset);
+      L.lock();
+      PendingResult = R < 0 ? -1 : R;
+      Changed.notify_all();
+    }
+  }
+
+  int FD;
+  uint64_t FileSize;
+  std::vector<std::unique_ptr<unsigned char[]>> Sections;
+
+  std::unique_ptr<unsigned char[]> Buffers[2];
+  unsigned char *Next = nullptr, *End = nullptr;
+  uint64_t NextOffset = 0, DataEnd = 0;
+
+  // The chunk being read by the prefetcher: into which buffer, from where,
+  // and its result (-2 while it is being read).
+  std::thread Prefetcher;
+  std::mutex Lock;
+  std::condition_variable Changed;
+  int Pending = -1;
+  uint64_t PendingOffset = 0;
+  size_t PendingSize = 0;
+  ssize_t PendingResult = 0;
+  bool Stop = false;
+};
+
+// Whether FD is on a network filesystem, where pages of a mapped file are
+// slow to fault in.
+static bool isNetworkFile(int FD) {
+#ifdef __linux__
+  struct statfs S;
+  if (fstatfs(FD, &S) != 0)
+    return false;
+  switch ((unsigned long)S.f_type) {
+  case 0x6969:     // NFS
+  case 0x517b:     // SMB
+  case 0xff534d42: // CIFS
+  case 0xfe534d42: // SMB2
+  case 0x564c:     // NCP
+  case 0x01021997: // 9P
+  case 0x65735546: // FUSE
+  case 0x6b414653: // AFS
+  case 0x47504653: // GPFS
+  case 0x0bd00bd0: // Lustre
+  case 0x00c36400: // Ceph
+    return true;
+  }
+#elif defined(__APPLE__)
+  struct statfs S;
+  if (fstatfs(FD, &S) != 0)
+    return false;
+  const char *Network[] = {"nfs", "smbfs", "afpfs", "webdav"};
+  for (const char *Name : Network)
+    if (!strcmp(S.f_fstypename, Name))
+      return true;
+#endif
+  return false;
+}
+#endif
+
+// Open Filename, or the standard input if it is "-", with the best way to
+// read it: regular files are mapped, unless they are on a network filesystem
+// or too large for the address space, and are then read with pread();
+// anything else is read as a pipe. LNT_PERF_INPUT=mmap, pread or pipe
+// overrides the choice.
+std::unique_ptr<PerfInput> PerfInput::open(const std::string &Filename) {
+  const char *Env = getenv("LNT_PERF_INPUT");
+  std::string Kind = Env && *Env ? Env : "auto";
+  if (Kind != "auto" && Kind != "mmap" && Kind != "pread" && Kind != "pipe")
+    throw std::invalid_argument("LNT_PERF_INPUT must be one of mmap, pread "
+                                "or pipe, not '" + Kind + "'");
+#ifdef _WIN32
+  if (Filename == "-" || Kind == "pipe") {
+    int FD = Filename == "-" ? _fileno(stdin)
+                             : _open(Filename.c_str(), _O_RDONLY | _O_BINARY);
+    assert(FD >= 0 && "cannot open perf.data");
+    std::unique_ptr<PerfInput> In(new PipeInput(FD));
+    if (Filename != "-")
+      _close(FD);
+    return In;
+  }
+  HANDLE hFile = ::CreateFileA(Filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                               NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  assert(hFile != INVALID_HANDLE_VALUE);
+  LARGE_INTEGER size;
+  size.QuadPart = 0;
+  BOOL GotSize = ::GetFileSizeEx(hFile, &size);
+  (void) GotSize;
+  assert(GotSize != FALSE);
+  HANDLE hMapFile = ::CreateFileMapping(hFile, NULL, PAGE_READONLY,
+                                        size.HighPart, size.LowPart, NULL);
+  assert(hMapFile != nullptr);
+  auto *Buffer =
+      (unsigned char *)::MapViewOfFile(hMapFile, FILE_MAP_READ, 0, 0, 0);
+  assert(Buffer != nullptr);
+  return std::unique_ptr<PerfInput>(
+      new MmapInput(hFile, hMapFile, Buffer, (size_t)size.QuadPart));
+#else
+  int FD = Filename == "-" ? dup(0) : ::open(Filename.c_str(), O_RDONLY);
+  assert(FD >= 0 && "cannot open perf.data");
+
+  struct stat sb;
+  int R = fstat(FD, &sb);
+  (void) R;
+  assert(R == 0 && "cannot stat perf.data");
+  if (!S_ISREG(sb.st_mode) || Kind == "pipe") {
+    std::unique_ptr<PerfInput> In(new PipeInput(FD));
+    close(FD);
+    return In;
+  }
+
+  uint64_t Size = sb.st_size;
+  // Leave most of a 32-bit address space to everything else.
+  const uint64_t MaxMapped = sizeof(void *) < 8 ? 1ULL << 30 : ~0ULL;
+  if (Kind == "auto" && (isNetworkFile(FD) || Size > MaxMapped))
+    Kind = "pread";
+  if (Kind != "pread" && Size > 0) {
+    void *P = mmap(NULL, Size, PROT_READ, MAP_SHARED, FD, 0);
+    if (P != MAP_FAILED) {
+      close(FD);
+      return std::unique_ptr<PerfInput>(
+          new MmapInput((unsigned char *)P, Size));
+    }
+  }
+  return std::unique_ptr<PerfInput>(new PreadInput(FD, Size));
+#endif
+}
+
+struct Symbol {
+  uint64_t Start;
+  uint64_t End;
+  std::string Name;
+
+  bool operator<(const Symbol &Other) const { return Start < Other.Start; }
+  bool operator==(const Symbol &Other) const {
+    return Start == Other.Start && End == Other.End && Name == Other.Name;
+  }
+};
+
+// The symbol of Syms, sorted by start address, that Addr lies in, or
+// nullptr.
+static const Symbol *lookupSymbol(const std::vector<Symbol> &Syms,
+                                  uint64_t Addr) {
+  auto I = std::upper_bound(
+      Syms.begin(), Syms.end(), Addr,
+      [](uint64_t Addr, const Symbol &S) { return Addr < S.Start; });
+  if (I == Syms.begin() || Addr >= (--I)->End)
+    return nullptr;
+  return &*I;
+}
+
+static bool pathExists(const std::string &Path, bool &IsDir) {
+  struct stat sb;
+  if (stat(Path.c_str(), &sb) != 0)
+    return false;
+  IsDir = (sb.st_mode & S_IFMT) == S_IFDIR;
+  return true;
+}
+
+// Return the path M's binary should be read from. BinaryCacheRoot either
+// mirrors the filesystem the profile was recorded on, or is a store of
+// binaries by build-id, laid out like perf's build-id cache or a debuginfod
+// client cache:
+//
+//   <root>/.build-id/<first 2 digits>/<remaining digits>[/elf]
+//   <root>/<build-id>/executable
+//
+// The build-id store is tried first, as it finds the right binary even if
+// the file at the recorded path has been rebuilt since.
+static std::string resolveBinary(const std::string &BinaryCacheRoot,
+                                 const Map &M) {
+  if (!BinaryCacheRoot.empty() && M.BuildID.size() > 2) {
+    bool IsDir;
+    std::string Path = BinaryCacheRoot + "/.build-id/" +
+                       M.BuildID.substr(0, 2) + "/" + M.BuildID.substr(2);
+    if (pathExists(Path, IsDir))
+      return IsDir ? Path + "/elf" : Path;
+    Path = BinaryCacheRoot + "/" + M.BuildID + "/executable";
+    if (pathExists(Path, IsDir) && !IsDir)
+      return Path;
+  }
+  return BinaryCacheRoot + M.Filename;
+}
+
+static std::string realPath(const std::string &Path) {
+#ifdef _WIN32
+  char *P = _fullpath(nullptr, Path.c_str(), 0);
+#else
+  char *P = realpath(Path.c_str(), nullptr);
+#endif
+  if (!P)
+    return "";
+  std::string S(P);
+  free(P);
+  return S;
+}
+
+// Return the real path of the file resolveBinary() picks for M, or an empty
+// string if that is not a file under BinaryCacheRoot. The server disassembles
+// binaries named by submitted profiles, whose paths and build-ids must not
+// reach any other file.
+static std::string confinedBinary(const std::string &BinaryCacheRoot,
+                                  const Map &M) {
+  std::string Filename = M.Filename;
+  if (BinaryCacheRoot.empty() || Filename.empty() || Filename[0] != '/' ||
+      (Filename + "/").find("/../") != std::string::npos ||
+      M.BuildID.find_first_not_of("0123456789abcdefABCDEF") !=
+          std::string::npos)
+    return "";
+  std::string Root = realPath(BinaryCacheRoot);
+  std::string Path = realPath(resolveBinary(BinaryCacheRoot, M));
+  if (Root.empty() || Path.empty())
+    return "";
+  if (Root.back() != '/')
+    Root += '/';
+  if (Path.compare(0, Root.size(), Root) != 0)
+    return "";
+  return Path;
+}
+
+class SymTabOutput : public std::vector<Symbol> {
+public:
+  std::string Objdump, BinaryCacheRoot;
+  // Fetch data objects (STT_OBJECT symbols in any section) rather than
+  // functions in .text.
+  bool Objects;
+
+  SymTabOutput(std::string Objdump, std::string BinaryCacheRoot,
+               bool Objects = false)
+    : Objdump(Objdump), BinaryCacheRoot(BinaryCacheRoot), Objects(Objects) {}
+
+  // The difference between file offset and virtual address of the binary's
+  // executable segment, and the virtual address of that segment.
+  uint64_t VAddrToFileOffset = 0;
+  uint64_t ExecVAddr = 0;
+
+  // The loadable segments, for objects. Data may be in any of them.
+  struct Segment {
+    uint64_t Offset, VAddr, MemSize;
+  };
+  std::vector<Segment> Segments;
+
+  // Translate an offset in the file to the virtual address it is loaded at,
+  // or return ~0ULL if it is not in any loadable segment.
+  uint64_t getVAddrForOffset(uint64_t Offset) const {
+    for (auto &S : Segments)
+      if (Offset >= S.Offset && Offset < S.Offset + S.MemSize)
+        return Offset - S.Offset + S.VAddr;
+    return ~0ULL;
+  }
+
+  void fetchExecSegment(const std::string &Path, uint64_t *FileOffset,
+                        uint64_t *VAddr) {
+    std::vector<std::string> Args;
+    appendWords(Args, Objdump);
+    Args.insert(Args.end(), {"-p", "-C", Path});
+    Subprocess P(Args);
+
+    // A segment is described on two lines: "LOAD off ... vaddr ..." then
+    // "filesz ... memsz ... flags ...". Only what is needed of the first
+    // line is kept while reading the second.
+    bool PrevIsLoad = false, PrevHasAddrs = false;
+    uint64_t PrevOffset = 0, PrevVAddr = 0;
+    *FileOffset = *VAddr = 0;
+    while (char *Line = P.nextLine()) {
+      bool IsLoad = PrevIsLoad, HasAddrs = PrevHasAddrs;
+      uint64_t Offset = PrevOffset, LineVAddr = PrevVAddr;
+      PrevIsLoad = strstr(Line, "LOAD off") != nullptr;
+      char *PosOffset = strstr(Line, "off ");
+      char *PosVAddr = strstr(Line, "vaddr ");
+      PrevHasAddrs = PosOffset && PosVAddr;
+      if (PrevHasAddrs) {
+        PrevOffset = strtoull(PosOffset + 4, NULL, 16);
+        PrevVAddr = strtoull(PosVAddr + 6, NULL, 16);
+      }
+
+      // Collect every loadable segment for objects.
+      if (Objects && IsLoad) {
+        char *PosMemSize = strstr(Line, "memsz ");
+        if (HasAddrs && PosMemSize)
+          Segments.push_back(
+              {Offset, LineVAddr, strtoull(PosMemSize + 6, NULL, 16)});
+        continue;
+      }
+
+      if (!strstr(Line, "flags r-x") && !strstr(Line, "flags rwx"))
+        continue;
+
+      /* Format is weird.. but we did find the section so punt.  */
+      if (!HasAddrs)
+        break;
+      *FileOffset = Offset;
+      *VAddr = LineVAddr;
+      break;
+    }
+  }
+
+  void fetchSymbols(const std::string &Path) {
+    std::vector<std::string> Args;
+    appendWords(Args, Objdump);
+    Args.insert(Args.end(), {"-t", "-T", "-C", Path});
+    Subprocess P(Args);
+
+    // Lines are split in place, e.g.
+    // "0000000000400590 g     F .text\t0000000000000002              main".
+    while (char *Line = P.nextLine()) {
+      char *Space = strchr(Line, ' ');
+      if (!Space)
+        continue;
+      *Space = '\0';
+      char *EndPtr = NULL;
+      uint64_t NStart = strtoull(Line, &EndPtr, 16);
+      if (EndPtr == Line)
+        continue;
+
+      // Seven flag characters and a space: local or global, weak,
+      // constructor, warning, indirect function, debugging or dynamic, and
+      // function (F), file (f) or object (O).
+      char *Flags = Space + 1;
+      if (strnlen(Flags, 8) < 8)
+        continue;
+      char FileFunc = Flags[6];
+      if (FileFunc != (Objects ? 'O' : 'F'))
+        continue;
+
+      char *Section = Flags + 8;
+      char *Tab = strchr(Section, '\t');
+      if (!Tab)
+        continue;
+      *Tab = '\0';
+      if (Objects ? Section[0] == '*' : strcmp(Section, ".text") != 0)
+        continue; // Objects may be in any section but *UND*, *ABS* etc.
+
+      char *Extent = Tab + 1;
+      Space = strchr(Extent, ' ');
+      if (!Space)
+        continue;
+      *Space = '\0';
+      uint64_t NExtent = strtoull(Extent, &EndPtr, 16);
+      if (EndPtr == Extent)
+        continue;
+
+      // Note Func includes the symbol table visibility if any.
+      char *Func = Space + 1;
+      Func += strspn(Func, " ");
+      if (!*Func)
+        continue;
+      push_back({NStart, NStart + NExtent, Func});
+    }
+  }
+
+  void reset(const std::string &Path) {
+    clear();
+    Segments.clear();
+
+    // Take possible difference between "offset" and "virtual address" of
+    // the executable segment into account.
+    uint64_t FileOffset, VAddr;
+    fetchExecSegment(Path, &FileOffset, &VAddr);
+    VAddrToFileOffset = FileOffset - VAddr;
+    ExecVAddr = VAddr;
+
+    // Fetch both dynamic and static symbols, sort and unique them.
+    fetchSymbols(Path);
+    
+    std::sort(begin(), end());
+    auto NewEnd = std::unique(begin(), end());
+    erase(NewEnd, end());
+  }
+
+  // Read the text symbols of a kernel from a copy of its /proc/kallsyms.
+  // Their addresses are those of the running kernel, so no adjustment is
+  // needed; each symbol is taken to end where the next one starts.
+  void readKallsyms(const std::string &Path) {
+    clear();
+    Segments.clear();
+    VAddrToFileOffset = ExecVAddr = 0;
+
+    int FD = open(Path.c_str(), O_RDONLY);
+    if (FD < 0)
+      return;
+    LineScanner Lines(FD);
+    while (char *Line = Lines.nextLine()) {
+      char *EndPtr;
+      uint64_t Start = strtoull(Line, &EndPtr, 16);
+      // Addresses are all zero if they were hidden (kptr_restrict).
+      if (EndPtr == Line || *EndPtr != ' ' || !Start)
+        continue;
+      char Type = EndPtr[1];
+      if ((Type != 't' && Type != 'T') || EndPtr[2] != ' ')
+        continue;
+      // Symbols of modules are followed by a tab and "[module]".
+      char *Name = EndPtr + 3;
+      Name[strcspn(Name, "\t\r")] = '\0';
+      if (*Name)
+        push_back({Start, Start, Name});
+    }
+    close(FD);
+
+    // Several names (aliases) may share an address; keep the first.
+    std::stable_sort(begin(), end());
+    erase(std::unique(begin(), end(),
+                      [](const Symbol &A, const Symbol &B) {
+                        return A.Start == B.Start;
+                      }),
+          end());
+    for (size_t I = 0; I < size(); ++I)
+      (*this)[I].End = I + 1 < size() ? (*this)[I + 1].Start
+                                      : (*this)[I].Start + 0x1000;
+  }
+
+protected:
+  int splitLine(const std::string& line, std::vector<std::string>& output, char delim = ' ') {
+    std::stringstream ss(line);
+    std::string token;
+    while (std::getline(ss, token, delim)) {
+        output.push_back(token);
+    }
+    return (int)output.size();
+  }
+};
+
+//===----------------------------------------------------------------------===//
+// Targets
+//===----------------------------------------------------------------------===//
+
+#define EM_386 3
+#define EM_PPC64 21
+#define EM_ARM 40
+#define EM_X86_64 62
+#define EM_AARCH64 183
+#define EM_RISCV 243
+
+// Return the LLVM triple for code at Start on the given ELF machine, or
+// nullptr if the machine is not supported.
+static const char *getTripleForMachine(uint16_t Machine, bool Is64,
+                                       uint64_t Start) {
+  switch (Machine) {
+  case EM_386:
+    return "i386-unknown-linux-gnu";
+  case EM_X86_64:
+    return "x86_64-unknown-linux-gnu";
+  case EM_AARCH64:
+    return "aarch64-unknown-linux-gnu";
+  case EM_ARM: // Thumb functions have the low bit set.
+    return (Start & 1) ? "thumbv7-unknown-linux-gnueabi"
+                       : "armv7-unknown-linux-gnueabi";
+  case EM_RISCV:
+    return Is64 ? "riscv64-unknown-linux-gnu" : "riscv32-unknown-linux-gnu";
+  case EM_PPC64:
+    return "powerpc64le-unknown-linux-gnu";
+  }
+  return nullptr;
+}
+
+// Smallest instruction size for the machine, used to skip undecodable bytes.
+static unsigned getMinInstSizeForMachine(uint16_t Machine, uint64_t Start) {
+  switch (Machine) {
+  case EM_386: case EM_X86_64:
+    return 1;
+  case EM_ARM:
+    return (Start & 1) ? 2 : 4;
+  case EM_RISCV:
+    return 2;
+  }
+  return 4;
+}
+
+// Return the objdump options selecting the machine when disassembling raw
+// code, or nullptr if the machine is not supported.
+static const char *getObjdumpArchForMachine(uint16_t Machine,
+                                            uint64_t Start) {
+  switch (Machine) {
+  case EM_386:
+    return "-m i386";
+  case EM_X86_64:
+    return "-m i386:x86-64";
+  case EM_AARCH64:
+    return "-m aarch64";
+  case EM_ARM:
+    return (Start & 1) ? "-m arm -M force-thumb" : "-m arm";
+  case EM_RISCV:
+    return "-m riscv";
+  case EM_PPC64:
+    return "-m powerpc:common64 -EL";
+  }
+  return nullptr;
+}
+
+//===----------------------------------------------------------------------===//
+// JIT code
+//===----------------------------------------------------------------------===//
+
+// A function emitted by a JIT. Code points at a copy of its code if the JIT
+// recorded one (jitdump files do, perf maps do not).
+struct JITSymbol {
+  uint64_t Start, End;
+  uint64_t Time;
+  std::string Name;
+  size_t CodeOffset, CodeSize;
+
+  bool operator<(const JITSymbol &Other) const {
+    return Start < Other.Start ||
+           (Start == Other.Start && Time < Other.Time);
+  }
+};
+
+// The JIT-compiled functions of one process, as described by perf's
+// /tmp/perf-<pid>.map symbol file and the jit-<pid>.dump file written by the
+// JIT (see tools/perf/Documentation/jitdump-specification.txt in Linux).
+// Symbols are kept sorted by address for lookup.
+class JITCode {
+public:
+  std::string Name;
+  // Path of the process's jitdump file, as recorded by perf when the JIT
+  // mapped it.
+  std::string DumpFile;
+  bool Loaded = false;
+  size_t MapID = ~0ULL;
+
+  std::vector<JITSymbol> Symbols;
+  std::string Dump;
+  uint16_t Machine = 0;
+
+  void load(const std::string &BinaryCacheRoot, uint32_t Pid) {
+    Symbols.clear();
+    Dump.clear();
+    readPerfMap(BinaryCacheRoot + "/tmp/perf-" + std::to_string(Pid) +
+                ".map");
+    if (!DumpFile.empty())
+      readJITDump(BinaryCacheRoot + DumpFile);
+    std::sort(Symbols.begin(), Symbols.end());
+    Loaded = true;
+  }
+
+  // Return the function containing PC at Time, or nullptr. If code was
+  // loaded at the same address more than once, the most recent load before
+  // Time is used.
+  const JITSymbol *lookup(uint64_t PC, uint64_t Time) const {
+    auto I = std::upper_bound(
+        Symbols.begin(), Symbols.end(), PC,
+        [](uint64_t PC, const JITSymbol &S) { return PC < S.Start; });
+    if (I == Symbols.begin())
+      return nullptr;
+    auto Best = --I;
+    for (auto J = I; J->Start == I->Start; --J) {
+      if (J->Time <= Time) {
+        Best = J;
+        break;
+      }
+      if (J == Symbols.begin())
+        break;
+    }
+    return PC < Best->End ? &*Best : nullptr;
+  }
+
+  const uint8_t *getCode(const JITSymbol &S) const {
+    return S.CodeSize ? (const uint8_t *)Dump.data() + S.CodeOffset : nullptr;
+  }
+
+  // Is Filename a jitdump file? The JIT maps it executable purely so that
+  // perf records where it is.
+  static bool isJITDump(const char *Filename) {
+    const char *Base = strrchr(Filename, '/');
+    Base = Base ? Base + 1 : Filename;
+    size_t Len = strlen(Base);
+    return !strncmp(Base, "jit-", 4) && Len > 9 &&
+           !strcmp(Base + Len - 5, ".dump");
+  }
+
+  // Could code in a mapping of Filename have been emitted by a JIT?
+  static bool isAnonymous(const char *Filename) {
+    return !strncmp(Filename, "//anon", 6) || !strncmp(Filename, "[anon", 5) ||
+           !strncmp(Filename, "/memfd:", 7) || !strcmp(Filename, "[heap]");
+  }
+
+private:
+  // Each line of a perf map is "START SIZE name", in hex.
+  void readPerfMap(const std::string &Filename) {
+    FILE *F = fopen(Filename.c_str(), "r");
+    if (!F)
+      return;
+    char *Line = nullptr;
+    size_t LineLen = 0;
+    while (getline(&Line, &LineLen, F) != -1) {
+      char *EndPtr;
+      uint64_t Start = strtoull(Line, &EndPtr, 16);
+      if (*EndPtr != ' ')
+        continue;
+      uint64_t Size = strtoull(EndPtr, &EndPtr, 16);
+      if (*EndPtr != ' ')
+        continue;
+      std::string Name(EndPtr + 1);
+      while (!Name.empty() && (Name.back() == '\n' || Name.back() == '\r'))
+        Name.pop_back();
+      Symbols.push_back({Start, Start + Size, 0, Name, 0, 0});
+    }
+    free(Line);
+    fclose(F);
+  }
+
+  template <typename T> T read(size_t Offset) const {
+    T X;
+    memcpy(&X, Dump.data() + Offset, sizeof(T));
+    return X;
+  }
+
+  void readJITDump(const std::string &Filename) {
+    FILE *F = fopen(Filename.c_str(), "rb");
+    if (!F)
+      return;
+    char Buf[65536];
+    size_t N;
+    while ((N = fread(Buf, 1, sizeof(Buf), F)) > 0)
+      Dump.append(Buf, N);
+    fclose(F);
+
+    // Files written with the other byte order are not supported.
+    const uint32_t JITDumpMagic = 0x4A695444; // "JiTD"
+    if (Dump.size() < 40 || read<uint32_t>(0) != JITDumpMagic)
+      return;
+    Machine = (uint16_t)read<uint32_t>(12);
+
+    const uint32_t JIT_CODE_LOAD = 0, JIT_CODE_MOVE = 1;
+    // Symbols by code_index, for JIT_CODE_MOVE.
+    std::map<uint64_t, size_t> Loads;
+    for (size_t Offset = read<uint32_t>(8); Offset + 16 <= Dump.size();) {
+      uint32_t ID = read<uint32_t>(Offset);
+      uint32_t Size = read<uint32_t>(Offset + 4);
+      uint64_t Time = read<uint64_t>(Offset + 8);
+      if (Size < 16 || Offset + Size > Dump.size())
+        break;
+      size_t Body = Offset + 16, End = Offset + Size;
+
+      if (ID == JIT_CODE_LOAD && Body + 40 < End) {
+        uint64_t CodeAddr = read<uint64_t>(Body + 16);
+        uint64_t CodeSize = read<uint64_t>(Body + 24);
+        uint64_t CodeIndex = read<uint64_t>(Body + 32);
+        const char *Name = Dump.data() + Body + 40;
+        const char *NameEnd = (const char *)memchr(Name, 0, End - Body - 40);
+        if (NameEnd) {
+          size_t CodeOffset = NameEnd + 1 - Dump.data();
+          if (CodeOffset + CodeSize > End)
+            CodeOffset = CodeSize = 0;
+          Loads[CodeIndex] = Symbols.size();
+          Symbols.push_back({CodeAddr, CodeAddr + read<uint64_t>(Body + 24),
+                             Time, std::string(Name, NameEnd), CodeOffset,
+                             CodeSize});
+        }
+      } else if (ID == JIT_CODE_MOVE && Body + 48 <= End) {
+        auto L = Loads.find(read<uint64_t>(Body + 40));
+        if (L != Loads.end()) {
+          JITSymbol S = Symbols[L->second];
+          uint64_t NewAddr = read<uint64_t>(Body + 24);
+          S.End = NewAddr + (S.End - S.Start);
+          S.Start = NewAddr;
+          S.Time = Time;
+          L->second = Symbols.size();
+          Symbols.push_back(S);
+        }
+      }
+      Offset = End;
+    }
+  }
+};
+
+// Produces the disassembly of an address range one instruction at a time.
+class Disassembler {
+public:
+  virtual ~Disassembler() {}
+
+  // Start disassembling [Start, Stop) of M's binary. Returns false if this
+  // disassembler cannot handle the binary.
+  virtual bool reset(Map *M, uint64_t Start, uint64_t Stop) = 0;
+  // Advance to the next instruction and return its address. Returns an
+  // address >= Stop once the range is exhausted.
+  virtual uint64_t next() = 0;
+  virtual std::string getText() = 0;
+};
+
+class ObjdumpOutput : public Disassembler {
+public:
+  std::string Objdump, BinaryCacheRoot;
+  Subprocess Process;
+  const char *ThisText;
+  uint64_t ThisAddress;
+  uint64_t EndAddress;
+  // A file holding JIT code for objdump, removed once it has been read.
+  std::string TempFile;
+
+  ObjdumpOutput(std::string Objdump, std::string BinaryCacheRoot)
+    : Objdump(Objdump), BinaryCacheRoot(BinaryCacheRoot) {}
+  ~ObjdumpOutput() { close(); }
+
+  bool reset(Map *M, uint64_t Start, uint64_t Stop) override {
+    run({"-d"}, resolveBinary(BinaryCacheRoot, *M), Start, Stop);
+    return true;
+  };
+
+  // Disassemble the code of a JIT-compiled function, which only exists in
+  // the jitdump file, by passing it to objdump as a raw binary.
+  bool reset(const JITCode &J, const JITSymbol &S) {
+#ifdef _WIN32
+    return false;
+#else
+    const char *Arch = getObjdumpArchForMachine(J.Machine, S.Start);
+    if (!Arch || !J.getCode(S))
+      return false;
+    char Filename[] = "/tmp/lnt-jit-XXXXXX";
+    int FD = mkstemp(Filename);
+    if (FD < 0)
+      return false;
+    bool Written =
+        write(FD, J.getCode(S), S.CodeSize) == (ssize_t)S.CodeSize;
+    ::close(FD);
+    if (!Written) {
+      remove(Filename);
+      return false;
+    }
+
+    uint64_t Start = S.Start & ~(uint64_t)1;
+    char VMA[32];
+    sprintf(VMA, "%#" PRIx64, Start);
+    std::vector<std::string> Args = {"-D", "-b", "binary"};
+    appendWords(Args, Arch);
+    Args.push_back(std::string("--adjust-vma=") + VMA);
+    run(Args, Filename, Start, S.End);
+    TempFile = Filename;
+    return true;
+#endif
+  }
+
+  std::string getText() override { return ThisText; }
+
+  uint64_t next() override {
+    getLine();
+    return ThisAddress;
+  }
+
+  void run(const std::vector<std::string> &ExtraArgs,
+           const std::string &Filename, uint64_t Start, uint64_t Stop) {
+    ThisAddress = 0;
+    ThisText = "";
+    close();
+
+    char buf1[32], buf2[32];
+    sprintf(buf1, "%#" PRIx64, Start);
+    sprintf(buf2, "%#" PRIx64, Stop + 4);
+
+    std::vector<std::string> Args;
+    appendWords(Args, Objdump);
+    Args.insert(Args.end(), ExtraArgs.begin(), ExtraArgs.end());
+    Args.insert(Args.end(), {"--no-show-raw-insn",
+                             std::string("--start-address=") + buf1,
+                             std::string("--stop-address=") + buf2, Filename});
+    Process.start(Args);
+
+    EndAddress = Stop;
+  }
+
+  void close() {
+    Process.close();
+    if (!TempFile.empty()) {
+      remove(TempFile.c_str());
+      TempFile.clear();
+    }
+  }
+
+  void getLine() {
+    while (true) {
+      char *Line = Process.nextLine();
+      if (!Line) {
+        ThisAddress = EndAddress;
+        ThisText = "";
+        return;
+      }
+      // "<address>:<text>", split in place.
+      char *One = Line + strspn(Line, ":");
+      char *Colon = strchr(One, ':');
+      if (!*One || !Colon || !Colon[1])
+        continue;
+      *Colon = '\0';
+      char *Two = Colon + 1;
+      char *EndPtr = NULL;
+      uint64_t Address = strtoull(One, &EndPtr, 16);
+      if (EndPtr != Colon)
+        continue;
+
+      ThisAddress = Address;
+      ThisText = Two;
+      break;
+    }
+  }
+};
+
+static std::string formatHex(uint64_t Value, const char *Prefix = "") {
+  char Buf[32];
+  snprintf(Buf, sizeof(Buf), "%s%" PRIx64, Prefix, Value);
+  return Buf;
+}
+
+#ifdef HAVE_LLVM_DISASSEMBLER
+//===----------------------------------------------------------------------===//
+// In-process disassembly with LLVM
+//===----------------------------------------------------------------------===//
+
+// A read-only mapping of an ELF file, giving access to the bytes of its
+// loadable segments by virtual address.
+class ELFImage {
+public:
+  ELFImage(const std::string &Filename) : Buffer(nullptr), BufferLen(0) {
+#ifndef _WIN32
+    int fd = open(Filename.c_str(), O_RDONLY);
+    if (fd < 0)
+      return;
+    struct stat sb;
+    if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+      BufferLen = (size_t)sb.st_size;
+      void *P = mmap(NULL, BufferLen, PROT_READ, MAP_PRIVATE, fd, 0);
+      Buffer = P == MAP_FAILED ? nullptr : (unsigned char *)P;
+    }
+    close(fd);
+    if (Buffer)
+      readSegments();
+#endif
+  }
+  ~ELFImage() {
+#ifndef _WIN32
+    if (Buffer)
+      munmap(Buffer, BufferLen);
+#endif
+  }
+
+  // Return the LLVM triple for code at Start, or nullptr if the machine is
+  // not supported.
+  const char *getTriple(uint64_t Start) const {
+    if (Segments.empty())
+      return nullptr;
+    return getTripleForMachine(Machine, Is64, Start);
+  }
+
+  // Thumb function addresses carry the mode in their low bit.
+  bool isThumb(uint64_t Start) const {
+    return Machine == EM_ARM && (Start & 1);
+  }
+
+  unsigned getMinInstSize(uint64_t Start) const {
+    return getMinInstSizeForMachine(Machine, Start);
+  }
+
+  // Return the function symbol that VAddr lies in, or nullptr. The symbol
+  // table (or failing that, the dynamic one) is only read when first needed.
+  const Symbol *findSymbol(uint64_t VAddr) {
+    if (!SymbolsRead) {
+      readSymbols();
+      SymbolsRead = true;
+    }
+    return lookupSymbol(Symbols, VAddr);
+  }
+
+  // Return the file contents at VAddr, and in Size the number of bytes
+  // available from there to the end of the containing segment.
+  const uint8_t *getBytes(uint64_t VAddr, uint64_t &Size) const {
+    for (auto &S : Segments) {
+      if (VAddr < S.VAddr || VAddr >= S.VAddr + S.FileSize)
+        continue;
+      uint64_t Offset = S.Offset + (VAddr - S.VAddr);
+      if (Offset >= BufferLen)
+        return nullptr;
+      Size = std::min<uint64_t>(S.VAddr + S.FileSize - VAddr,
+                                BufferLen - Offset);
+      return Buffer + Offset;
+    }
+    return nullptr;
+  }
+
+private:
+  struct Segment {
+    uint64_t VAddr, FileSize, Offset;
+  };
+
+  template <typename T> T read(size_t Offset) const {
+    T X;
+    memcpy(&X, Buffer + Offset, sizeof(T));
+    return X;
+  }
+
+  void readSegments() {
+    // Only little-endian ELF files are handled; anything else is left to
+    // objdump.
+    if (BufferLen < 52 || memcmp(Buffer, "\x7f" "ELF", 4) || Buffer[5] != 1)
+      return;
+    Is64 = Buffer[4] == 2;
+    Machine = read<uint16_t>(18);
+    uint64_t PhOff = Is64 ? read<uint64_t>(32) : read<uint32_t>(28);
+    uint16_t PhEntSize = read<uint16_t>(Is64 ? 54 : 42);
+    uint16_t PhNum = read<uint16_t>(Is64 ? 56 : 44);
+    for (unsigned I = 0; I < PhNum; ++I) {
+      size_t Ph = PhOff + I * PhEntSize;
+      if (Ph + (Is64 ? 56 : 32) > BufferLen)
+        break;
+      if (read<uint32_t>(Ph) != 1) // PT_LOAD
+        continue;
+      Segment S;
+      if (Is64) {
+        S.Offset = read<uint64_t>(Ph + 8);
+        S.VAddr = read<uint64_t>(Ph + 16);
+        S.FileSize = read<uint64_t>(Ph + 32);
+      } else {
+        S.Offset = read<uint32_t>(Ph + 4);
+        S.VAddr = read<uint32_t>(Ph + 8);
+        S.FileSize = read<uint32_t>(Ph + 16);
+      }
+      Segments.push_back(S);
+    }
+  }
+
+  void readSymbols() {
+    if (Segments.empty())
+      return;
+    uint64_t ShOff = Is64 ? read<uint64_t>(40) : read<uint32_t>(32);
+    uint16_t ShEntSize = read<uint16_t>(Is64 ? 58 : 46);
+    uint16_t ShNum = read<uint16_t>(Is64 ? 60 : 48);
+    size_t ShSize = Is64 ? 64 : 40;
+    if (!ShOff || ShEntSize < ShSize || ShOff + ShNum * ShEntSize > BufferLen)
+      return;
+    auto Section = [&](unsigned I) { return ShOff + I * ShEntSize; };
+    auto Offset = [&](size_t Sh) {
+      return Is64 ? read<uint64_t>(Sh + 24) : read<uint32_t>(Sh + 16);
+    };
+    auto Size = [&](size_t Sh) {
+      return Is64 ? read<uint64_t>(Sh + 32) : read<uint32_t>(Sh + 20);
+    };
+    for (uint32_t Type : {2u /* SHT_SYMTAB */, 11u /* SHT_DYNSYM */}) {
+      for (unsigned I = 0; I < ShNum; ++I) {
+        size_t Sh = Section(I);
+        uint32_t Link = read<uint32_t>(Sh + (Is64 ? 40 : 24));
+        if (read<uint32_t>(Sh + 4) != Type || Link >= ShNum)
+          continue;
+        uint64_t SymOff = Offset(Sh), SymSize = Size(Sh);
+        uint64_t StrOff = Offset(Section(Link)), StrSize = Size(Section(Link));
+        if (SymOff + SymSize > BufferLen || StrOff + StrSize > BufferLen)
+          continue;
+        size_t EntSize = Is64 ? 24 : 16;
+        for (uint64_t E = SymOff; E + EntSize <= SymOff + SymSize;
+             E += EntSize) {
+          uint32_t NameOff = read<uint32_t>(E);
+          uint8_t Info = Buffer[E + (Is64 ? 4 : 12)];
+          uint16_t Shndx = read<uint16_t>(E + (Is64 ? 6 : 14));
+          uint64_t Value = Is64 ? read<uint64_t>(E + 8) : read<uint32_t>(E + 4);
+          uint64_t SymLen =
+              Is64 ? read<uint64_t>(E + 16) : read<uint32_t>(E + 8);
+          if ((Info & 0xf) != 2 /* STT_FUNC */ || !Shndx || NameOff >= StrSize)
+            continue;
+          // Thumb functions have the low bit of their address set.
+          if (Machine == EM_ARM)
+            Value &= ~1ULL;
+          const char *Name = (const char *)Buffer + StrOff + NameOff;
+          Symbols.push_back(
+              {Value, Value + std::max<uint64_t>(SymLen, 1),
+               std::string(Name, strnlen(Name, StrSize - NameOff))});
+        }
+      }
+      if (!Symbols.empty())
+        break;
+    }
+    std::sort(Symbols.begin(), Symbols.end());
+  }
+
+  unsigned char *Buffer;
+  size_t BufferLen;
+  bool Is64 = false;
+  uint16_t Machine = 0;
+  std::vector<Segment> Segments;
+  bool SymbolsRead = false;
+  std::vector<Symbol> Symbols;
+};
+
+class LLVMDisassemblerOutput : public Disassembler {
+public:
+  LLVMDisassemblerOutput(std::string BinaryCacheRoot)
+    : BinaryCacheRoot(BinaryCacheRoot) {
+    static bool Initialized = false;
+    if (!Initialized) {
+      LLVMInitializeAllTargetInfos();
+      LLVMInitializeAllTargetMCs();
+      LLVMInitializeAllDisassemblers();
+      Initialized = true;
+    }
+  }
+  ~LLVMDisassemblerOutput() {
+    for (auto &KV : Contexts)
+      if (KV.second)
+        LLVMDisasmDispose(KV.second);
+  }
+
+  bool reset(Map *M, uint64_t Start, uint64_t Stop) override {
+    // Images are cached, as many symbols are disassembled from each binary.
+    std::string Path = resolveBinary(BinaryCacheRoot, *M);
+    auto &Image = Images[Path];
+    if (!Image)
+      Image.reset(new ELFImage(Path));
+
+    const char *Triple = Image->getTriple(Start);
+    if (!Triple)
+      return false;
+    unsigned MinInstSize = Image->getMinInstSize(Start);
+    if (Image->isThumb(Start))
+      Start &= ~1ULL;
+    uint64_t Size = 0;
+    const uint8_t *Bytes = Image->getBytes(Start, Size);
+    CurrentImage = Image.get();
+    CurrentJIT = nullptr;
+    return reset(Triple, MinInstSize, Bytes, Size, Start, Stop);
+  }
+
+  // Disassemble the code of a JIT-compiled function from its jitdump copy.
+  bool reset(const JITCode &J, const JITSymbol &S) {
+    const char *Triple = getTripleForMachine(J.Machine, true, S.Start);
+    if (!Triple)
+      return false;
+    CurrentImage = nullptr;
+    CurrentJIT = &J;
+    return reset(Triple, getMinInstSizeForMachine(J.Machine, S.Start),
+                 J.getCode(S), S.CodeSize, S.Start & ~1ULL, S.End);
+  }
+
+  // Disassemble Size bytes of code at Bytes, loaded at Start, for Triple.
+  bool reset(const char *Triple, unsigned MinInstSize, const uint8_t *Bytes,
+             uint64_t Size, uint64_t Start, uint64_t Stop) {
+    auto It = Contexts.find(Triple);
+    if (It == Contexts.end()) {
+      auto DC = LLVMCreateDisasm(Triple, this, 0, nullptr, lookUpSymbol);
+      if (DC)
+        LLVMSetDisasmOptions(DC, LLVMDisassembler_Option_PrintImmHex);
+      It = Contexts.insert({Triple, DC}).first;
+    }
+    Context = It->second;
+    if (!Context || !Bytes)
+      return false;
+    this->MinInstSize = MinInstSize;
+    this->Bytes = Bytes;
+    this->Size = std::min(Size, Stop - Start);
+    Address = Start;
+    EndAddress = Stop;
+    Offset = 0;
+    InstSize = 0;
+    return true;
+  }
+
+  uint64_t next() override {
+    Offset += InstSize;
+    if (Offset >= Size)
+      return EndAddress;
+
+    char Buf[256];
+    HasBranchTarget = false;
+    InstSize = LLVMDisasmInstruction(Context, (uint8_t *)Bytes + Offset,
+                                     Size - Offset, Address + Offset, Buf,
+                                     sizeof(Buf));
+    if (InstSize) {
+      Text = Buf;
+      if (HasBranchTarget) {
+        // The target was printed as the last operand, as an address, and
+        // for ADRP with the page in a comment.
+        size_t Comment = Text.find("//");
+        if (Comment != std::string::npos)
+          Text.erase(Text.find_last_not_of(" \t", Comment - 1) + 1);
+        size_t Operand = Text.find_last_of(" \t,") + 1;
+        Text.replace(Operand, std::string::npos, describeTarget(BranchTarget));
+      }
+    } else {
+      InstSize = MinInstSize;
+      Text = "\t(bad)";
+    }
+    return Address + Offset;
+  }
+
+  std::string getText() override { return Text; }
+
+private:
+  // Called by LLVM for operands that may refer to a symbol. Knowing of a
+  // symbol lookup makes LLVM resolve branch targets (and AArch64 ADRP
+  // pages) to absolute addresses instead of printing them as offsets; no
+  // symbol is ever returned, so other operands are printed as without it.
+  static const char *lookUpSymbol(void *DisInfo, uint64_t ReferenceValue,
+                                  uint64_t *ReferenceType,
+                                  uint64_t ReferencePC,
+                                  const char **ReferenceName) {
+    auto *This = (LLVMDisassemblerOutput *)DisInfo;
+    if (*ReferenceType == LLVMDisassembler_ReferenceType_In_Branch) {
+      This->BranchTarget = ReferenceValue;
+      This->HasBranchTarget = true;
+    } else if (*ReferenceType == LLVMDisassembler_ReferenceType_In_ARM64_ADRP) {
+      // ReferenceValue is the encoded instruction; objdump prints the page.
+      uint64_t Imm = ((ReferenceValue >> 29) & 3) |
+                     (((ReferenceValue >> 5) & 0x7ffff) << 2);
+      int64_t Pages = (int64_t)(Imm << 43) >> 43;
+      This->BranchTarget = (ReferencePC & ~0xfffULL) + Pages * 4096;
+      This->HasBranchTarget = true;
+    }
+    *ReferenceType = LLVMDisassembler_ReferenceType_InOut_None;
+    *ReferenceName = nullptr;
+    return nullptr;
+  }
+
+  // Format Target as objdump does: "401015 <bar+0xc>", or just the address
+  // if it is not in a known function.
+  std::string describeTarget(uint64_t Target) {
+    std::string Name;
+    uint64_t SymStart = 0;
+    if (CurrentJIT) {
+      if (const JITSymbol *S = CurrentJIT->lookup(Target, ~0ULL)) {
+        Name = S->Name;
+        SymStart = S->Start & ~1ULL;
+      }
+    } else if (CurrentImage) {
+      if (const Symbol *S = CurrentImage->findSymbol(Target)) {
+        Name = S->Name;
+        SymStart = S->Start;
+      }
+    }
+    std::string Result = formatHex(Target);
+    if (Name.empty())
+      return Result;
+    Result += " <" + Name;
+    if (Target != SymStart)
+      Result += formatHex(Target - SymStart, "+0x");
+    return Result + ">";
+  }
+
+  std::string BinaryCacheRoot;
+  std::map<std::string, std::unique_ptr<ELFImage>> Images;
+  std::map<std::string, LLVMDisasmContextRef> Contexts;
+
+  LLVMDisasmContextRef Context = nullptr;
+  ELFImage *CurrentImage = nullptr;
+  const JITCode *CurrentJIT = nullptr;
+  const uint8_t *Bytes = nullptr;
+  uint64_t Address = 0, EndAddress = 0, Size = 0, Offset = 0, InstSize = 0;
+  unsigned MinInstSize = 1;
+  std::string Text;
+  bool HasBranchTarget = false;
+  uint64_t BranchTarget = 0;
+};
+#endif
+
+//===----------------------------------------------------------------------===//
+// Instruction normalization
+//===----------------------------------------------------------------------===//
+
+// Disassembly is normalized so that the same code gets the same text wherever
+// it was loaded, and so can be compared between builds: the instruction
+// encoding printed by objdump is dropped, branch targets within the function
+// become offsets from its start, and addresses outside it (calls, tail calls
+// and PC-relative data) are replaced by the symbol they refer to.
+
+// The name of the symbol of Syms or JIT that Addr lies in, or "?".
+static std::string findSymbolName(const std::vector<Symbol> *Syms,
+                                  const JITCode *JIT, uint64_t Addr) {
+  if (JIT) {
+    const JITSymbol *S = JIT->lookup(Addr, ~0ULL);
+    return S ? S->Name : "?";
+  }
+  if (Syms) {
+    if (const Symbol *S = lookupSymbol(*Syms, Addr))
+      return S->Name;
+  }
+  return "?";
+}
+
+// Parse an immediate as printed by objdump ("401000", "0x3010", "12305") or
+// LLVM ("0x10", "-0x1d", "#0x10"). Numbers without a "0x" prefix are hex if
+// BareHex is true and decimal otherwise. Returns false if S is not one.
+static bool parseImmediate(const std::string &S, bool BareHex,
+                           int64_t &Value) {
+  size_t I = 0;
+  if (I < S.size() && S[I] == '#')
+    ++I;
+  bool Negative = I < S.size() && S[I] == '-';
+  if (Negative)
+    ++I;
+  unsigned Base = BareHex ? 16 : 10;
+  if (S.compare(I, 2, "0x") == 0) {
+    I += 2;
+    Base = 16;
+  }
+  if (I == S.size())
+    return false;
+  uint64_t V = 0;
+  for (; I < S.size(); ++I) {
+    unsigned char C = S[I];
+    unsigned Digit = isdigit(C) ? C - '0'
+                                : isxdigit(C) ? tolower(C) - 'a' + 10 : Base;
+    if (Digit >= Base)
+      return false;
+    V = V * Base + Digit;
+  }
+  Value = Negative ? -(int64_t)V : (int64_t)V;
+  return true;
+}
+
+// Normalize Text, the disassembly of the instruction at PC of a function
+// spanning [Start, End). NextPC is the address of the next instruction.
+static std::string normalizeInstruction(const std::string &Text, uint64_t PC,
+                                        uint64_t NextPC, uint64_t Start,
+                                        uint64_t End,
+                                        const std::vector<Symbol> *Syms,
+                                        const JITCode *JIT) {
+  // Runs of spaces only align columns, whose width depends on the addresses.
+  std::string T;
+  for (char C : Text)
+    if (C != ' ' || T.empty() || T.back() != ' ')
+      T += C;
+
+  // objdump prints the encoding first: "\ta9be4ff4 \tstp ..." (binutils) or
+  // " 48 85 ff      \ttestq ..." (llvm-objdump).
+  if (!T.empty() && (T[0] == '\t' || T[0] == ' ')) {
+    size_t I = 1;
+    while (I < T.size() && (isxdigit((unsigned char)T[I]) || T[I] == ' '))
+      ++I;
+    if (I > 2 && I < T.size() && T[I] == '\t' && T[I - 1] == ' ')
+      T.replace(0, I + 1, "\t");
+  }
+
+  // objdump annotates addresses with their symbol: "401015 <bar+0xc>".
+  bool Annotated = false;
+  for (size_t Open = T.find(" <"); Open != std::string::npos;
+       Open = T.find(" <", Open + 2)) {
+    size_t NumEnd = Open;
+    size_t NumStart = NumEnd;
+    while (NumStart > 0 && isxdigit((unsigned char)T[NumStart - 1]))
+      --NumStart;
+    bool Prefixed = NumStart >= 2 && T.compare(NumStart - 2, 2, "0x") == 0;
+    int64_t Target;
+    if (NumStart == NumEnd ||
+        !parseImmediate(T.substr(NumStart, NumEnd - NumStart), true, Target))
+      continue;
+    if (Prefixed)
+      NumStart -= 2;
+    Annotated = true;
+    std::string Replacement;
+    if ((uint64_t)Target >= Start && (uint64_t)Target < End)
+      Replacement = formatHex(Target - Start, Prefixed ? "0x" : "") + " ";
+    T.replace(NumStart, NumEnd - NumStart + 1, Replacement);
+    Open = NumStart + Replacement.size() - 1;
+  }
+
+  // PC-relative data: "0x1ff1(%rip)". objdump names the target in a
+  // comment, which was dealt with above.
+  size_t Rip = T.find("(%rip)");
+  if (Rip != std::string::npos) {
+    size_t DispStart = Rip;
+    while (DispStart > 0 && (isxdigit((unsigned char)T[DispStart - 1]) ||
+                             T[DispStart - 1] == 'x' ||
+                             T[DispStart - 1] == '-'))
+      --DispStart;
+    int64_t Disp;
+    if (parseImmediate(T.substr(DispStart, Rip - DispStart), false, Disp)) {
+      std::string Name =
+          Annotated ? "" : "<" + findSymbolName(Syms, JIT, NextPC + Disp) + ">";
+      T.replace(DispStart, Rip - DispStart, Name == "<?>" ? "" : Name);
+    }
+  }
+  if (Annotated)
+    return T;
+
+  // For targets whose branches it does not resolve to addresses (see
+  // LLVMDisassemblerOutput::lookUpSymbol), the LLVM disassembler prints
+  // branch targets as offsets: from the next instruction on x86 and from
+  // the branch itself elsewhere. Those within the function do not depend on
+  // where it was loaded.
+  size_t MnemonicStart = T.find_first_not_of(" \t");
+  if (MnemonicStart == std::string::npos)
+    return T;
+  size_t MnemonicEnd = T.find_first_of(" \t", MnemonicStart);
+  if (MnemonicEnd == std::string::npos)
+    return T;
+  std::string Mnemonic = T.substr(MnemonicStart, MnemonicEnd - MnemonicStart);
+  uint64_t Base;
+  if (Mnemonic == "call" || Mnemonic == "callq" || Mnemonic == "jmp" ||
+      Mnemonic == "jmpq")
+    Base = NextPC;
+  else if (Mnemonic == "b" || Mnemonic == "bl" || Mnemonic == "j" ||
+           Mnemonic == "jal")
+    Base = PC;
+  else
+    return T;
+  size_t OperandStart = T.find_last_of(" \t,") + 1;
+  int64_t Offset;
+  if (T.compare(OperandStart, 1, "#") != 0 &&
+      T.compare(OperandStart, 2, "0x") != 0 &&
+      T.compare(OperandStart, 3, "-0x") != 0)
+    return T;
+  if (!parseImmediate(T.substr(OperandStart), true, Offset))
+    return T;
+  uint64_t Target = Base + Offset;
+  if (Target >= Start && Target < End)
+    return T;
+  T.replace(OperandStart, std::string::npos,
+            "<" + findSymbolName(Syms, JIT, Target) + ">");
+  return T;
+}
+
+// FNV-1a, over the normalized instructions of a function.
+static uint64_t hashText(uint64_t Hash, const std::string &Text) {
+  for (unsigned char C : Text)
+    Hash = (Hash ^ C) * 0x100000001b3ULL;
+  return (Hash ^ '\n') * 0x100000001b3ULL;
+}
+
+//===----------------------------------------------------------------------===//
+// Column - a read-only uint64 array exported through the buffer protocol
+//===----------------------------------------------------------------------===//
+
+#ifndef STANDALONE
+struct ColumnObject {
+  PyObject_HEAD
+  std::vector<uint64_t> *Data;
+  int NDim;
+  Py_ssize_t Shape[2];
+  Py_ssize_t Strides[2];
+};
+
+static PyTypeObject ColumnType;
+
+// Create a Column taking the contents of Data. If NumCols is nonzero the
+// column is two-dimensional, with Data.size() / NumCols rows.
+static PyObject *createColumn(std::vector<uint64_t> &Data, size_t NumCols) {
+  auto *C = PyObject_New(ColumnObject, &ColumnType);
+  if (!C)
+    return nullptr;
+  C->Data = new std::vector<uint64_t>();
+  C->Data->swap(Data);
+  if (NumCols) {
+    C->NDim = 2;
+    C->Shape[0] = C->Data->size() / NumCols;
+    C->Shape[1] = NumCols;
+    C->Strides[0] = NumCols * sizeof(uint64_t);
+    C->Strides[1] = sizeof(uint64_t);
+  } else {
+    C->NDim = 1;
+    C->Shape[0] = C->Data->size();
+    C->Strides[0] = sizeof(uint64_t);
+  }
+  return (PyObject *)C;
+}
+
+static void Column_dealloc(ColumnObject *Self) {
+  delete Self->Data;
+  PyObject_Del(Self);
+}
+
+static int Column_getbuffer(ColumnObject *Self, Py_buffer *View, int Flags) {
+  static uint64_t Empty;
+  if (Flags & PyBUF_WRITABLE) {
+    PyErr_SetString(PyExc_BufferError, "cPerf.Column is read-only");
+    View->obj = nullptr;
+    return -1;
+  }
+  View->obj = (PyObject *)Self;
+  Py_INCREF(Self);
+  View->buf = Self->Data->empty() ? &Empty : Self->Data->data();
+  View->len = Self->Data->size() * sizeof(uint64_t);
+  View->readonly = 1;
+  View->itemsize = sizeof(uint64_t);
+  View->format = (Flags & PyBUF_FORMAT) ? (char *)"Q" : nullptr;
+  View->ndim = Self->NDim;
+  View->shape = (Flags & PyBUF_ND) ? Self->Shape : nullptr;
+  View->strides = (Flags & PyBUF_STRIDES) ? Self->Strides : nullptr;
+  View->suboffsets = nullptr;
+  View->internal = nullptr;
+  return 0;
+}
+
+static Py_ssize_t Column_length(ColumnObject *Self) { return Self->Shape[0]; }
+
+static PyBufferProcs ColumnBufferProcs;
+static PySequenceMethods ColumnSequenceMethods;
+
+static int initColumnType() {
+  ColumnBufferProcs.bf_getbuffer = (getbufferproc)Column_getbuffer;
+  ColumnSequenceMethods.sq_length = (lenfunc)Column_length;
+
+  ColumnType.tp_name = "cPerf.Column";
+  ColumnType.tp_basicsize = sizeof(ColumnObject);
+  ColumnType.tp_dealloc = (destructor)Column_dealloc;
+  ColumnType.tp_as_buffer = &ColumnBufferProcs;
+  ColumnType.tp_as_sequence = &ColumnSequenceMethods;
+  ColumnType.tp_flags = Py_TPFLAGS_DEFAULT;
+  ColumnType.tp_doc = "Read-only uint64 array exported via the buffer protocol";
+  return PyType_Ready(&ColumnType);
+}
+#endif
+
+//===----------------------------------------------------------------------===//
+// PerfReader
+//===----------------------------------------------------------------------===//
+
+// A histogram of sample weights (for memory access samples, their latency in
+// cycles). Each power of two is split into four buckets, which keeps values to
+// within 25% in a few dozen buckets.
+class LatencyHistogram {
+public:
+  void add(uint64_t Weight) {
+    unsigned B = getBucket(Weight);
+    if (B >= Buckets.size())
+      Buckets.resize(B + 1);
+    ++Buckets[B];
+    ++Count;
+    Sum += Weight;
+  }
+
+  void add(const LatencyHistogram &Other) {
+    if (Other.Buckets.size() > Buckets.size())
+      Buckets.resize(Other.Buckets.size());
+    for (size_t B = 0; B < Other.Buckets.size(); ++B)
+      Buckets[B] += Other.Buckets[B];
+    Count += Other.Count;
+    Sum += Other.Sum;
+  }
+
+  bool empty() const { return Count == 0; }
+  uint64_t getMean() const { return Count ? Sum / Count : 0; }
+
+  // Return the P'th percentile (nearest rank) of the weights.
+  uint64_t getPercentile(double P) const {
+    uint64_t Rank = std::max<uint64_t>(1, (uint64_t)std::ceil(P * Count));
+    uint64_t Seen = 0;
+    for (size_t B = 0; B < Buckets.size(); ++B) {
+      Seen += Buckets[B];
+      if (Seen >= Rank)
+        return getBucketValue(B);
+    }
+    return getBucketValue(Buckets.size() - 1);
+  }
+
+private:
+  static unsigned getBucket(uint64_t Weight) {
+    if (Weight < 4)
+      return (unsigned)Weight;
+    unsigned Log2 = 63;
+    while (!(Weight >> Log2))
+      --Log2;
+    return 4 * (Log2 - 1) + ((Weight >> (Log2 - 2)) & 3);
+  }
+
+  // The middle of bucket B.
+  static uint64_t getBucketValue(size_t B) {
+    if (B < 4)
+      return B;
+    unsigned Log2 = (unsigned)(B / 4 + 1);
+    uint64_t Low = (4 + B % 4) << (Log2 - 2);
+    return Low + ((1ULL << (Log2 - 2)) >> 1);
+  }
+
+  std::vector<uint32_t> Buckets;
+  uint64_t Count = 0, Sum = 0;
+};
+
+// Counters derived from sample weights. Unlike event counts, these are not
+// summed over instructions and are not turned into percentages.
+static const char *LatencyCounterNames[] = {"latency-mean", "latency-p50",
+                                            "latency-p99"};
+
+static void setLatencyCounters(std::map<const char *, uint64_t> &Counters,
+                               const LatencyHistogram &H) {
+  Counters[LatencyCounterNames[0]] = H.getMean();
+  Counters[LatencyCounterNames[1]] = H.getPercentile(0.5);
+  Counters[LatencyCounterNames[2]] = H.getPercentile(0.99);
+}
+
+// Samples of data accesses to one address (or data object): the events they
+// counted, and how many of them were served by each level of the memory
+// hierarchy.
+struct DataAccesses {
+  std::map<const char *, uint64_t> Counters;
+  std::map<const char *, uint64_t> Levels;
+
+  void add(const DataAccesses &Other) {
+    for (auto &KV : Other.Counters)
+      Counters[KV.first] += KV.second;
+    for (auto &KV : Other.Levels)
+      Levels[KV.first] += KV.second;
+  }
+};
+
+// The PERF_MEM_LVL_* bits of perf_mem_data_src.mem_lvl, from the nearest
+// level to the furthest.
+#define PERF_MEM_LVL_MISS 0x04
+static const struct {
+  uint64_t Mask;
+  const char *Hit, *Miss;
+} MemoryLevels[] = {
+    {0x08, "L1", "L1-miss"},
+    {0x10, "LFB", "LFB-miss"},
+    {0x20, "L2", "L2-miss"},
+    {0x40, "L3", "L3-miss"},
+    {0x80, "RAM", "RAM-miss"},
+    {0x300, "remote-RAM", "remote-RAM-miss"},
+    {0xc00, "remote-cache", "remote-cache-miss"},
+    {0x1000, "IO", "IO-miss"},
+    {0x2000, "uncached", "uncached-miss"},
+};
+
+// Decode where in the memory hierarchy a sampled access was served from.
+static const char *getMemoryLevel(uint64_t DataSrc) {
+  uint64_t Level = (DataSrc >> 5) & 0x3fff;
+  for (auto &L : MemoryLevels)
+    if (Level & L.Mask)
+      return (Level & PERF_MEM_LVL_MISS) ? L.Miss : L.Hit;
+  return "unknown";
+}
+
+// A symbol with enough samples to be emitted, and its counters.
+struct KeptSymbol {
+  size_t MapID;
+  Symbol Sym;
+  std::map<const char *, uint64_t> Counters;
+};
+
+// Which samples to import, so that the work around what was meant to be
+// profiled (a test driver, warmup) does not count towards the totals. Empty
+// sets accept everything.
+struct SampleFilter {
+  std::set<uint32_t> Pids, Tids, Cpus;
+  // A regular expression searched for in the command name of the thread.
+  std::string Comm;
+  std::regex CommRegex;
+  // The window to accept samples in, in nanoseconds after the first sample.
+  uint64_t TimeStart = 0, TimeEnd = ~0ULL;
+
+  bool empty() const {
+    return Pids.empty() && Tids.empty() && Cpus.empty() && Comm.empty() &&
+           TimeStart == 0 && TimeEnd == ~0ULL;
+  }
+};
+
+// How much of each kept symbol to emit.
+enum DetailLevel {
+  DL_Functions,    // Per-function counters only.
+  DL_Addresses,    // Per-PC counters, disassembly deferred to view time.
+  DL_Instructions  // Per-instruction counters and disassembly.
+};
+
+class PerfReader {
+public:
+  PerfReader(const std::string &Filename, std::string Objdump,
+             std::string BinaryCacheRoot, DetailLevel Detail, bool Columnar,
+             bool NativeDisassembly, bool DataObjects, bool Normalize,
+             const SampleFilter &Filter = SampleFilter());
+  ~PerfReader();
+
+  void readHeader();
+  void readAttrs();
   void readEventDesc();
+  void readBuildIds();
   void readDataStream();
-  void registerNewMapping(unsigned char *Buf, const char *FileName);
+  void registerNewMapping(unsigned char *Buf, const char *FileName,
+                          const std::string &BuildID, bool Exec = true);
+  JITCode *getJITCode(uint32_t Pid);
+  size_t getJITMap(uint32_t Pid);
+  void setKernelSymbols(const std::string &Kallsyms,
+                        const std::string &Vmlinux);
+  size_t getKernelMap();
+  size_t getHypervisorMap();
+  void loadKernelSymbols(Map &M);
   unsigned char *readEvent(unsigned char *);
-  perf_event_sample parseEvent(unsigned char *Buf, uint64_t Layout);
+  bool acceptSample(const perf_event_sample &E, const EventLayout &Layout);
+  perf_event_sample parseEvent(unsigned char *Buf, const EventLayout &Layout);
+  void readCounts(const perf_event_sample &E, const EventLayout &Layout);
   void emitLine(uint64_t PC, std::map<const char *, uint64_t> *Counters,
                 const std::string &Text);
   void emitFunctionStart(std::string &Name);
@@ -657,103 +2722,252 @@ public:
                        std::map<const char *, uint64_t> &Counters);
   void emitTopLevelCounters();
   void emitMaps();
-  void emitSymbol(
+  void collectSymbols();
+  size_t getNumKeptSymbols() const { return KeptSymbols.size(); }
+  PyObject *emitKeptSymbol(size_t I);
+  PyObject *takeKeptSymbol(size_t I);
+  bool emitSymbol(
       Symbol &Sym, Map &M,
       std::map<uint64_t, std::map<const char *, uint64_t>>::iterator Event,
       std::map<const char *, uint64_t> &SymEvents);
+  void emitSymbolAddresses(
+      Symbol &Sym, Map &M,
+      std::map<uint64_t, std::map<const char *, uint64_t>> &MapEvents,
+      std::map<const char *, uint64_t> &SymEvents);
+  void addLatencyCounters(
+      std::map<uint64_t, LatencyHistogram> &PCLatencies, Symbol &Sym,
+      uint64_t VAddrToPCOffset,
+      std::map<uint64_t, std::map<const char *, uint64_t>> &MapEvents,
+      std::map<const char *, uint64_t> &SymEvents);
+  void emitDataObjects();
   PyObject *complete();
 
 private:
-  unsigned char *Buffer;
-#ifdef _WIN32
-  HANDLE hFile;
-  HANDLE hMapFile;
-#else
-  size_t BufferLen;
-#endif
+  perf_file_section *getFeatureSection(unsigned Feature);
 
+  std::unique_ptr<PerfInput> Input;
   perf_header *Header;
+  // The table of feature sections, which follows the data section.
+  perf_file_section *Features = nullptr;
   std::map<uint64_t, const char *> EventIDs;
-  std::map<uint64_t, uint64_t> EventLayouts;
+  std::map<uint64_t, EventLayout> EventLayouts;
   std::map<size_t, std::map<uint64_t, std::map<const char *, uint64_t>>> Events;
   std::map<const char *, uint64_t> TotalEvents;
   std::map<uint64_t, std::map<const char *, uint64_t>> TotalEventsPerMap;
+  // The last value read (PERF_SAMPLE_READ) of each event, by event ID, and
+  // what each event counted for the current sample.
+  std::map<uint64_t, uint64_t> ReadValues;
+  std::vector<std::pair<const char *, uint64_t>> SampleCounts;
+  // Sample weights by map and PC, for samples that had one.
+  std::map<size_t, std::map<uint64_t, LatencyHistogram>> Latencies;
+  LatencyHistogram TotalLatency;
   std::vector<Map> Maps;
   std::map<uint64_t, std::map<uint64_t, EventDesc>> CurrentMaps;
-
-  PyObject *Functions, *TopLevelCounters;
+  // The file names of maps, which records may not outlive.
+  std::unordered_set<std::string> MapFilenames;
+  // Mappings that are not executable, by time and start address, when data
+  // objects are collected.
+  std::map<uint64_t, std::map<uint64_t, EventDesc>> CurrentDataMaps;
+  // Data accesses by map and address for file-backed mappings, and by page
+  // for everything else (heap, stack and anonymous memory).
+  std::map<size_t, std::map<uint64_t, DataAccesses>> DataEvents;
+  std::map<uint64_t, DataAccesses> PageEvents;
+  std::map<std::string, std::string> BuildIDs;
+  // Symbol tables by build-id (or path, for binaries without one), as the
+  // same binary is often mapped several times.
+  std::map<std::string, std::unique_ptr<SymTabOutput>> SymbolTables;
+  std::map<std::string, std::unique_ptr<SymTabOutput>> ObjectTables;
+  // JIT-compiled code by pid. Each process with samples in JIT code gets a
+  // pseudo-map in Maps covering the whole address space.
+  std::map<uint32_t, JITCode> JITs;
+  // Samples taken in the kernel and in the hypervisor go to pseudo-maps of
+  // their own, covering the whole address space. Kernel symbols are read
+  // from a copy of /proc/kallsyms or from the vmlinux image, if given; the
+  // hypervisor is a single function.
+  size_t KernelMapID = ~0ULL, HypervisorMapID = ~0ULL;
+  std::string Kallsyms, Vmlinux;
+  SymTabOutput KernelSymbols, HypervisorSymbols;
+  bool KernelSymbolsLoaded = false;
+  // The address of the kernel's _text, from the MMAP event perf records for
+  // it, to relocate the symbols of vmlinux if the kernel was (KASLR).
+  uint64_t KernelTextAddress = 0;
+  std::vector<KeptSymbol> KeptSymbols;
+
+  PyObject *Functions, *TopLevelCounters, *DataObjectsDict;
   std::vector<PyObject*> Lines;
-  
+
+  // State for columnar output. Counters are assigned a column each, in
+  // TotalEvents order.
+  std::map<const char *, size_t> CounterColumns;
+  std::vector<uint64_t> LineAddresses, LineCounters, LineTextOffsets;
+  std::string TextPool;
+  std::unordered_map<std::string, uint64_t> TextPoolOffsets;
+
   std::string Objdump, BinaryCacheRoot;
+  DetailLevel Detail;
+  bool Columnar;
+  // Try the in-process disassembler before objdump, if it is available.
+  bool NativeDisassembly;
+  // Aggregate sampled data addresses by data object.
+  bool DataObjects;
+  // Emit disassembled functions with normalized instructions at offsets from
+  // the function start, and a hash of their code (see normalizeInstruction).
+  bool Normalize;
+  // The samples to import, and what is needed to apply it: the time of the
+  // first sample, the command name of each thread, and whether it matches.
+  SampleFilter Filter;
+  uint64_t FirstSampleTime = ~0ULL;
+  std::unordered_map<uint32_t, std::string> Comms;
+  std::unordered_map<uint32_t, bool> CommMatches;
+#ifdef HAVE_LLVM_DISASSEMBLER
+  std::unique_ptr<LLVMDisassemblerOutput> Native;
+#endif
 };
 
 PerfReader::PerfReader(const std::string &Filename, std::string Objdump,
-                       std::string BinaryCacheRoot)
-    : Objdump(Objdump), BinaryCacheRoot(BinaryCacheRoot) {
+                       std::string BinaryCacheRoot, DetailLevel Detail,
+                       bool Columnar, bool NativeDisassembly, bool DataObjects,
+                       bool Normalize, const SampleFilter &Filter)
+    : KernelSymbols(Objdump, BinaryCacheRoot),
+      HypervisorSymbols(Objdump, BinaryCacheRoot), Objdump(Objdump),
+      BinaryCacheRoot(BinaryCacheRoot), Detail(Detail), Columnar(Columnar),
+      NativeDisassembly(NativeDisassembly), DataObjects(DataObjects),
+      Normalize(Normalize), Filter(Filter) {
   TopLevelCounters = PyDict_New();
   Functions = PyDict_New();
-#ifdef _WIN32
-  Buffer = nullptr;
-  hMapFile = nullptr;
-  hFile = ::CreateFileA(Filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
-                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-  assert(hFile != INVALID_HANDLE_VALUE);
-  LARGE_INTEGER size;
-  size.QuadPart = 0;
-  assert(::GetFileSizeEx(hFile, &size) != FALSE);
-  hMapFile = ::CreateFileMapping(hFile, NULL, PAGE_READONLY, size.HighPart, size.LowPart, NULL);
-  assert(hMapFile != nullptr);
-  Buffer = (unsigned char*)::MapViewOfFile(hMapFile, FILE_MAP_READ, 0, 0, 0);
-  assert(Buffer != nullptr);
-#else
-  int fd = open(Filename.c_str(), O_RDONLY);
-  assert(fd > 0);
-
-  struct stat sb;
-  assert(fstat(fd, &sb) == 0);
-  BufferLen = (size_t)sb.st_size;
-
-  Buffer = (unsigned char *)mmap(NULL, BufferLen, PROT_READ, MAP_SHARED, fd, 0);
-  assert(Buffer != MAP_FAILED);
-#endif
+  DataObjectsDict = PyDict_New();
+  Input = PerfInput::open(Filename);
 }
 
-PerfReader::~PerfReader() {
-#ifdef _WIN32
-  if (hMapFile != NULL) {
-    if (Buffer != NULL) ::UnmapViewOfFile(Buffer);
-    ::CloseHandle(hMapFile);
-  }
-  if (hFile != INVALID_HANDLE_VALUE) ::CloseHandle(hFile);
-#else
-  munmap(Buffer, BufferLen);
-#endif
-}
+PerfReader::~PerfReader() {}
 
 void PerfReader::readHeader() {
-  Header = (perf_header *)&Buffer[0];
+  Header = (perf_header *)Input->section(0, sizeof(perf_header));
 
   assert(!strncmp(Header->magic, "PERFILE2", 8));
+
+  size_t NumFeatures = 0;
+  for (unsigned I = 0; I < 64; ++I)
+    if (Header->flags & (1ULL << I))
+      ++NumFeatures;
+  Features = (perf_file_section *)Input->section(
+      Header->data.offset + Header->data.size,
+      NumFeatures * sizeof(perf_file_section));
+}
+
+static uint64_t getTimeFromSampleId(unsigned char *EndOfStruct,
+                                    const EventLayout &Event) {
+  uint64_t Layout = Event.SampleType;
+  uint64_t *Ptr = (uint64_t *)EndOfStruct;
+  // Each of the PERF_SAMPLE_* bits tested below adds an 8-byte field.
+  if (Layout & PERF_SAMPLE_IDENTIFIER)
+    --Ptr;
+  if (Layout & PERF_SAMPLE_CPU)
+    --Ptr;
+  if (Layout & PERF_SAMPLE_STREAM_ID)
+    --Ptr;
+  if (Layout & PERF_SAMPLE_ID)
+    --Ptr;
+  assert(Layout & PERF_SAMPLE_TIME);
+  --Ptr;
+  return *Ptr;
 }
 
+// Return the time of sample Buf, which has PERF_SAMPLE_TIME.
+static uint64_t getTimeFromSample(unsigned char *Buf,
+                                  const EventLayout &Layout) {
+  uint64_t *Ptr = (uint64_t *)(Buf + sizeof(perf_event_header));
+  if (Layout.SampleType & PERF_SAMPLE_IDENTIFIER)
+    ++Ptr;
+  if (Layout.SampleType & PERF_SAMPLE_IP)
+    ++Ptr;
+  if (Layout.SampleType & PERF_SAMPLE_TID)
+    ++Ptr;
+  return *Ptr;
+}
+
+// perf writes the buffer of each CPU in turn, so the records of the data
+// section are not in time order: a sample may come before the mapping it
+// was taken in. Records are queued, and processed in time order up to the
+// latest time seen before the previous PERF_RECORD_FINISHED_ROUND; by the
+// end of a round, perf has written every buffer up to where the round
+// started. Without times on every record, they are processed in file order.
 void PerfReader::readDataStream() {
-  unsigned char *Buf = &Buffer[Header->data.offset];
-  unsigned char *End = Buf + Header->data.size;
-  while (Buf < End)
-    Buf = readEvent(Buf);
+  Input->startData(Header->data.offset, Header->data.size);
+  // FIXME: The first EventID is used for every event.
+  const EventLayout &Layout = EventLayouts.begin()->second;
+  if (!(Layout.SampleType & PERF_SAMPLE_TIME) || !Layout.SampleIDAll) {
+    while (unsigned char *Buf = Input->nextRecord())
+      readEvent(Buf);
+    return;
+  }
+
+  // Queued records are copied if the input reuses their memory.
+  bool Copy = !Input->stableRecords();
+  RecordArena Arena;
+  OrderedEvents Queue(MaxQueuedEvents);
+  auto Process = [this, Copy, &Arena](unsigned char *Buf) {
+    readEvent(Buf);
+    if (Copy)
+      Arena.release(Buf);
+  };
+  uint64_t MaxTime = 0, RoundTime = 0;
+  while (unsigned char *Buf = Input->nextRecord()) {
+    perf_event_header *E = (perf_event_header *)Buf;
+    switch (E->type) {
+    case PERF_RECORD_COMM:
+    case PERF_RECORD_MMAP:
+    case PERF_RECORD_MMAP2:
+    case PERF_RECORD_SAMPLE: {
+      uint64_t Time = E->type == PERF_RECORD_SAMPLE
+                          ? getTimeFromSample(Buf, Layout)
+                          : getTimeFromSampleId(Buf + E->size, Layout);
+      MaxTime = std::max(MaxTime, Time);
+      if (Queue.full())
+        Queue.flushHalf(Process);
+      Queue.push(Time, Copy ? Arena.copy(Buf, E->size) : Buf);
+      break;
+    }
+    case PERF_RECORD_FINISHED_ROUND:
+      Queue.flush(RoundTime, Process);
+      RoundTime = MaxTime;
+      break;
+    case PERF_RECORD_FINISHED_INIT:
+      // The records synthesized for what existed before recording started
+      // all come before this.
+      Queue.flush(~0ULL, Process);
+      break;
+    }
+  }
+  Queue.flush(~0ULL, Process);
 }
 
+#define HEADER_BUILD_ID 2
 #define HEADER_EVENT_DESC 12
 
+// Feature sections follow the data section, one perf_file_section for every
+// feature bit set in the header, in bit order.
+perf_file_section *PerfReader::getFeatureSection(unsigned Feature) {
+  if (!(Header->flags & (1ULL << Feature)))
+    return nullptr;
+  perf_file_section *P = Features;
+  for (unsigned I = 0; I < Feature; ++I)
+    if (Header->flags & (1ULL << I))
+      ++P;
+  return P;
+}
+
 void PerfReader::readAttrs() {
   if (Header->flags & (1U << HEADER_EVENT_DESC)) {
     readEventDesc();
   } else {
     uint64_t NumEvents = Header->attrs.size / Header->attr_size;
+    unsigned char *Attrs =
+        Input->section(Header->attrs.offset, Header->attrs.size);
     for (unsigned I = 0; I < NumEvents; ++I) {
-      const perf_event_attr* attr = (const perf_event_attr*)&Buffer[Header->attrs.offset + I * Header->attr_size];
+      const perf_event_attr* attr = (const perf_event_attr*)&Attrs[I * Header->attr_size];
       const perf_file_section* ids = (const perf_file_section*)((unsigned char *)attr + attr->size);
-      unsigned char* Buf = &Buffer[ids->offset];
+      unsigned char* Buf = Input->section(ids->offset, ids->size);
       uint64_t NumIDs = ids->size / sizeof(uint64_t);
 
       const char* Str = "unknown";
@@ -770,34 +2984,27 @@ void PerfReader::readAttrs() {
       // event descriptor can be referred to by ANY id!
       if (NumEvents == 1) {
         EventIDs[0] = Str;
-        EventLayouts[0] = attr->sample_type;
+        EventLayouts[0] = EventLayout(attr);
       }
 
       for (unsigned J = 0; J < NumIDs; ++J) {
         auto id = TakeU64(Buf);
         EventIDs[id] = Str;
-        EventLayouts[id] = attr->sample_type;
+        EventLayouts[id] = EventLayout(attr);
       }
     }
   }
 }
 
 void PerfReader::readEventDesc() {
-  perf_file_section *P =
-      (perf_file_section *)&Buffer[Header->data.offset + Header->data.size];
-  for (int I = 0; I < HEADER_EVENT_DESC; ++I)
-    if (Header->flags & (1ULL << I))
-      ++P;
+  perf_file_section *P = getFeatureSection(HEADER_EVENT_DESC);
 
-  unsigned char *Buf = &Buffer[P->offset];
+  unsigned char *Buf = Input->section(P->offset, P->size);
   uint32_t NumEvents = TakeU32(Buf);
   uint32_t AttrSize = TakeU32(Buf);
   for (unsigned I = 0; I < NumEvents; ++I) {
-    // Parse out the "config" bitmask for the struct layout.
-    auto *Buf2 = Buf;
-    (void)TakeU32(Buf2); (void)TakeU32(Buf2); (void)TakeU64(Buf2); (void)TakeU64(Buf2);
-    auto Layout = TakeU64(Buf2);
-    
+    EventLayout Layout((const perf_event_attr *)Buf);
+
     Buf += AttrSize;
     uint32_t NumIDs = TakeU32(Buf);
 
@@ -820,89 +3027,333 @@ void PerfReader::readEventDesc() {
   }
 }
 
-static uint64_t getTimeFromSampleId(unsigned char *EndOfStruct,
-                                    uint64_t Layout) {
-  uint64_t *Ptr = (uint64_t *)EndOfStruct;
-  // Each of the PERF_SAMPLE_* bits tested below adds an 8-byte field.
-  if (Layout & PERF_SAMPLE_IDENTIFIER)
-    --Ptr;
-  if (Layout & PERF_SAMPLE_CPU)
-    --Ptr;
-  if (Layout & PERF_SAMPLE_STREAM_ID)
-    --Ptr;
-  if (Layout & PERF_SAMPLE_ID)
-    --Ptr;
-  assert(Layout & PERF_SAMPLE_TIME);
-  --Ptr;
-  return *Ptr;
+static std::string formatBuildID(const uint8_t *ID, size_t Size) {
+  static const char Hex[] = "0123456789abcdef";
+  std::string Str;
+  for (size_t I = 0; I < Size; ++I) {
+    Str += Hex[ID[I] >> 4];
+    Str += Hex[ID[I] & 0xf];
+  }
+  return Str;
+}
+
+void PerfReader::readBuildIds() {
+  perf_file_section *P = getFeatureSection(HEADER_BUILD_ID);
+  if (!P)
+    return;
+
+  unsigned char *Buf = Input->section(P->offset, P->size);
+  unsigned char *End = Buf + P->size;
+  while (Buf < End) {
+    build_id_event *E = (build_id_event *)Buf;
+    assert(E->header.size > 0);
+    // Older perf versions always write a 20-byte (SHA-1) build-id; newer ones
+    // flag an explicit size stored just after it.
+    size_t Size = 20;
+    if (E->header.misc & PERF_RECORD_MISC_BUILD_ID_SIZE)
+      Size = std::min<size_t>(E->build_id[20], 20);
+
+    BuildIDs[E->filename] = formatBuildID(E->build_id, Size);
+    Buf += E->header.size;
+  }
 }
 
-void PerfReader::registerNewMapping(unsigned char *Buf, const char *Filename) {
+void PerfReader::registerNewMapping(unsigned char *Buf, const char *Filename,
+                                    const std::string &BuildID, bool Exec) {
   perf_event_mmap_common *E = (perf_event_mmap_common *)Buf;
   auto MapID = Maps.size();
 
+  if (Exec && JITCode::isJITDump(Filename)) {
+    // Not code; this tells us where the process's JIT describes its code.
+    auto &J = JITs[E->pid];
+    J.DumpFile = Filename;
+    J.Loaded = false;
+    return;
+  }
+
   uint64_t End = E->start + E->extent;
+  Filename = MapFilenames.insert(Filename).first->c_str();
   Map NewMapping(E->start, End, Filename);
   NewMapping.FileToPCOffset = E->start - E->pgoff;
+  // Prefer the build-id of the mapping itself, which is right even if the
+  // file was replaced while perf was running.
+  NewMapping.BuildID = BuildID;
+  if (BuildID.empty()) {
+    auto I = BuildIDs.find(Filename);
+    if (I != BuildIDs.end())
+      NewMapping.BuildID = I->second;
+  }
   Maps.push_back(NewMapping);
 
   unsigned char *EndOfEvent = Buf + E->header.size;
   // FIXME: The first EventID is used for every event.
   // FIXME: The code assumes perf_event_attr.sample_id_all is set.
   uint64_t Time = getTimeFromSampleId(EndOfEvent, EventLayouts.begin()->second);
-  auto &CurrentMap = CurrentMaps[Time];
+  auto &CurrentMap = (Exec ? CurrentMaps : CurrentDataMaps)[Time];
   CurrentMap.insert({E->start, { E->start, End, MapID}});
 }
 
+// Search Maps for the map containing Addr at Time. Search backwards through
+// time, discarding any maps created after Time. Returns ~0ULL if there is
+// none.
+static uint64_t
+findMap(std::map<uint64_t, std::map<uint64_t, EventDesc>> &Maps, uint64_t Addr,
+        uint64_t Time) {
+  for (auto I = Maps.rbegin(), E = Maps.rend(); I != E; ++I) {
+    if (I->first > Time)
+      continue;
+
+    auto NewI = I->second.upper_bound(Addr);
+    if (NewI == I->second.begin())
+      continue;
+    --NewI;
+
+    if (NewI->second.Start > Addr || NewI->second.End < Addr)
+      continue;
+    return NewI->second.MapId;
+  }
+  return ~0ULL;
+}
+
+// Return the JIT code of process Pid, reading it the first time it is asked
+// for, or nullptr if the process has none.
+JITCode *PerfReader::getJITCode(uint32_t Pid) {
+  auto &J = JITs[Pid];
+  if (!J.Loaded)
+    J.load(BinaryCacheRoot, Pid);
+  return J.Symbols.empty() ? nullptr : &J;
+}
+
+size_t PerfReader::getJITMap(uint32_t Pid) {
+  auto &J = JITs[Pid];
+  if (J.MapID == ~0ULL) {
+    J.Name = "[jit-" + std::to_string(Pid) + "]";
+    Map M(0, ~0ULL, J.Name.c_str());
+    M.FileToPCOffset = M.VAddrToFileOffset = 0;
+    M.JIT = &J;
+    J.MapID = Maps.size();
+    Maps.push_back(M);
+  }
+  return J.MapID;
+}
+
+// Resolve kernel samples against Kallsyms, a copy of /proc/kallsyms, or, if
+// that is empty, the symbols of the vmlinux image Vmlinux (looked for under
+// the binary cache root like any other binary).
+void PerfReader::setKernelSymbols(const std::string &Kallsyms,
+                                  const std::string &Vmlinux) {
+  this->Kallsyms = Kallsyms;
+  this->Vmlinux = Vmlinux;
+}
+
+size_t PerfReader::getKernelMap() {
+  if (KernelMapID == ~0ULL) {
+    bool Image = Kallsyms.empty() && !Vmlinux.empty();
+    Map M(0, ~0ULL, Image ? Vmlinux.c_str() : "[kernel.kallsyms]");
+    M.FileToPCOffset = M.VAddrToFileOffset = 0;
+    M.Symbols = &KernelSymbols;
+    M.NoCode = !Image;
+    auto I = BuildIDs.find("[kernel.kallsyms]");
+    if (Image && I != BuildIDs.end())
+      M.BuildID = I->second;
+    KernelMapID = Maps.size();
+    Maps.push_back(M);
+  }
+  return KernelMapID;
+}
+
+size_t PerfReader::getHypervisorMap() {
+  if (HypervisorMapID == ~0ULL) {
+    Map M(0, ~0ULL, "[hypervisor]");
+    M.FileToPCOffset = M.VAddrToFileOffset = 0;
+    M.Symbols = &HypervisorSymbols;
+    M.NoCode = true;
+    HypervisorSymbols.push_back({0, ~0ULL, "[hypervisor]"});
+    HypervisorMapID = Maps.size();
+    Maps.push_back(M);
+  }
+  return HypervisorMapID;
+}
+
+// Read the symbols of the kernel pseudo-map M, the first time they are
+// needed.
+void PerfReader::loadKernelSymbols(Map &M) {
+  if (KernelSymbolsLoaded)
+    return;
+  KernelSymbolsLoaded = true;
+  if (!Kallsyms.empty()) {
+    KernelSymbols.readKallsyms(Kallsyms);
+  } else if (!Vmlinux.empty()) {
+    KernelSymbols.reset(resolveBinary(BinaryCacheRoot, M));
+    // The image is linked with its executable segment at _text.
+    uint64_t Slide = KernelTextAddress && KernelSymbols.ExecVAddr
+                         ? KernelTextAddress - KernelSymbols.ExecVAddr
+                         : 0;
+    M.FileToPCOffset = Slide - KernelSymbols.VAddrToFileOffset;
+  }
+}
+
+// Return whether sample E passes Filter. Samples that do not are dropped
+// before they are aggregated.
+bool PerfReader::acceptSample(const perf_event_sample &E,
+                              const EventLayout &Layout) {
+  if (Filter.empty())
+    return true;
+  if (FirstSampleTime == ~0ULL)
+    FirstSampleTime = E.time;
+
+  if (!Filter.Pids.empty() || !Filter.Tids.empty() || !Filter.Comm.empty())
+    assert((Layout.SampleType & PERF_SAMPLE_TID) &&
+           "filtering by thread needs samples with PERF_SAMPLE_TID");
+  if (!Filter.Pids.empty() && !Filter.Pids.count(E.pid))
+    return false;
+  if (!Filter.Tids.empty() && !Filter.Tids.count(E.tid))
+    return false;
+
+  if (!Filter.Cpus.empty()) {
+    assert((Layout.SampleType & PERF_SAMPLE_CPU) &&
+           "filtering by CPU needs samples with PERF_SAMPLE_CPU");
+    if (!Filter.Cpus.count(E.cpu))
+      return false;
+  }
+
+  if (Filter.TimeStart != 0 || Filter.TimeEnd != ~0ULL) {
+    assert((Layout.SampleType & PERF_SAMPLE_TIME) &&
+           "filtering by time needs samples with PERF_SAMPLE_TIME");
+    // Samples are not strictly ordered by time.
+    uint64_t Time = E.time > FirstSampleTime ? E.time - FirstSampleTime : 0;
+    if (Time < Filter.TimeStart || Time >= Filter.TimeEnd)
+      return false;
+  }
+
+  if (!Filter.Comm.empty()) {
+    auto I = CommMatches.find(E.tid);
+    if (I == CommMatches.end()) {
+      // Threads inherit the name of their process until they set one.
+      auto C = Comms.find(E.tid);
+      if (C == Comms.end())
+        C = Comms.find(E.pid);
+      bool Match = C != Comms.end() &&
+                   std::regex_search(C->second, Filter.CommRegex);
+      I = CommMatches.insert({E.tid, Match}).first;
+    }
+    if (!I->second)
+      return false;
+  }
+  return true;
+}
+
 unsigned char *PerfReader::readEvent(unsigned char *Buf) {
   perf_event_header *E = (perf_event_header *)Buf;
   switch (E->type) {
+  case PERF_RECORD_COMM:
+  {
+    // Only needed to filter by command name. A thread is renamed by exec
+    // and prctl(PR_SET_NAME).
+    if (Filter.Comm.empty())
+      break;
+    perf_event_comm *E = (perf_event_comm *)Buf;
+    Comms[E->tid] = E->comm;
+    CommMatches.clear();
+  }
+  break;
   case PERF_RECORD_MMAP:
   {
     perf_event_mmap *E = (perf_event_mmap *)Buf;
-    registerNewMapping(Buf, E->filename);
+    bool Exec = !(E->mmap_common.header.misc & PERF_RECORD_MISC_MMAP_DATA);
+    // perf records the kernel as mapped at the address of _text, given in
+    // pgoff.
+    if (!strncmp(E->filename, "[kernel.kallsyms]", 17))
+      KernelTextAddress = E->mmap_common.pgoff;
+    if (Exec || DataObjects)
+      registerNewMapping(Buf, E->filename, "", Exec);
   }
   break;
   case PERF_RECORD_MMAP2:
   {
     perf_event_mmap2 *E = (perf_event_mmap2 *)Buf;
-    if (!(E->prot & PROT_EXEC))
+    bool Exec = E->prot & PROT_EXEC;
+    if (!Exec && !DataObjects)
       break;
-    registerNewMapping(Buf, E->filename);
+    std::string BuildID;
+    if (E->mmap_common.header.misc & PERF_RECORD_MISC_MMAP_BUILD_ID) {
+      const uint8_t *P = (const uint8_t *)&E->maj;
+      BuildID = formatBuildID(P + 4, std::min<size_t>(P[0], 20));
+    }
+    registerNewMapping(Buf, E->filename, BuildID, Exec);
   }
   break;
   case PERF_RECORD_SAMPLE:
   {
     perf_event_sample* E = (perf_event_sample*)Buf;
+    auto Layout = EventLayouts.begin()->second;
     auto NewE = parseEvent(((unsigned char*)E) + sizeof(perf_event_header),
-                           EventLayouts.begin()->second);
+                           Layout);
     auto EventID = NewE.id;
     auto PC = NewE.ip;
 
-    // Search for the map corresponding to this sample. Search backwards through
-    // time, discarding any maps created after our timestamp.
-    uint64_t MapID = ~0ULL;
-    for (auto I = CurrentMaps.rbegin(), E = CurrentMaps.rend();
-         I != E; ++I) {
-      if (I->first > NewE.time)
-        continue;
-
-      auto NewI = I->second.upper_bound(PC);
-      if (NewI == I->second.begin())
-        continue;
-      --NewI;
+    if (!acceptSample(NewE, Layout)) {
+      // Group reads count from the previous sample, wherever it was.
+      if (NewE.read)
+        readCounts(NewE, Layout);
+      break;
+    }
 
-      if (NewI->second.Start > PC || NewI->second.End < PC)
-        continue;
-      MapID = NewI->second.MapId;
+    // Search for the map corresponding to this sample. Kernel and hypervisor
+    // samples are attributed by where the CPU was, not by address.
+    uint64_t MapID = ~0ULL;
+    switch (E->header.misc & PERF_RECORD_MISC_CPUMODE_MASK) {
+    case PERF_RECORD_MISC_KERNEL:
+      MapID = getKernelMap();
       break;
+    case PERF_RECORD_MISC_HYPERVISOR:
+      MapID = getHypervisorMap();
+      break;
+    default:
+      MapID = findMap(CurrentMaps, PC, NewE.time);
+      break;
+    }
+
+    // Code outside any file-backed mapping may have been emitted by a JIT.
+    if ((MapID == ~0ULL || JITCode::isAnonymous(Maps[MapID].Filename)) &&
+        (Layout.SampleType & PERF_SAMPLE_TID)) {
+      JITCode *J = getJITCode(NewE.pid);
+      if (J && J->lookup(PC, NewE.time))
+        MapID = getJITMap(NewE.pid);
     }
+
     if (MapID != ~0ULL) {
       assert(EventIDs.count(EventID));
-      Events[MapID][PC][EventIDs[EventID]] += NewE.period;
+      readCounts(NewE, Layout);
+      auto &PCEvents = Events[MapID][PC];
+      auto &MapTotals = TotalEventsPerMap[MapID];
+      for (auto &KV : SampleCounts) {
+        PCEvents[KV.first] += KV.second;
+        TotalEvents[KV.first] += KV.second;
+        MapTotals[KV.first] += KV.second;
+      }
+
+      if (NewE.weight) {
+        Latencies[MapID][PC].add(NewE.weight);
+        TotalLatency.add(NewE.weight);
+      }
+    }
 
-      TotalEvents[EventIDs[EventID]] += NewE.period;
-      TotalEventsPerMap[MapID][EventIDs[EventID]] += NewE.period;
+    // Constant data may be in the code mappings as well.
+    if (DataObjects && NewE.addr) {
+      assert(EventIDs.count(EventID));
+      uint64_t Addr = NewE.addr;
+      uint64_t DataMapID = findMap(CurrentDataMaps, Addr, NewE.time);
+      if (DataMapID == ~0ULL)
+        DataMapID = findMap(CurrentMaps, Addr, NewE.time);
+      const char *Filename =
+          DataMapID != ~0ULL ? Maps[DataMapID].Filename : "";
+      DataAccesses &A = Filename[0] == '/' && !JITCode::isAnonymous(Filename)
+                            ? DataEvents[DataMapID][Addr]
+                            : PageEvents[Addr & ~0xfffULL];
+      A.Counters[EventIDs[EventID]] += NewE.period;
+      if (Layout.SampleType & PERF_SAMPLE_DATA_SRC)
+        ++A.Levels[getMemoryLevel(NewE.data_src)];
     }
   }
   break;
@@ -910,9 +3361,62 @@ unsigned char *PerfReader::readEvent(unsigned char *Buf) {
   return &Buf[E->size];
 }
 
-perf_event_sample PerfReader::parseEvent(unsigned char *Buf, uint64_t Layout) {
+// Set SampleCounts to what each event counted for sample E. Normally that is
+// the sample's period, for its own event. If the sample read the counters of
+// its event group (PERF_SAMPLE_READ, as 'perf record -e {cycles,instructions}'
+// does with leader sampling or --sample-read), it is what every member counted
+// since it was last read, so that all members are attributed exactly.
+void PerfReader::readCounts(const perf_event_sample &E,
+                            const EventLayout &Layout) {
+  SampleCounts.clear();
+  uint64_t Format = Layout.ReadFormat;
+  // Without IDs, the values cannot be told apart.
+  if (!E.read || !(Format & PERF_FORMAT_ID)) {
+    SampleCounts.push_back({EventIDs[E.id], E.period});
+    return;
+  }
+
+  unsigned char *Buf = E.read;
+  uint64_t NumValues = 1;
+  if (Format & PERF_FORMAT_GROUP) {
+    // { nr, time_enabled, time_running, { value, id, lost }[nr] }
+    NumValues = TakeU64(Buf);
+    if (Format & PERF_FORMAT_TOTAL_TIME_ENABLED)
+      Buf += 8;
+    if (Format & PERF_FORMAT_TOTAL_TIME_RUNNING)
+      Buf += 8;
+  }
+  for (uint64_t I = 0; I < NumValues; ++I) {
+    uint64_t Value = TakeU64(Buf);
+    if (!(Format & PERF_FORMAT_GROUP)) {
+      // { value, time_enabled, time_running, id, lost }
+      if (Format & PERF_FORMAT_TOTAL_TIME_ENABLED)
+        Buf += 8;
+      if (Format & PERF_FORMAT_TOTAL_TIME_RUNNING)
+        Buf += 8;
+    }
+    uint64_t ID = TakeU64(Buf);
+    if (Format & PERF_FORMAT_LOST)
+      Buf += 8;
+
+    auto Name = EventIDs.find(ID);
+    if (Name == EventIDs.end())
+      continue;
+    // Values are running totals. They only go backwards if the counter was
+    // reset, and then all of the value is new.
+    uint64_t &Prev = ReadValues[ID];
+    uint64_t Delta = Value >= Prev ? Value - Prev : Value;
+    Prev = Value;
+    if (Delta)
+      SampleCounts.push_back({Name->second, Delta});
+  }
+}
+
+perf_event_sample PerfReader::parseEvent(unsigned char *Buf,
+                                         const EventLayout &Event) {
   perf_event_sample E;
   memset((char*)&E, 0, sizeof(E));
+  uint64_t Layout = Event.SampleType;
 
   assert(Layout & PERF_SAMPLE_IP);
   assert(Layout & PERF_SAMPLE_PERIOD);
@@ -928,51 +3432,145 @@ perf_event_sample PerfReader::parseEvent(unsigned char *Buf, uint64_t Layout) {
   if (Layout & PERF_SAMPLE_TIME)
     E.time = TakeU64(Buf);
   if (Layout & PERF_SAMPLE_ADDR)
-    (void) TakeU64(Buf);
+    E.addr = TakeU64(Buf);
   if (Layout & PERF_SAMPLE_ID)
     E.id = TakeU64(Buf);
   if (Layout & PERF_SAMPLE_STREAM_ID)
     (void) TakeU64(Buf);
-  if (Layout & PERF_SAMPLE_CPU)
-    (void) TakeU64(Buf);
+  if (Layout & PERF_SAMPLE_CPU) {
+    E.cpu = TakeU32(Buf);
+    (void) TakeU32(Buf);
+  }
   if (Layout & PERF_SAMPLE_PERIOD)
     E.period = TakeU64(Buf);
-  
+
+  if (Layout & PERF_SAMPLE_READ)
+    E.read = Buf;
+
+  // The remaining fields are only parsed to get to the sample weight and
+  // data source.
+  if (!(Layout & (PERF_SAMPLE_WEIGHT | PERF_SAMPLE_WEIGHT_STRUCT |
+                  PERF_SAMPLE_DATA_SRC)))
+    return E;
+
+  if (Layout & PERF_SAMPLE_READ) {
+    uint64_t Format = Event.ReadFormat;
+    unsigned ValueSize = 8 * (1 + !!(Format & PERF_FORMAT_ID) +
+                              !!(Format & PERF_FORMAT_LOST));
+    uint64_t NumValues = 1;
+    if (Format & PERF_FORMAT_GROUP)
+      NumValues = TakeU64(Buf);
+    if (Format & PERF_FORMAT_TOTAL_TIME_ENABLED)
+      Buf += 8;
+    if (Format & PERF_FORMAT_TOTAL_TIME_RUNNING)
+      Buf += 8;
+    Buf += NumValues * ValueSize;
+  }
+  if (Layout & PERF_SAMPLE_CALLCHAIN)
+    Buf += 8 * TakeU64(Buf);
+  if (Layout & PERF_SAMPLE_RAW)
+    Buf += TakeU32(Buf);
+  if (Layout & PERF_SAMPLE_BRANCH_STACK) {
+    uint64_t NumBranches = TakeU64(Buf);
+    if (Event.BranchSampleType & PERF_SAMPLE_BRANCH_HW_INDEX)
+      Buf += 8;
+    Buf += 24 * NumBranches;
+  }
+  if (Layout & PERF_SAMPLE_REGS_USER) {
+    if (TakeU64(Buf)) // ABI; zero if no registers were sampled.
+      for (uint64_t Regs = Event.SampleRegsUser; Regs; Regs &= Regs - 1)
+        Buf += 8;
+  }
+  if (Layout & PERF_SAMPLE_STACK_USER) {
+    uint64_t Size = TakeU64(Buf);
+    if (Size)
+      Buf += Size + 8; // The stack, then its dynamic size.
+  }
+  if (Layout & (PERF_SAMPLE_WEIGHT | PERF_SAMPLE_WEIGHT_STRUCT)) {
+    // With PERF_SAMPLE_WEIGHT_STRUCT, the latency is in the low 32 bits.
+    uint64_t Weight = TakeU64(Buf);
+    E.weight = (Layout & PERF_SAMPLE_WEIGHT) ? Weight : (uint32_t)Weight;
+  }
+  if (Layout & PERF_SAMPLE_DATA_SRC)
+    E.data_src = TakeU64(Buf);
+
   return E;
 }
 
-void PerfReader::emitFunctionStart(std::string &Name) {
+static void setCounter(PyObject *Dict, const char *Name, uint64_t Value) {
+  auto *V = PyLong_FromUnsignedLongLong((unsigned long long)Value);
+  PyDict_SetItemString(Dict, Name, V);
+  Py_DECREF(V);
+}
+
+void PerfReader::emitFunctionStart(std::string &) {
   Lines.clear();
+  LineAddresses.clear();
+  LineCounters.clear();
+  LineTextOffsets.clear();
 }
 
 void PerfReader::emitFunctionEnd(std::string &Name,
                                  std::map<const char *, uint64_t> &Counters) {
   auto *CounterDict = PyDict_New();
   for (auto &KV : Counters)
-    PyDict_SetItemString(CounterDict, KV.first,
-                         PyLong_FromUnsignedLongLong((unsigned long long)KV.second));
-
-  auto *LinesList = PyList_New(Lines.size());
-  unsigned Idx = 0;
-  for (auto *I : Lines)
-    PyList_SetItem(LinesList, Idx++, I);
-  
+    setCounter(CounterDict, KV.first, KV.second);
+
   auto *FnDict = PyDict_New();
   PyDict_SetItemString(FnDict, "counters", CounterDict);
-  PyDict_SetItemString(FnDict, "data", LinesList);
+  Py_DECREF(CounterDict);
+
+#ifndef STANDALONE
+  if (Detail != DL_Functions && Columnar) {
+    auto *Addresses = createColumn(LineAddresses, 0);
+    auto *Counters = createColumn(LineCounters, CounterColumns.size());
+    auto *TextOffsets = createColumn(LineTextOffsets, 0);
+    PyDict_SetItemString(FnDict, "addresses", Addresses);
+    PyDict_SetItemString(FnDict, "counter-matrix", Counters);
+    PyDict_SetItemString(FnDict, "text-offsets", TextOffsets);
+    Py_DECREF(Addresses);
+    Py_DECREF(Counters);
+    Py_DECREF(TextOffsets);
+  } else
+#endif
+  if (Detail != DL_Functions) {
+    auto *LinesList = PyList_New(Lines.size());
+    unsigned Idx = 0;
+    for (auto *I : Lines)
+      PyList_SetItem(LinesList, Idx++, I);
+    PyDict_SetItemString(FnDict, "data", LinesList);
+    Py_DECREF(LinesList);
+  }
 
   PyDict_SetItemString(Functions, Name.c_str(), FnDict);
+  Py_DECREF(FnDict);
 }
 
 void PerfReader::emitLine(uint64_t PC,
                           std::map<const char *, uint64_t> *Counters,
                           const std::string &Text) {
+  if (Columnar) {
+    LineAddresses.push_back(PC);
+    size_t Row = LineCounters.size();
+    LineCounters.resize(Row + CounterColumns.size());
+    if (Counters)
+      for (auto &KV : *Counters)
+        LineCounters[Row + CounterColumns[KV.first]] = KV.second;
+
+    auto It = TextPoolOffsets.find(Text);
+    if (It == TextPoolOffsets.end()) {
+      It = TextPoolOffsets.insert({Text, TextPool.size()}).first;
+      TextPool.append(Text.c_str(), Text.size() + 1);
+    }
+    LineTextOffsets.push_back(It->second);
+    return;
+  }
+
   auto *CounterDict = PyDict_New();
   if (Counters)
     for (auto &KV : *Counters)
-      PyDict_SetItemString(CounterDict, KV.first,
-                           PyLong_FromUnsignedLongLong((unsigned long long)KV.second));
-  
+      setCounter(CounterDict, KV.first, KV.second);
+
   auto *Line = Py_BuildValue("[NKs]",
                              CounterDict,
                              (unsigned long long) PC,
@@ -981,12 +3579,24 @@ void PerfReader::emitLine(uint64_t PC,
 }
 
 void PerfReader::emitTopLevelCounters() {
-  for (auto &KV : TotalEvents)
-    PyDict_SetItemString(TopLevelCounters, KV.first,
-                         PyLong_FromUnsignedLongLong((unsigned long long)KV.second));
+  auto Counters = TotalEvents;
+  if (!TotalLatency.empty())
+    setLatencyCounters(Counters, TotalLatency);
+  for (auto &KV : Counters) {
+    setCounter(TopLevelCounters, KV.first, KV.second);
+    CounterColumns.insert({KV.first, CounterColumns.size()});
+  }
 }
 
 void PerfReader::emitMaps() {
+  collectSymbols();
+  for (size_t I = 0; I < KeptSymbols.size(); ++I)
+    emitKeptSymbol(I);
+}
+
+// Find the symbols to emit: those of maps with enough samples, that have
+// enough samples themselves.
+void PerfReader::collectSymbols() {
   for (auto &KV : Events) {
     auto MapID = KV.first;
     auto &MapEvents = KV.second;
@@ -1013,8 +3623,29 @@ void PerfReader::emitMaps() {
       continue;
 
     Map &M = Maps[MapID];
-    SymTabOutput Syms(Objdump, BinaryCacheRoot);
-    Syms.reset(&M);
+    SymTabOutput JITSyms(Objdump, BinaryCacheRoot);
+    SymTabOutput *SymsPtr = &JITSyms;
+    if (M.JIT) {
+      for (auto &S : M.JIT->Symbols)
+        JITSyms.push_back({S.Start, S.End, S.Name});
+      std::sort(JITSyms.begin(), JITSyms.end());
+      JITSyms.erase(std::unique(JITSyms.begin(), JITSyms.end()),
+                    JITSyms.end());
+    } else if (M.Symbols) {
+      if (MapID == KernelMapID)
+        loadKernelSymbols(M);
+      SymsPtr = M.Symbols;
+    } else {
+      std::string Path = resolveBinary(BinaryCacheRoot, M);
+      auto &Cached = SymbolTables[M.BuildID.empty() ? Path : M.BuildID];
+      if (!Cached) {
+        Cached.reset(new SymTabOutput(Objdump, BinaryCacheRoot));
+        Cached->reset(Path);
+      }
+      SymsPtr = Cached.get();
+    }
+    SymTabOutput &Syms = *SymsPtr;
+    M.VAddrToFileOffset = Syms.VAddrToFileOffset;
 
     uint64_t VAddrToPCOffset = M.VAddrToFileOffset + M.FileToPCOffset;
 
@@ -1040,7 +3671,7 @@ void PerfReader::emitMaps() {
       ++Event;
     }
 
-    // Emit only symbols that took up > 0.5% of any counter
+    // Keep only symbols that took up > 0.5% of any counter
     for (auto &Sym : Syms) {
       bool Keep = false;
       for (auto &KV : SymToEventTotals[Sym.Start]) {
@@ -1049,76 +3680,1130 @@ void PerfReader::emitMaps() {
           break;
         }
       }
-      if (Keep)
-        emitSymbol(Sym, M, MapEvents.lower_bound(Sym.Start + VAddrToPCOffset),
-                   SymToEventTotals[Sym.Start]);
+      if (!Keep)
+        continue;
+      auto L = Latencies.find(MapID);
+      if (L != Latencies.end())
+        addLatencyCounters(L->second, Sym, VAddrToPCOffset, MapEvents,
+                           SymToEventTotals[Sym.Start]);
+      KeptSymbols.push_back({MapID, Sym, SymToEventTotals[Sym.Start]});
+    }
+  }
+
+  // Functions are keyed by name, so a later symbol of the same name (in
+  // another binary) replaces an earlier one. Only keep the last.
+  std::map<std::string, size_t> Last;
+  for (size_t I = 0; I < KeptSymbols.size(); ++I)
+    Last[KeptSymbols[I].Sym.Name] = I;
+  size_t N = 0;
+  for (size_t I = 0; I < KeptSymbols.size(); ++I) {
+    if (Last[KeptSymbols[I].Sym.Name] != I)
+      continue;
+    if (N != I)
+      KeptSymbols[N] = std::move(KeptSymbols[I]);
+    ++N;
+  }
+  KeptSymbols.resize(N);
+}
+
+// Emit the I'th kept symbol into Functions, returning its dict (a borrowed
+// reference).
+PyObject *PerfReader::emitKeptSymbol(size_t I) {
+  auto &KS = KeptSymbols[I];
+  Map &M = Maps[KS.MapID];
+  auto &MapEvents = Events[KS.MapID];
+  uint64_t VAddrToPCOffset = M.VAddrToFileOffset + M.FileToPCOffset;
+  switch (Detail) {
+  case DL_Functions:
+    emitFunctionStart(KS.Sym.Name);
+    emitFunctionEnd(KS.Sym.Name, KS.Counters);
+    break;
+  case DL_Addresses:
+    // JIT code cannot be found again after the process has exited, so
+    // it is always disassembled now.
+    if (!M.JIT && !M.NoCode) {
+      emitSymbolAddresses(KS.Sym, M, MapEvents, KS.Counters);
+      break;
     }
+    // Fall through.
+  case DL_Instructions:
+    if (!emitSymbol(KS.Sym, M,
+                    MapEvents.lower_bound(KS.Sym.Start + VAddrToPCOffset),
+                    KS.Counters))
+      emitSymbolAddresses(KS.Sym, M, MapEvents, KS.Counters);
+    break;
   }
+  return PyDict_GetItemString(Functions, KS.Sym.Name.c_str());
+}
+
+// Emit the I'th kept symbol, returning a (name, function) tuple. Unlike with
+// emitKeptSymbol, the function is not kept in Functions, so that it is freed
+// as soon as the caller is done with it.
+PyObject *PerfReader::takeKeptSymbol(size_t I) {
+  auto *Fn = emitKeptSymbol(I);
+  const char *Name = KeptSymbols[I].Sym.Name.c_str();
+  auto *Item = Py_BuildValue("(sO)", Name, Fn);
+  PyDict_DelItemString(Functions, Name);
+  return Item;
 }
 
-void PerfReader::emitSymbol(
+// Emit Sym with its disassembly. Returns false, emitting nothing, if the code
+// of Sym is not available (JIT code that was only named in a perf map, or a
+// pseudo-map without code).
+bool PerfReader::emitSymbol(
     Symbol &Sym, Map &M,
     std::map<uint64_t, std::map<const char *, uint64_t>>::iterator Event,
     std::map<const char *, uint64_t> &SymEvents) {
   uint64_t VAddrToPCOffset = M.VAddrToFileOffset + M.FileToPCOffset;
-  ObjdumpOutput Dump(Objdump, BinaryCacheRoot);
-  Dump.reset(&M, Sym.Start, Sym.End);
+  const JITSymbol *JS = M.JIT ? M.JIT->lookup(Sym.Start, ~0ULL) : nullptr;
+  if (M.NoCode || (M.JIT && (!JS || !M.JIT->getCode(*JS))))
+    return false;
+
+  ObjdumpOutput ObjdumpDump(Objdump, BinaryCacheRoot);
+  Disassembler *Dump = nullptr;
+#ifdef HAVE_LLVM_DISASSEMBLER
+  if (NativeDisassembly) {
+    if (!Native)
+      Native.reset(new LLVMDisassemblerOutput(BinaryCacheRoot));
+    if (JS ? Native->reset(*M.JIT, *JS) : Native->reset(&M, Sym.Start, Sym.End))
+      Dump = Native.get();
+  }
+#endif
+  if (!Dump) {
+    if (JS ? ObjdumpDump.reset(*M.JIT, *JS)
+           : ObjdumpDump.reset(&M, Sym.Start, Sym.End))
+      Dump = &ObjdumpDump;
+    else
+      return false;
+  }
 
   emitFunctionStart(Sym.Name);
   assert(Sym.Start <= Event->first - VAddrToPCOffset &&
          Event->first - VAddrToPCOffset < Sym.End);
-  for (uint64_t I = Dump.next(); I < Sym.End; I = Dump.next()) {
-    auto VAddr = Event->first - VAddrToPCOffset;
+  if (!Normalize) {
+    for (uint64_t I = Dump->next(); I < Sym.End; I = Dump->next()) {
+      auto VAddr = Event->first - VAddrToPCOffset;
+
+      auto Text = Dump->getText();
+      if (VAddr == I) {
+        emitLine(I, &Event->second, Text);
+        ++Event;
+      } else {
+        emitLine(I, nullptr, Text);
+      }
+    }
+    emitFunctionEnd(Sym.Name, SymEvents);
+    return true;
+  }
 
-    auto Text = Dump.getText();
-    if (VAddr == I) {
-      emitLine(I, &Event->second, Text);
+  // Normalizing an instruction needs the address of the next one.
+  std::vector<std::pair<uint64_t, std::string>> Insts;
+  for (uint64_t I = Dump->next(); I < Sym.End; I = Dump->next())
+    Insts.push_back({I, Dump->getText()});
+  const std::vector<Symbol> *Syms = M.Symbols;
+  if (!M.JIT && !Syms) {
+    auto It = SymbolTables.find(M.BuildID.empty()
+                                    ? resolveBinary(BinaryCacheRoot, M)
+                                    : M.BuildID);
+    if (It != SymbolTables.end())
+      Syms = It->second.get();
+  }
+  uint64_t Start = Insts.empty() ? Sym.Start : Insts.front().first;
+  uint64_t Hash = 0xcbf29ce484222325ULL;
+  for (size_t N = 0; N < Insts.size(); ++N) {
+    uint64_t I = Insts[N].first;
+    uint64_t NextPC = N + 1 < Insts.size() ? Insts[N + 1].first : Sym.End;
+    auto Text = normalizeInstruction(Insts[N].second, I, NextPC, Start,
+                                     Sym.End, Syms, M.JIT);
+    Hash = hashText(Hash, Text);
+    if (Event->first - VAddrToPCOffset == I) {
+      emitLine(I - Start, &Event->second, Text);
       ++Event;
     } else {
-      emitLine(I, nullptr, Text);
+      emitLine(I - Start, nullptr, Text);
     }
   }
   emitFunctionEnd(Sym.Name, SymEvents);
+
+  auto *FnDict = PyDict_GetItemString(Functions, Sym.Name.c_str());
+  auto *HashStr = PyUnicode_FromString(formatHex(Hash).c_str());
+  PyDict_SetItemString(FnDict, "hash", HashStr);
+  Py_DECREF(HashStr);
+  return true;
+}
+
+void PerfReader::emitSymbolAddresses(
+    Symbol &Sym, Map &M,
+    std::map<uint64_t, std::map<const char *, uint64_t>> &MapEvents,
+    std::map<const char *, uint64_t> &SymEvents) {
+  uint64_t VAddrToPCOffset = M.VAddrToFileOffset + M.FileToPCOffset;
+
+  emitFunctionStart(Sym.Name);
+  for (auto Event = MapEvents.lower_bound(Sym.Start + VAddrToPCOffset);
+       Event != MapEvents.end(); ++Event) {
+    auto VAddr = Event->first - VAddrToPCOffset;
+    if (VAddr >= Sym.End)
+      break;
+    emitLine(VAddr, &Event->second, "");
+  }
+  emitFunctionEnd(Sym.Name, SymEvents);
+  if (M.JIT || M.NoCode)
+    return;
+
+  // Record where the text for this function can be found later.
+  auto *FnDict = PyDict_GetItemString(Functions, Sym.Name.c_str());
+  auto *Binary = PyUnicode_FromString(M.Filename);
+  auto *ID = PyUnicode_FromString(M.BuildID.c_str());
+  auto *Start = PyLong_FromUnsignedLongLong((unsigned long long)Sym.Start);
+  auto *End = PyLong_FromUnsignedLongLong((unsigned long long)Sym.End);
+  PyDict_SetItemString(FnDict, "binary", Binary);
+  PyDict_SetItemString(FnDict, "build-id", ID);
+  PyDict_SetItemString(FnDict, "start", Start);
+  PyDict_SetItemString(FnDict, "end", End);
+  Py_DECREF(Binary);
+  Py_DECREF(ID);
+  Py_DECREF(Start);
+  Py_DECREF(End);
+}
+
+// Give Sym and each of its instructions that had weighted samples latency
+// counters.
+void PerfReader::addLatencyCounters(
+    std::map<uint64_t, LatencyHistogram> &PCLatencies, Symbol &Sym,
+    uint64_t VAddrToPCOffset,
+    std::map<uint64_t, std::map<const char *, uint64_t>> &MapEvents,
+    std::map<const char *, uint64_t> &SymEvents) {
+  LatencyHistogram SymLatency;
+  for (auto I = PCLatencies.lower_bound(Sym.Start + VAddrToPCOffset);
+       I != PCLatencies.end() && I->first - VAddrToPCOffset < Sym.End; ++I) {
+    setLatencyCounters(MapEvents[I->first], I->second);
+    SymLatency.add(I->second);
+  }
+  if (!SymLatency.empty())
+    setLatencyCounters(SymEvents, SymLatency);
+}
+
+// Resolve the sampled data addresses to the data objects (STT_OBJECT symbols)
+// of the binaries they were mapped from, the same way samples are resolved to
+// functions in emitMaps. Addresses that are not in any object are grouped by
+// page.
+void PerfReader::emitDataObjects() {
+  std::map<std::string, DataAccesses> Objects;
+  auto Pages = PageEvents;
+
+  for (auto &KV : DataEvents) {
+    Map &M = Maps[KV.first];
+    std::string Path = resolveBinary(BinaryCacheRoot, M);
+    auto &Cached = ObjectTables[M.BuildID.empty() ? Path : M.BuildID];
+    if (!Cached) {
+      Cached.reset(new SymTabOutput(Objdump, BinaryCacheRoot, true));
+      Cached->reset(Path);
+    }
+    SymTabOutput &Syms = *Cached;
+
+    // Sort the accesses by their virtual address in the binary, which is
+    // not necessarily the order of their addresses in memory.
+    typedef std::map<uint64_t, DataAccesses>::iterator AccessIt;
+    std::vector<std::pair<uint64_t, AccessIt>> Accesses;
+    for (auto A = KV.second.begin(); A != KV.second.end(); ++A) {
+      uint64_t VAddr = Syms.getVAddrForOffset(A->first - M.FileToPCOffset);
+      if (VAddr == ~0ULL)
+        Pages[A->first & ~0xfffULL].add(A->second);
+      else
+        Accesses.push_back({VAddr, A});
+    }
+    std::sort(Accesses.begin(), Accesses.end(),
+              [](const std::pair<uint64_t, AccessIt> &A,
+                 const std::pair<uint64_t, AccessIt> &B) {
+                return A.first < B.first;
+              });
+
+    auto Sym = Syms.begin();
+    auto Access = Accesses.begin();
+    while (Access != Accesses.end()) {
+      // Skip symbols until the access is before the end of Sym
+      if (Sym != Syms.end() && Access->first >= Sym->End) {
+        ++Sym;
+        continue;
+      }
+      if (Sym != Syms.end() && Access->first >= Sym->Start)
+        Objects[Sym->Name].add(Access->second->second);
+      else
+        Pages[Access->second->first & ~0xfffULL].add(Access->second->second);
+      ++Access;
+    }
+  }
+
+  for (auto &KV : Pages) {
+    char Name[32];
+    snprintf(Name, sizeof(Name), "[page 0x%llx]", (unsigned long long)KV.first);
+    Objects[Name].add(KV.second);
+  }
+
+  // Emit only objects that took up > 0.5% of any counter, like functions.
+  for (auto &KV : Objects) {
+    bool Keep = false;
+    for (auto &C : KV.second.Counters) {
+      if ((double)C.second / (double)TotalEvents[C.first] > 0.005) {
+        Keep = true;
+        break;
+      }
+    }
+    if (!Keep)
+      continue;
+
+    auto *Counters = PyDict_New();
+    for (auto &C : KV.second.Counters)
+      setCounter(Counters, C.first, C.second);
+    auto *Levels = PyDict_New();
+    for (auto &L : KV.second.Levels)
+      setCounter(Levels, L.first, L.second);
+    auto *Obj = PyDict_New();
+    PyDict_SetItemString(Obj, "counters", Counters);
+    PyDict_SetItemString(Obj, "levels", Levels);
+    PyDict_SetItemString(DataObjectsDict, KV.first.c_str(), Obj);
+    Py_DECREF(Counters);
+    Py_DECREF(Levels);
+    Py_DECREF(Obj);
+  }
 }
 
 PyObject *PerfReader::complete() {
   auto *Obj = PyDict_New();
   PyDict_SetItemString(Obj, "counters", TopLevelCounters);
   PyDict_SetItemString(Obj, "functions", Functions);
+  if (DataObjects)
+    PyDict_SetItemString(Obj, "data-objects", DataObjectsDict);
+  if (Detail != DL_Instructions) {
+    auto *Str = PyUnicode_FromString(Detail == DL_Functions ? "functions"
+                                                            : "addresses");
+    PyDict_SetItemString(Obj, "detail", Str);
+    Py_DECREF(Str);
+  }
+  if (!TotalLatency.empty()) {
+    auto *Names = PyList_New(0);
+    for (auto *Name : LatencyCounterNames) {
+      auto *Str = PyUnicode_FromString(Name);
+      PyList_Append(Names, Str);
+      Py_DECREF(Str);
+    }
+    PyDict_SetItemString(Obj, "absolute-counters", Names);
+    Py_DECREF(Names);
+  }
+  if (Columnar) {
+    auto *Names = PyList_New(CounterColumns.size());
+    for (auto &KV : CounterColumns)
+      PyList_SetItem(Names, KV.second, PyUnicode_FromString(KV.first));
+    auto *Pool = PyBytes_FromStringAndSize(TextPool.data(), TextPool.size());
+    PyDict_SetItemString(Obj, "counter-names", Names);
+    PyDict_SetItemString(Obj, "text-pool", Pool);
+    Py_DECREF(Names);
+    Py_DECREF(Pool);
+  }
   return Obj;
 }
 
 #ifndef STANDALONE
-static PyObject *cPerf_importPerf(PyObject *self, PyObject *args) {
+// Parse the 'disassembler' argument: 'auto' uses the in-process disassembler
+// where possible, 'objdump' (the default) always runs objdump.
+static bool parseDisassembler(const char *Disasm, bool &NativeDisassembly) {
+  NativeDisassembly = !strcmp(Disasm, "auto");
+  if (!NativeDisassembly && strcmp(Disasm, "objdump")) {
+    PyErr_SetString(PyExc_ValueError,
+                    "disassembler must be 'auto' or 'objdump'");
+    return false;
+  }
+  return true;
+}
+
+// Parse the 'detail' argument.
+static bool parseDetail(const char *Detail, DetailLevel &Level) {
+  if (!strcmp(Detail, "instructions")) {
+    Level = DL_Instructions;
+  } else if (!strcmp(Detail, "addresses")) {
+    Level = DL_Addresses;
+  } else if (!strcmp(Detail, "functions")) {
+    Level = DL_Functions;
+  } else {
+    PyErr_SetString(PyExc_ValueError, "detail must be 'instructions', "
+                                      "'addresses' or 'functions'");
+    return false;
+  }
+  return true;
+}
+
+// Parse a sequence of integers into Set.
+static bool parseIDs(PyObject *Seq, const char *What, std::set<uint32_t> &Set) {
+  if (!Seq || Seq == Py_None)
+    return true;
+  PyObject *Iter = PyObject_GetIter(Seq);
+  if (!Iter) {
+    PyErr_Format(PyExc_TypeError, "%s must be a sequence of integers", What);
+    return false;
+  }
+  while (PyObject *Item = PyIter_Next(Iter)) {
+    unsigned long ID = PyLong_AsUnsignedLong(Item);
+    Py_DECREF(Item);
+    if (PyErr_Occurred())
+      break;
+    Set.insert((uint32_t)ID);
+  }
+  Py_DECREF(Iter);
+  return !PyErr_Occurred();
+}
+
+// Parse the sample filter arguments: sequences of pids, tids and CPUs, a
+// regular expression for command names, and a (start, end) time window in
+// seconds after the first sample, either end of which may be None.
+static bool parseFilter(PyObject *Pids, PyObject *Tids, const char *Comm,
+                        PyObject *TimeRange, PyObject *Cpus,
+                        SampleFilter &Filter) {
+  if (!parseIDs(Pids, "pids", Filter.Pids) ||
+      !parseIDs(Tids, "tids", Filter.Tids) ||
+      !parseIDs(Cpus, "cpus", Filter.Cpus))
+    return false;
+
+  if (Comm && *Comm) {
+    try {
+      Filter.CommRegex = std::regex(Comm);
+    } catch (std::regex_error &E) {
+      PyErr_Format(PyExc_ValueError, "invalid comm regex '%s': %s", Comm,
+                   E.what());
+      return false;
+    }
+    Filter.Comm = Comm;
+  }
+
+  if (TimeRange && TimeRange != Py_None) {
+    PyObject *Start, *End;
+    if (!PyArg_ParseTuple(TimeRange, "OO", &Start, &End))
+      return false;
+    if (Start != Py_None) {
+      double S = PyFloat_AsDouble(Start);
+      if (PyErr_Occurred())
+        return false;
+      Filter.TimeStart = S > 0 ? (uint64_t)(S * 1e9) : 0;
+    }
+    if (End != Py_None) {
+      double E = PyFloat_AsDouble(End);
+      if (PyErr_Occurred())
+        return false;
+      Filter.TimeEnd = E > 0 ? (uint64_t)(E * 1e9) : 0;
+    }
+  }
+  return true;
+}
+
+// Report the exception being handled as a Python exception.
+static void setPythonError() {
+  try {
+    throw;
+  } catch (std::invalid_argument &E) {
+    PyErr_SetString(PyExc_ValueError, E.what());
+  } catch (std::logic_error &E) {
+    PyErr_SetString(PyExc_AssertionError, E.what());
+  } catch (std::runtime_error &E) {
+    PyErr_SetString(PyExc_RuntimeError, E.what());
+  } catch (...) {
+    PyErr_SetString(PyExc_RuntimeError, "Unknown error");
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// FunctionIterator - the functions of a profile, emitted one at a time
+//===----------------------------------------------------------------------===//
+
+struct FunctionIteratorObject {
+  PyObject_HEAD
+  PerfReader *Reader;
+  size_t Next;
+  // Everything importPerf returns but the functions.
+  PyObject *Info;
+};
+
+static PyTypeObject FunctionIteratorType;
+
+static void FunctionIterator_dealloc(FunctionIteratorObject *Self) {
+  delete Self->Reader;
+  Py_XDECREF(Self->Info);
+  PyObject_Del(Self);
+}
+
+static PyObject *FunctionIterator_next(FunctionIteratorObject *Self) {
+  if (!Self->Reader || Self->Next == Self->Reader->getNumKeptSymbols())
+    return NULL; // StopIteration
+  try {
+    return Self->Reader->takeKeptSymbol(Self->Next++);
+  } catch (...) {
+    setPythonError();
+    return NULL;
+  }
+}
+
+static PyObject *FunctionIterator_getInfo(FunctionIteratorObject *Self,
+                                          void *) {
+  Py_INCREF(Self->Info);
+  return Self->Info;
+}
+
+static PyGetSetDef FunctionIteratorGetSet[] = {
+    {(char *)"info", (getter)FunctionIterator_getInfo, nullptr,
+     (char *)"The profile's top-level data, as returned by importPerf() but "
+             "without 'functions'",
+     nullptr},
+    {nullptr, nullptr, nullptr, nullptr, nullptr}};
+
+static int initFunctionIteratorType() {
+  FunctionIteratorType.tp_name = "cPerf.FunctionIterator";
+  FunctionIteratorType.tp_basicsize = sizeof(FunctionIteratorObject);
+  FunctionIteratorType.tp_dealloc = (destructor)FunctionIterator_dealloc;
+  FunctionIteratorType.tp_iter = PyObject_SelfIter;
+  FunctionIteratorType.tp_iternext = (iternextfunc)FunctionIterator_next;
+  FunctionIteratorType.tp_getset = FunctionIteratorGetSet;
+  FunctionIteratorType.tp_flags = Py_TPFLAGS_DEFAULT;
+  FunctionIteratorType.tp_doc = "Iterator over the (name, function) pairs "
+                                "of a perf.data file";
+  return PyType_Ready(&FunctionIteratorType);
+}
+
+static PyObject *cPerf_importPerf(PyObject *, PyObject *args,
+                                  PyObject *kwargs) {
+  static const char *Kwlist[] = {"filename", "objdump", "binaryCacheRoot",
+                                 "detail", "columnar", "disassembler",
+                                 "dataObjects", "normalize", "kallsyms",
+                                 "vmlinux", "pids", "tids", "comm",
+                                 "timeRange", "cpus", nullptr};
   const char *Fname;
   const char *Objdump = "objdump";
   const char *BinaryCacheRoot = "";
-  if (!PyArg_ParseTuple(args, "s|ss", &Fname, &Objdump, &BinaryCacheRoot))
+  const char *Detail = "instructions";
+  int Columnar = 0;
+  const char *Disasm = "objdump";
+  int DataObjects = 0;
+  int Normalize = 0;
+  const char *Kallsyms = "";
+  const char *Vmlinux = "";
+  PyObject *Pids = nullptr, *Tids = nullptr, *TimeRange = nullptr;
+  PyObject *Cpus = nullptr;
+  const char *Comm = "";
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|ssspsppssOOsOO",
+                                   (char **)Kwlist, &Fname, &Objdump,
+                                   &BinaryCacheRoot, &Detail, &Columnar,
+                                   &Disasm, &DataObjects, &Normalize,
+                                   &Kallsyms, &Vmlinux, &Pids, &Tids, &Comm,
+                                   &TimeRange, &Cpus))
+    return NULL;
+
+  SampleFilter Filter;
+  if (!parseFilter(Pids, Tids, Comm, TimeRange, Cpus, Filter))
+    return NULL;
+
+  bool NativeDisassembly;
+  if (!parseDisassembler(Disasm, NativeDisassembly))
+    return NULL;
+
+  DetailLevel Level;
+  if (!parseDetail(Detail, Level))
     return NULL;
 
   try {
-    PerfReader P(Fname, Objdump, BinaryCacheRoot);
+    PerfReader P(Fname, Objdump, BinaryCacheRoot, Level, Columnar,
+                 NativeDisassembly, DataObjects, Normalize, Filter);
+    P.setKernelSymbols(Kallsyms, Vmlinux);
     P.readHeader();
     P.readAttrs();
+    P.readBuildIds();
     P.readDataStream();
     P.emitTopLevelCounters();
     P.emitMaps();
+    if (DataObjects)
+      P.emitDataObjects();
     return P.complete();
+  } catch (...) {
+    setPythonError();
+    return NULL;
+  }
+}
+
+static PyObject *cPerf_iterFunctions(PyObject *, PyObject *args,
+                                     PyObject *kwargs) {
+  static const char *Kwlist[] = {"filename", "objdump", "binaryCacheRoot",
+                                 "detail", "disassembler", "dataObjects",
+                                 "normalize", "kallsyms", "vmlinux", "pids",
+                                 "tids", "comm", "timeRange", "cpus",
+                                 nullptr};
+  const char *Fname;
+  const char *Objdump = "objdump";
+  const char *BinaryCacheRoot = "";
+  const char *Detail = "instructions";
+  const char *Disasm = "objdump";
+  int DataObjects = 0;
+  int Normalize = 0;
+  const char *Kallsyms = "";
+  const char *Vmlinux = "";
+  PyObject *Pids = nullptr, *Tids = nullptr, *TimeRange = nullptr;
+  PyObject *Cpus = nullptr;
+  const char *Comm = "";
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|ssssppssOOsOO",
+                                   (char **)Kwlist, &Fname, &Objdump,
+                                   &BinaryCacheRoot, &Detail, &Disasm,
+                                   &DataObjects, &Normalize, &Kallsyms,
+                                   &Vmlinux, &Pids, &Tids, &Comm, &TimeRange,
+                                   &Cpus))
+    return NULL;
+
+  SampleFilter Filter;
+  if (!parseFilter(Pids, Tids, Comm, TimeRange, Cpus, Filter))
+    return NULL;
+
+  bool NativeDisassembly;
+  if (!parseDisassembler(Disasm, NativeDisassembly))
+    return NULL;
+
+  DetailLevel Level;
+  if (!parseDetail(Detail, Level))
+    return NULL;
+
+  auto *It = PyObject_New(FunctionIteratorObject, &FunctionIteratorType);
+  if (!It)
+    return NULL;
+  It->Reader = nullptr;
+  It->Next = 0;
+  It->Info = nullptr;
+  try {
+    // Everything up to the emission of the functions themselves is done now.
+    It->Reader = new PerfReader(Fname, Objdump, BinaryCacheRoot, Level, false,
+                                NativeDisassembly, DataObjects, Normalize,
+                                Filter);
+    PerfReader &P = *It->Reader;
+    P.setKernelSymbols(Kallsyms, Vmlinux);
+    P.readHeader();
+    P.readAttrs();
+    P.readBuildIds();
+    P.readDataStream();
+    P.emitTopLevelCounters();
+    P.collectSymbols();
+    if (DataObjects)
+      P.emitDataObjects();
+    It->Info = P.complete();
+    PyDict_DelItemString(It->Info, "functions");
+  } catch (...) {
+    setPythonError();
+    Py_DECREF(It);
+    return NULL;
+  }
+  return (PyObject *)It;
+}
+
+static PyObject *cPerf_readTopLevelCounters(PyObject *, PyObject *args,
+                                           PyObject *kwargs) {
+  static const char *Kwlist[] = {"filename", nullptr};
+  const char *Fname;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s", (char **)Kwlist,
+                                   &Fname))
+    return NULL;
+
+  try {
+    // Only the event stream is read: no symbol table is loaded and nothing
+    // is disassembled.
+    PerfReader P(Fname, "objdump", "", DL_Functions, false, false, false,
+                 false);
+    P.readHeader();
+    P.readAttrs();
+    P.readBuildIds();
+    P.readDataStream();
+    P.emitTopLevelCounters();
+    auto *Obj = P.complete();
+    auto *Counters = PyDict_GetItemString(Obj, "counters");
+    Py_INCREF(Counters);
+    Py_DECREF(Obj);
+    return Counters;
+  } catch (...) {
+    setPythonError();
+    return NULL;
+  }
+}
+
+// Disassemble [start, end) of filename, which must resolve to a file under
+// binaryCacheRoot (see confinedBinary()).
+static PyObject *cPerf_disassemble(PyObject *, PyObject *args,
+                                   PyObject *kwargs) {
+  static const char *Kwlist[] = {"filename", "start", "end", "objdump",
+                                 "binaryCacheRoot", "disassembler", "buildId",
+                                 nullptr};
+  const char *Fname;
+  unsigned long long Start, End;
+  const char *Objdump = "objdump";
+  const char *BinaryCacheRoot = "";
+  const char *Disasm = "objdump";
+  const char *BuildID = "";
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sKK|ssss", (char **)Kwlist,
+                                   &Fname, &Start, &End, &Objdump,
+                                   &BinaryCacheRoot, &Disasm, &BuildID))
+    return NULL;
+
+  bool NativeDisassembly;
+  if (!parseDisassembler(Disasm, NativeDisassembly))
+    return NULL;
+
+  try {
+    Map M(Start, End, Fname);
+    M.BuildID = BuildID;
+    if (confinedBinary(BinaryCacheRoot, M).empty()) {
+      PyErr_Format(PyExc_ValueError,
+                   "%s is not a binary under the binary cache root", Fname);
+      return NULL;
+    }
+    ObjdumpOutput ObjdumpDump(Objdump, BinaryCacheRoot);
+    Disassembler *Dump = &ObjdumpDump;
+#ifdef HAVE_LLVM_DISASSEMBLER
+    LLVMDisassemblerOutput Native(BinaryCacheRoot);
+    if (NativeDisassembly && Native.reset(&M, Start, End))
+      Dump = &Native;
+#endif
+    if (Dump == &ObjdumpDump)
+      ObjdumpDump.reset(&M, Start, End);
+
+    auto *Lines = PyList_New(0);
+    for (uint64_t I = Dump->next(); I < End; I = Dump->next()) {
+      auto *Line = Py_BuildValue("(Ks)", (unsigned long long)I,
+                                 Dump->getText().c_str());
+      PyList_Append(Lines, Line);
+      Py_DECREF(Line);
+    }
+    return Lines;
   } catch (std::logic_error &E) {
     PyErr_SetString(PyExc_AssertionError, E.what());
     return NULL;
-  } catch (std::runtime_error &E) {
-    PyErr_SetString(PyExc_RuntimeError, E.what());
-    return NULL;
   } catch (...) {
     PyErr_SetString(PyExc_RuntimeError, "Unknown error");
     return NULL;
   }
 }
 
-static PyMethodDef cPerfMethods[] = {{"importPerf", cPerf_importPerf,
-                                      METH_VARARGS,
+#ifdef HAVE_BZLIB
+//===----------------------------------------------------------------------===//
+// ProfileV2 serialization
+//===----------------------------------------------------------------------===//
+
+// The encodings of profilev2impl.py: writeNum(), writeString() and
+// writeFloat().
+static void writeULEB(std::string &S, uint64_t N) {
+  do {
+    unsigned char B = N & 0x7f;
+    N >>= 7;
+    if (N)
+      B |= 0x80;
+    S += (char)B;
+  } while (N);
+}
+
+static bool writePyString(std::string &S, PyObject *Str) {
+  Py_ssize_t Len;
+  const char *P = PyUnicode_AsUTF8AndSize(Str, &Len);
+  if (!P)
+    return false;
+  S.append(P, Len);
+  S += '\n';
+  return true;
+}
+
+// Counters are stored as the bits of their value as a float32.
+static bool writePyFloat(std::string &S, PyObject *Value) {
+  double D = PyFloat_AsDouble(Value);
+  if (D == -1.0 && PyErr_Occurred())
+    return false;
+  if (D == 0.0) {
+    writeULEB(S, 0);
+    return true;
+  }
+  float F = (float)D;
+  if (std::isinf(F) && !std::isinf(D)) {
+    PyErr_SetString(PyExc_OverflowError,
+                    "float too large to pack with f format");
+    return false;
+  }
+  int32_t Bits;
+  memcpy(&Bits, &F, sizeof(Bits));
+  if (Bits < 0) {
+    PyErr_SetString(PyExc_ValueError, "negative counter value");
+    return false;
+  }
+  writeULEB(S, (uint64_t)Bits);
+  return true;
+}
+
+static bool pyToU64(PyObject *Value, uint64_t &N) {
+  PyObject *Int = PyNumber_Long(Value);
+  if (!Int)
+    return false;
+  N = PyLong_AsUnsignedLongLong(Int);
+  Py_DECREF(Int);
+  return !PyErr_Occurred();
+}
+
+// The items of a mapping with string keys, sorted by key. The items hold
+// references to the keys and values.
+class SortedItems {
+public:
+  bool init(PyObject *Mapping) {
+    Items = PyMapping_Items(Mapping);
+    if (!Items)
+      return false;
+    for (Py_ssize_t I = 0, E = PyList_GET_SIZE(Items); I < E; ++I) {
+      PyObject *Item = PyList_GET_ITEM(Items, I);
+      Py_ssize_t Len;
+      const char *Key = PyUnicode_AsUTF8AndSize(PyTuple_GET_ITEM(Item, 0),
+                                                &Len);
+      if (!Key)
+        return false;
+      Sorted.push_back({std::string(Key, Len), PyTuple_GET_ITEM(Item, 1)});
+    }
+    std::sort(Sorted.begin(), Sorted.end(),
+              [](const std::pair<std::string, PyObject *> &A,
+                 const std::pair<std::string, PyObject *> &B) {
+                return A.first < B.first;
+              });
+    return true;
+  }
+  ~SortedItems() { Py_XDECREF(Items); }
+
+  std::vector<std::pair<std::string, PyObject *>> Sorted;
+
+private:
+  PyObject *Items = nullptr;
+};
+
+// TextPool.getOrCreate() on a copy of a TextPool: strings are written at the
+// position its buffer was left at, which is the end of the pool unless the
+// pool was read from a file.
+struct TextPoolWriter {
+  std::string Data;
+  size_t Pos;
+  std::unordered_map<std::string, uint64_t> Offsets;
+
+  uint64_t getOrCreate(const char *Text, size_t Len) {
+    std::string Key(Text, Len);
+    auto I = Offsets.find(Key);
+    if (I != Offsets.end())
+      return I->second;
+    uint64_t Offset = Pos;
+    if (Data.size() < Pos + Len + 1)
+      Data.resize(Pos + Len + 1);
+    memcpy(&Data[Pos], Text, Len);
+    Data[Pos + Len] = '\n';
+    Pos += Len + 1;
+    Offsets.emplace(std::move(Key), Offset);
+    return Offset;
+  }
+};
+
+// Compress In as bz2.compress() does (level 9, default work factor).
+static bool bz2Compress(const std::string &In, std::string &Out) {
+  bz_stream S;
+  memset(&S, 0, sizeof(S));
+  if (BZ2_bzCompressInit(&S, 9, 0, 0) != BZ_OK)
+    return false;
+  Out.resize(In.size() + In.size() / 100 + 600);
+  size_t InPos = 0, OutPos = 0;
+  int Result;
+  do {
+    if (S.avail_in == 0 && InPos < In.size()) {
+      size_t N = std::min<size_t>(In.size() - InPos, 1U << 30);
+      S.next_in = const_cast<char *>(In.data()) + InPos;
+      S.avail_in = (unsigned)N;
+      InPos += N;
+    }
+    if (Out.size() - OutPos < (1 << 16))
+      Out.resize(Out.size() * 2 + (1 << 16));
+    size_t Room = std::min<size_t>(Out.size() - OutPos, 1U << 30);
+    S.next_out = &Out[OutPos];
+    S.avail_out = (unsigned)Room;
+    Result = BZ2_bzCompress(&S, InPos < In.size() || S.avail_in
+                                    ? BZ_RUN
+                                    : BZ_FINISH);
+    OutPos += Room - S.avail_out;
+  } while (Result == BZ_RUN_OK || Result == BZ_FINISH_OK);
+  BZ2_bzCompressEnd(&S);
+  Out.resize(OutPos);
+  return Result == BZ_STREAM_END;
+}
+
+static PyObject *cPerf_serializeProfileV2(PyObject *, PyObject *args,
+                                          PyObject *kwargs) {
+  static const char *Kwlist[] = {"header",       "counterNames",
+                                 "counters",     "functions",
+                                 "getCode",      "textPool",
+                                 "textPoolPosition", "textPoolOffsets",
+                                 "threads",      nullptr};
+  const char *HeaderData;
+  Py_ssize_t HeaderLen;
+  PyObject *CounterNames, *Counters, *Functions, *GetCode;
+  const char *PoolData = "\n";
+  Py_ssize_t PoolLen = 1, PoolPos = 1;
+  PyObject *PoolOffsets = nullptr;
+  int Threads = 0;
+  if (!PyArg_ParseTupleAndKeywords(
+          args, kwargs, "y#OOOO|y#nOi", (char **)Kwlist, &HeaderData,
+          &HeaderLen, &CounterNames, &Counters, &Functions, &GetCode,
+          &PoolData, &PoolLen, &PoolPos, &PoolOffsets, &Threads))
+    return NULL;
+
+  // The sections, in the order of ProfileV2.sections.
+  enum { Header, CNP, TLC, LC, LA, LT, TP, Funcs, NumSections };
+  std::string Sections[NumSections];
+  Sections[Header].assign(HeaderData, HeaderLen);
+
+  // CounterNamePool, and the index of each name.
+  std::unordered_map<std::string, uint64_t> CounterIndex;
+  PyObject *Names = PySequence_Fast(CounterNames, "counterNames must be a "
+                                                  "sequence");
+  if (!Names)
+    return NULL;
+  writeULEB(Sections[CNP], PySequence_Fast_GET_SIZE(Names));
+  for (Py_ssize_t I = 0, E = PySequence_Fast_GET_SIZE(Names); I < E; ++I) {
+    PyObject *Name = PySequence_Fast_GET_ITEM(Names, I);
+    Py_ssize_t Len;
+    const char *P = PyUnicode_AsUTF8AndSize(Name, &Len);
+    if (!P) {
+      Py_DECREF(Names);
+      return NULL;
+    }
+    CounterIndex[std::string(P, Len)] = I;
+    writePyString(Sections[CNP], Name);
+  }
+  Py_DECREF(Names);
+  auto counterIndex = [&](const std::string &Name, uint64_t &Index) {
+    auto It = CounterIndex.find(Name);
+    if (It == CounterIndex.end()) {
+      PyErr_SetString(PyExc_KeyError, Name.c_str());
+      return false;
+    }
+    Index = It->second;
+    return true;
+  };
+
+  // TopLevelCounters.
+  {
+    SortedItems Items;
+    if (!Items.init(Counters))
+      return NULL;
+    writeULEB(Sections[TLC], Items.Sorted.size());
+    for (auto &KV : Items.Sorted) {
+      uint64_t Index, Value;
+      if (!counterIndex(KV.first, Index) || !pyToU64(KV.second, Value))
+        return NULL;
+      writeULEB(Sections[TLC], Index);
+      writeULEB(Sections[TLC], Value);
+    }
+  }
+
+  TextPoolWriter Pool;
+  Pool.Data.assign(PoolData, PoolLen);
+  Pool.Pos = PoolPos;
+  if (PoolOffsets && PoolOffsets != Py_None) {
+    SortedItems Items;
+    if (!Items.init(PoolOffsets))
+      return NULL;
+    for (auto &KV : Items.Sorted) {
+      uint64_t Offset;
+      if (!pyToU64(KV.second, Offset))
+        return NULL;
+      Pool.Offsets[KV.first] = Offset;
+    }
+  }
+
+  // LineCounters, LineAddresses and LineText in one pass over the code of
+  // each function, then Functions.
+  SortedItems FunctionItems;
+  if (!FunctionItems.init(Functions))
+    return NULL;
+  std::string &F = Sections[Funcs];
+  writeULEB(F, FunctionItems.Sorted.size());
+  for (auto &KV : FunctionItems.Sorted) {
+    PyObject *Name = PyUnicode_FromStringAndSize(KV.first.data(),
+                                                 KV.first.size());
+    PyObject *FuncCounters = PyMapping_GetItemString(KV.second, "counters");
+    PyObject *Length = FuncCounters
+                           ? PyMapping_GetItemString(KV.second, "length")
+                           : nullptr;
+    PyObject *Code = Length ? PyObject_CallFunctionObjArgs(GetCode, Name,
+                                                           NULL)
+                            : nullptr;
+    PyObject *It = Code ? PyObject_GetIter(Code) : nullptr;
+    Py_XDECREF(Code);
+    SortedItems Counted;
+    uint64_t NumLines = 0;
+    bool OK = It && Counted.init(FuncCounters);
+    std::vector<PyObject *> Keys;
+    for (auto &C : Counted.Sorted)
+      Keys.push_back(PyUnicode_FromStringAndSize(C.first.data(),
+                                                 C.first.size()));
+
+    uint64_t LCOffset = Sections[LC].size(), LAOffset = Sections[LA].size(),
+             LTOffset = Sections[LT].size();
+    uint64_t PrevAddress = 0;
+    while (OK) {
+      PyObject *Line = PyIter_Next(It);
+      if (!Line) {
+        OK = !PyErr_Occurred();
+        break;
+      }
+      PyObject *Fields = PySequence_Fast(Line, "code lines must be "
+                                               "sequences");
+      Py_DECREF(Line);
+      if (!Fields || PySequence_Fast_GET_SIZE(Fields) != 3) {
+        if (Fields)
+          PyErr_SetString(PyExc_ValueError,
+                          "code lines must be (counters, address, text)");
+        Py_XDECREF(Fields);
+        OK = false;
+        break;
+      }
+      PyObject *LineCounters = PySequence_Fast_GET_ITEM(Fields, 0);
+      for (PyObject *Key : Keys) {
+        PyObject *V = PyObject_GetItem(LineCounters, Key);
+        if (!V) {
+          if (!PyErr_ExceptionMatches(PyExc_KeyError)) {
+            OK = false;
+            break;
+          }
+          PyErr_Clear();
+          writeULEB(Sections[LC], 0);
+          continue;
+        }
+        OK = writePyFloat(Sections[LC], V);
+        Py_DECREF(V);
+        if (!OK)
+          break;
+      }
+      uint64_t Address;
+      OK = OK && pyToU64(PySequence_Fast_GET_ITEM(Fields, 1), Address);
+      Py_ssize_t TextLen;
+      const char *Text =
+          OK ? PyUnicode_AsUTF8AndSize(PySequence_Fast_GET_ITEM(Fields, 2),
+                                       &TextLen)
+             : nullptr;
+      if (OK && Text) {
+        // FIXME: As in LineAddresses.serialize(), addresses that go
+        // backwards are written as no increment.
+        writeULEB(Sections[LA], Address > PrevAddress ? Address - PrevAddress
+                                                      : 0);
+        PrevAddress = Address;
+        writeULEB(Sections[LT], Pool.getOrCreate(Text, TextLen));
+        ++NumLines;
+      } else {
+        OK = false;
+      }
+      Py_DECREF(Fields);
+    }
+    writeULEB(Sections[LT], 0); // Sequence terminator.
+    for (PyObject *Key : Keys)
+      Py_DECREF(Key);
+    Py_XDECREF(It);
+
+    uint64_t N = 0;
+    if (OK && (OK = writePyString(F, Name) && pyToU64(Length, N))) {
+      writeULEB(F, N);
+      writeULEB(F, LCOffset);
+      writeULEB(F, LAOffset);
+      writeULEB(F, LTOffset);
+      writeULEB(F, Counted.Sorted.size());
+      for (auto &C : Counted.Sorted) {
+        uint64_t Index;
+        if (!(OK = counterIndex(C.first, Index)))
+          break;
+        writeULEB(F, Index);
+        if (!(OK = writePyFloat(F, C.second)))
+          break;
+      }
+    }
+    Py_DECREF(Name);
+    Py_XDECREF(FuncCounters);
+    Py_XDECREF(Length);
+    if (!OK)
+      return NULL;
+  }
+  Sections[TP] = std::move(Pool.Data);
+
+  // Compress the four large sections at once. They are independent, and
+  // bzip2 at level 9 takes much longer than encoding them.
+  int Compressed[] = {LC, LA, LT, TP};
+  std::string Output[4];
+  bool Failed = false;
+  Py_BEGIN_ALLOW_THREADS
+  std::atomic<unsigned> Next(0);
+  std::atomic<bool> Error(false);
+  auto Work = [&] {
+    for (unsigned I; (I = Next++) < 4;)
+      if (!bz2Compress(Sections[Compressed[I]], Output[I]))
+        Error = true;
+  };
+  unsigned NumThreads = Threads > 0 ? (unsigned)Threads
+                                    : std::thread::hardware_concurrency();
+  NumThreads = std::max(1U, std::min(NumThreads, 4U));
+  std::vector<std::thread> Workers;
+  for (unsigned I = 1; I < NumThreads; ++I)
+    Workers.emplace_back(Work);
+  Work();
+  for (auto &W : Workers)
+    W.join();
+  Failed = Error;
+  Py_END_ALLOW_THREADS
+  if (Failed) {
+    PyErr_SetString(PyExc_RuntimeError, "bzip2 compression failed");
+    return NULL;
+  }
+  for (unsigned I = 0; I < 4; ++I)
+    Sections[Compressed[I]] = std::move(Output[I]);
+
+  // The version, the offset and size of each section (and the empty pool
+  // file name of the TextPool), then the sections.
+  std::string Out;
+  writeULEB(Out, 2);
+  uint64_t Offset = 0;
+  size_t Total = 0;
+  for (unsigned I = 0; I < NumSections; ++I) {
+    writeULEB(Out, Offset);
+    writeULEB(Out, Sections[I].size());
+    if (I == TP)
+      Out += '\n';
+    Offset += Sections[I].size();
+    Total += Sections[I].size();
+  }
+  Out.reserve(Out.size() + Total);
+  for (auto &S : Sections)
+    Out += S;
+  return PyBytes_FromStringAndSize(Out.data(), Out.size());
+}
+#endif
+
+static PyMethodDef cPerfMethods[] = {{"importPerf",
+                                      (PyCFunction)(void (*)(void))cPerf_importPerf,
+                                      METH_VARARGS | METH_KEYWORDS,
                                       "Import perf.data from a filename"},
+                                     {"iterFunctions",
+                                      (PyCFunction)(void (*)(void))cPerf_iterFunctions,
+                                      METH_VARARGS | METH_KEYWORDS,
+                                      "Import perf.data from a filename, "
+                                      "one function at a time"},
+                                     {"readTopLevelCounters",
+                                      (PyCFunction)(void (*)(void))cPerf_readTopLevelCounters,
+                                      METH_VARARGS | METH_KEYWORDS,
+                                      "Read only the top-level counters of "
+                                      "perf.data from a filename"},
+                                     {"disassemble",
+                                      (PyCFunction)(void (*)(void))cPerf_disassemble,
+                                      METH_VARARGS | METH_KEYWORDS,
+                                      "Disassemble an address range of a "
+                                      "binary into (address, text) pairs"},
+#ifdef HAVE_BZLIB
+                                     {"serializeProfileV2",
+                                      (PyCFunction)(void (*)(void))cPerf_serializeProfileV2,
+                                      METH_VARARGS | METH_KEYWORDS,
+                                      "Write the sections of a profile as "
+                                      "a ProfileV2 file"},
+#endif
                                      {NULL, NULL, 0, NULL}};
 
 static PyModuleDef cPerfModuleDef = {PyModuleDef_HEAD_INIT,
@@ -1132,7 +4817,22 @@ static PyModuleDef cPerfModuleDef = {PyModuleDef_HEAD_INIT,
                                      nullptr};
 
 PyMODINIT_FUNC PyInit_cPerf(void) {
-  return PyModule_Create(&cPerfModuleDef);
+  if (initColumnType() < 0 || initFunctionIteratorType() < 0)
+    return nullptr;
+  auto *M = PyModule_Create(&cPerfModuleDef);
+  if (!M)
+    return nullptr;
+  Py_INCREF(&ColumnType);
+  PyModule_AddObject(M, "Column", (PyObject *)&ColumnType);
+  Py_INCREF(&FunctionIteratorType);
+  PyModule_AddObject(M, "FunctionIterator",
+                     (PyObject *)&FunctionIteratorType);
+#ifdef HAVE_LLVM_DISASSEMBLER
+  PyModule_AddIntConstant(M, "NATIVE_DISASSEMBLER", 1);
+#else
+  PyModule_AddIntConstant(M, "NATIVE_DISASSEMBLER", 0);
+#endif
+  return M;
 }
 
 #else // STANDALONE
@@ -1155,13 +4855,29 @@ int main(int argc, char **argv) {
 
   std::string BinaryCacheRoot = getEnvVar("LNT_BINARY_CACHE_ROOT", "");
   std::string Objdump = getEnvVar("CMAKE_OBJDUMP", "objdump");
-
-  PerfReader P(argv[1], Objdump, BinaryCacheRoot);
+  std::string Detail = getEnvVar("LNT_PROFILE_DETAIL", "instructions");
+  DetailLevel Level = DL_Instructions;
+  if (Detail == "functions")
+    Level = DL_Functions;
+  else if (Detail == "addresses")
+    Level = DL_Addresses;
+
+  bool NativeDisassembly = getEnvVar("LNT_DISASSEMBLER", "objdump") == "auto";
+  bool DataObjects = !getEnvVar("LNT_PROFILE_DATA_OBJECTS", "").empty();
+  bool Normalize = !getEnvVar("LNT_PROFILE_NORMALIZE", "").empty();
+
+  PerfReader P(argv[1], Objdump, BinaryCacheRoot, Level, false,
+               NativeDisassembly, DataObjects, Normalize);
+  P.setKernelSymbols(getEnvVar("LNT_KALLSYMS", ""),
+                     getEnvVar("LNT_VMLINUX", ""));
   P.readHeader();
   P.readAttrs();
+  P.readBuildIds();
   P.readDataStream();
   P.emitTopLevelCounters();
   P.emitMaps();
+  if (DataObjects)
+    P.emitDataObjects();
   PyObject_Print(P.complete(), stdout, Py_PRINT_RAW);
   fputs("\n", stdout); // Usually expected by UNIX shells
   Py_FinalizeEx();
@@ -1,7 +1,9 @@
 from lnt.util import logger
 from .profile import ProfileImpl
 from .profilev1impl import ProfileV1
+from .profilev2impl import ProfileV2, ProfileV2Writer
 
+import functools
 import os
 import traceback
 import glob
@@ -12,6 +14,64 @@ except Exception:
     pass
 
 
+# Metrics derived from counters at import time, as (name, numerator,
+# denominator, scale). Like latencies, they are absolute values rather than
+# percentages. They are most meaningful per instruction when the counters were
+# recorded as a group (see "Group reads" in cPerf.cpp).
+DERIVED_METRICS = [
+    ('IPC', 'instructions', 'cycles', 1.0),
+    ('cache-miss-rate', 'cache-misses', 'cache-references', 100.0),
+    ('branch-miss-rate', 'branch-misses', 'branch-instructions', 100.0),
+]
+
+# Other names perf gives the same events.
+_COUNTER_ALIASES = {'branches': 'branch-instructions',
+                    'cpu-cycles': 'cycles'}
+
+
+def _resolveDerivedMetrics(counter_names, metrics):
+    """
+    Return the metrics that can be computed from counter_names, as (name,
+    numerator, denominator, scale) with the actual counter names. Event
+    modifiers (such as ':u') are ignored when matching.
+    """
+    names = {}
+    for name in counter_names:
+        base = name.split(':')[0]
+        names.setdefault(_COUNTER_ALIASES.get(base, base), name)
+    return [(name, names[num], names[den], scale)
+            for name, num, den, scale in metrics
+            if num in names and den in names]
+
+
+def _addDerivedMetrics(counters, metrics):
+    """
+    Add the resolved metrics to counters, a dict of absolute counts.
+    """
+    for name, num, den, scale in metrics:
+        if counters.get(den):
+            counters[name] = scale * counters.get(num, 0) / counters[den]
+
+
+def _convertFunction(f, totals, absolute, metrics):
+    """
+    Add the derived metrics to function f, as returned by cPerf, and convert
+    its counters to percentages: of totals for the function, and of the
+    function for its instructions. Absolute counters (such as latencies and
+    derived metrics) are left alone.
+    """
+    fc = f['counters']
+    _addDerivedMetrics(fc, metrics)
+    for inst_info in f.get('data', []):
+        _addDerivedMetrics(inst_info[0], metrics)
+        for k, v in inst_info[0].items():
+            if k not in absolute:
+                inst_info[0][k] = 100.0 * float(v) / fc[k]
+    for k, v in fc.items():
+        if k not in absolute:
+            fc[k] = 100.0 * v / totals[k]
+
+
 def merge_recursively(dct1, dct2):
     # type: (dict, dict) -> None
     """Add the content of dct2 to dct1.
@@ -31,6 +91,180 @@ def merge_recursively(dct1, dct2):
             dct1[k] = v
 
 
+def _isConfined(binary, binaryCacheRoot):
+    """
+    Return whether binary, a path recorded in a profile, names a file under
+    binaryCacheRoot. cPerf.disassemble() checks the file it resolves it to,
+    possibly by build-id, as well.
+    """
+    if not binaryCacheRoot or not os.path.isabs(binary) or \
+            '..' in binary.split('/'):
+        return False
+    root = os.path.join(os.path.realpath(binaryCacheRoot), '')
+    return os.path.realpath(binaryCacheRoot + binary).startswith(root)
+
+
+@functools.lru_cache(maxsize=256)
+def _disassemble(binary, start, end, objdump, binaryCacheRoot, disassembler,
+                 buildId):
+    code = tuple(cPerf.disassemble(binary, start, end, objdump,
+                                   binaryCacheRoot, disassembler, buildId))
+    if not code:
+        # Raise rather than return, so that failures are not memoized.
+        raise RuntimeError('Could not disassemble %s [%#x, %#x)' %
+                           (binary, start, end))
+    return code
+
+
+def disassemble(binary, start, end, objdump='objdump', binaryCacheRoot='',
+                disassembler='objdump', buildId=''):
+    """
+    Disassemble [start, end) of binary, returning a tuple of (address, text)
+    pairs, or an empty tuple if the binary cannot be disassembled.
+
+    This is used to produce the text of profiles that were imported with
+    detail 'addresses' when they are first viewed. The result is memoized as
+    the same function is usually looked at many times, and in many runs of
+    the same binary.
+
+    disassembler is 'objdump' (the default) to always run objdump, or 'auto'
+    to use the in-process LLVM disassembler when cPerf was built with it
+    (falling back to objdump for binaries it cannot handle). Its text is in
+    LLVM's syntax, which differs from objdump's.
+
+    If buildId is given, the binary is first looked for by build-id in
+    binaryCacheRoot (see cPerf.cpp), and only then at binaryCacheRoot +
+    binary. binary comes from a submitted profile: it must be an absolute
+    path, and nothing outside of binaryCacheRoot is disassembled.
+    """
+    if not _isConfined(binary, binaryCacheRoot):
+        logger.warning("Not disassembling %s: not under the binary cache "
+                       "root", binary)
+        return ()
+    try:
+        return _disassemble(binary, start, end, objdump, binaryCacheRoot,
+                            disassembler, buildId)
+    except Exception:
+        logger.warning(traceback.format_exc())
+        return ()
+
+
+def _getDataObjectPercentages(dataObjects, totals):
+    """
+    Convert the absolute counts of cPerf's 'data-objects' into percentages:
+    counters of the profile total, and memory levels of the object's samples.
+    """
+    objects = {}
+    for name, o in dataObjects.items():
+        samples = sum(o['levels'].values())
+        objects[name] = {
+            'counters': {k: 100.0 * v / totals[k] if totals.get(k) else 0.0
+                         for k, v in o['counters'].items()},
+            'levels': {k: 100.0 * v / samples
+                       for k, v in o['levels'].items()}}
+    return objects
+
+
+class ColumnarProfileV1(ProfileV1):
+    """
+    A ProfileV1 backed by the result of cPerf.importPerf(columnar=True).
+
+    Per-instruction data stays in the cPerf.Column buffers returned by cPerf
+    and is only turned into Python objects one function at a time, by
+    getCodeForFunction(). Counters are converted to percentages as they are
+    read. The ProfileV1 ``data`` dict is only built if something asks for it
+    (serialize() does).
+    """
+
+    def __init__(self, result, derivedMetrics=DERIVED_METRICS):
+        self.result = result
+        self.metrics = _resolveDerivedMetrics(result['counters'],
+                                              derivedMetrics)
+        self.absolute = set(result.get('absolute-counters', []))
+        self.absolute.update(m[0] for m in self.metrics)
+        self._data = None
+
+    @property
+    def data(self):
+        if self._data is None:
+            self._data = self._buildData()
+        return self._data
+
+    def _buildData(self):
+        data = {'counters': self.result['counters'], 'functions': {}}
+        if 'detail' in self.result:
+            data['detail'] = self.result['detail']
+        if self.absolute:
+            data['absolute-counters'] = sorted(self.absolute)
+        if 'data-objects' in self.result:
+            data['data-objects'] = self.getDataObjects()
+        for fname, f in self.result['functions'].items():
+            fn = {'counters': self._getFunctionCounters(f)}
+            for k in ('binary', 'build-id', 'start', 'end', 'hash'):
+                if k in f:
+                    fn[k] = f[k]
+            if 'addresses' in f:
+                fn['data'] = [list(x) for x in self.getCodeForFunction(fname)]
+            data['functions'][fname] = fn
+        return data
+
+    def _getFunctionCounters(self, f):
+        counters = dict(f['counters'])
+        _addDerivedMetrics(counters, self.metrics)
+        return {k: v if k in self.absolute
+                else 100.0 * v / self.result['counters'][k]
+                for k, v in counters.items()}
+
+    def getTopLevelCounters(self):
+        return self.result['counters']
+
+    def getDetail(self):
+        return self.result.get('detail', 'instructions')
+
+    def getDataObjects(self):
+        return _getDataObjectPercentages(self.result.get('data-objects', {}),
+                                         self.result['counters'])
+
+    def getAbsoluteCounters(self):
+        return sorted(self.absolute)
+
+    def getBinaryInfo(self, fname):
+        f = self.result['functions'][fname]
+        if 'binary' not in f:
+            return None
+        return {k: f[k] for k in ('binary', 'build-id', 'start', 'end')}
+
+    def getFunctions(self):
+        functions = {}
+        for fname, f in self.result['functions'].items():
+            functions[fname] = {'counters': self._getFunctionCounters(f),
+                                'length': len(f.get('addresses', ()))}
+            if 'hash' in f:
+                functions[fname]['hash'] = f['hash']
+        return functions
+
+    def getCodeForFunction(self, fname):
+        f = self.result['functions'][fname]
+        if 'addresses' not in f:
+            return
+        names = self.result['counter-names']
+        pool = self.result['text-pool']
+        fc = f['counters']
+        texts = {}
+        for address, row, offset in zip(
+                memoryview(f['addresses']).tolist(),
+                memoryview(f['counter-matrix']).tolist(),
+                memoryview(f['text-offsets']).tolist()):
+            counters = {k: v for k, v in zip(names, row) if v}
+            _addDerivedMetrics(counters, self.metrics)
+            counters = {k: float(v) if k in self.absolute
+                        else 100.0 * float(v) / fc[k]
+                        for k, v in counters.items()}
+            if offset not in texts:
+                texts[offset] = pool[offset:pool.index(b'\0', offset)].decode()
+            yield (counters, address, texts[offset])
+
+
 class LinuxPerfProfile(ProfileImpl):
     def __init__(self):
         pass
@@ -42,7 +276,29 @@ class LinuxPerfProfile(ProfileImpl):
 
     @staticmethod
     def deserialize(f, objdump='objdump', propagateExceptions=False,
-                    binaryCacheRoot=''):
+                    binaryCacheRoot='', detail='instructions',
+                    disassembler='objdump', dataObjects=False,
+                    derivedMetrics=DERIVED_METRICS, normalize=False,
+                    kallsyms='', vmlinux='', filters=None):
+        """
+        Import a perf.data file. If detail is 'functions', only per-function
+        counters are imported and no disassembly is performed. If detail is
+        'addresses', per-instruction counters are imported but disassembly
+        is deferred until the profile is viewed. disassembler is as for
+        disassemble(). If dataObjects is True, sampled data addresses are
+        aggregated by data object as well (see getDataObjects()).
+        derivedMetrics are the metrics to compute for every function and
+        instruction, in the form of DERIVED_METRICS. If normalize is True,
+        disassembled functions get normalized instructions, at offsets from
+        the start of the function, and a hash of their code (see
+        ProfileImpl.getFunctions()). Samples taken in the kernel are
+        resolved against kallsyms, a copy of /proc/kallsyms, or else the
+        symbols of the vmlinux image, if either is given. filters restricts
+        the samples that are imported, and so the totals, to those of some
+        processes, threads, CPUs or time window. It is a dict of the
+        'pids', 'tids', 'comm', 'timeRange' and 'cpus' arguments of
+        cPerf.importPerf.
+        """
         f = f.name
 
         if os.path.getsize(f) == 0:
@@ -50,19 +306,39 @@ class LinuxPerfProfile(ProfileImpl):
             return None
 
         try:
+            fnames = glob.glob("%s*" % f)
+            if len(fnames) == 1:
+                return ColumnarProfileV1(cPerf.importPerf(
+                    fnames[0], objdump, binaryCacheRoot, detail,
+                    columnar=True, disassembler=disassembler,
+                    dataObjects=dataObjects, normalize=normalize,
+                    kallsyms=kallsyms, vmlinux=vmlinux, **(filters or {})),
+                    derivedMetrics)
+
             data = {}
-            for fname in glob.glob("%s*" % f):
-                cur_data = cPerf.importPerf(fname, objdump, binaryCacheRoot)
+            for fname in fnames:
+                cur_data = cPerf.importPerf(fname, objdump, binaryCacheRoot,
+                                            detail,
+                                            disassembler=disassembler,
+                                            dataObjects=dataObjects,
+                                            normalize=normalize,
+                                            kallsyms=kallsyms,
+                                            vmlinux=vmlinux,
+                                            **(filters or {}))
                 merge_recursively(data, cur_data)
 
-            # Go through the data and convert counter values to percentages.
+            # Go through the data, add derived metrics and convert counter
+            # values to percentages.
+            metrics = _resolveDerivedMetrics(data['counters'], derivedMetrics)
+            absolute = set(data.get('absolute-counters', []))
+            absolute.update(m[0] for m in metrics)
+            if absolute:
+                data['absolute-counters'] = sorted(absolute)
             for f in data['functions'].values():
-                fc = f['counters']
-                for inst_info in f['data']:
-                    for k, v in inst_info[0].items():
-                        inst_info[0][k] = 100.0 * float(v) / fc[k]
-                for k, v in fc.items():
-                    fc[k] = 100.0 * v / data['counters'][k]
+                _convertFunction(f, data['counters'], absolute, metrics)
+            if 'data-objects' in data:
+                data['data-objects'] = _getDataObjectPercentages(
+                    data['data-objects'], data['counters'])
 
             return ProfileV1(data)
 
@@ -71,3 +347,82 @@ class LinuxPerfProfile(ProfileImpl):
                 raise
             logger.warning(traceback.format_exc())
             return None
+
+    @classmethod
+    def peek(cls, f, functions=False, detail=False):
+        # The top-level counters only need the event stream to be read, not
+        # the binaries' symbol tables. Several files still need merging.
+        fnames = glob.glob("%s*" % f.name)
+        if functions or detail or len(fnames) != 1:
+            return super(LinuxPerfProfile, cls).peek(f, functions, detail)
+        if os.path.getsize(f.name) == 0:
+            return {'counters': {}}
+        return {'counters': cPerf.readTopLevelCounters(f.name)}
+
+    @staticmethod
+    def importToProfileV2(f, fname, objdump='objdump',
+                          propagateExceptions=False, binaryCacheRoot='',
+                          detail='instructions', disassembler='objdump',
+                          dataObjects=False, derivedMetrics=DERIVED_METRICS,
+                          normalize=False, kallsyms='', vmlinux='',
+                          filters=None):
+        """
+        Import the perf.data file f (a file name) straight into the
+        ProfileV2 file fname, with the same arguments as deserialize().
+
+        Functions are read from cPerf, converted and written out one at a
+        time, so that memory use does not grow with the size of the profile.
+        Returns False if the profile could not be imported.
+        """
+        if os.path.getsize(f) == 0:
+            # Empty file - exit early.
+            return False
+
+        try:
+            fnames = glob.glob("%s*" % f)
+            if len(fnames) != 1:
+                # Several files have to be merged, which needs all of them.
+                with open(f, 'rb') as fd:
+                    p = LinuxPerfProfile.deserialize(
+                        fd, objdump, propagateExceptions, binaryCacheRoot,
+                        detail, disassembler, dataObjects, derivedMetrics,
+                        normalize, kallsyms, vmlinux, filters)
+                if not p:
+                    return False
+                ProfileV2.upgrade(p).serialize(fname)
+                return True
+
+            functions = cPerf.iterFunctions(fnames[0], objdump,
+                                            binaryCacheRoot, detail,
+                                            disassembler=disassembler,
+                                            dataObjects=dataObjects,
+                                            normalize=normalize,
+                                            kallsyms=kallsyms,
+                                            vmlinux=vmlinux,
+                                            **(filters or {}))
+            info = functions.info
+            totals = info['counters']
+            metrics = _resolveDerivedMetrics(totals, derivedMetrics)
+            absolute = set(info.get('absolute-counters', []))
+            absolute.update(m[0] for m in metrics)
+            writer = ProfileV2Writer(
+                totals, absolute, detail=info.get('detail', 'instructions'),
+                data_objects=_getDataObjectPercentages(
+                    info.get('data-objects', {}), totals))
+            for name, f in functions:
+                _convertFunction(f, totals, absolute, metrics)
+                binary_info = None
+                if 'binary' in f:
+                    binary_info = {k: f[k] for k in ('binary', 'build-id',
+                                                     'start', 'end')}
+                writer.addFunction(name, f['counters'],
+                                   (tuple(x) for x in f.get('data', [])),
+                                   binary_info, f.get('hash'))
+            writer.write(fname)
+            return True
+
+        except Exception:
+            if propagateExceptions:
+                raise
+            logger.warning(traceback.format_exc())
+            return False
@@ -1,9 +1,72 @@
 import base64
+import concurrent.futures
 import lnt.testing.profile
 import os
 import tempfile
 
 
+def _upgradeOne(f, filename):
+    """Profile.upgradeFile(), for Profile.upgradeDirectory()."""
+    try:
+        if not any(impl.checkFile(f) for impl
+                   in lnt.testing.profile.IMPLEMENTATIONS.values()):
+            return False
+        directory = os.path.dirname(filename)
+        if directory and not os.path.exists(directory):
+            os.makedirs(directory, exist_ok=True)
+        return Profile.upgradeFile(f, filename)
+    except Exception as e:
+        return str(e) or e.__class__.__name__
+
+
+def _getPerfFilters():
+    """
+    Return the samples to import from Linux perf profiles, as set in the
+    environment: LNT_PROFILE_PIDS, LNT_PROFILE_TIDS and LNT_PROFILE_CPUS are
+    comma-separated lists, LNT_PROFILE_COMM a regular expression matching
+    command names and LNT_PROFILE_TIME a 'start,end' window in seconds after
+    the first sample, either end of which may be left out.
+    """
+    filters = {}
+    for key, var in (('pids', 'LNT_PROFILE_PIDS'), ('tids', 'LNT_PROFILE_TIDS'),
+                     ('cpus', 'LNT_PROFILE_CPUS')):
+        if os.getenv(var):
+            filters[key] = [int(x) for x in os.getenv(var).split(',')]
+    if os.getenv('LNT_PROFILE_COMM'):
+        filters['comm'] = os.getenv('LNT_PROFILE_COMM')
+    if os.getenv('LNT_PROFILE_TIME'):
+        start, end = os.getenv('LNT_PROFILE_TIME').split(',')
+        filters['timeRange'] = (float(start) if start else None,
+                                float(end) if end else None)
+    return filters
+
+
+# Bumped whenever Profile.getCodeForFunction() may return different code for
+# a profile than it did before, e.g. after a fix to the disassembler, so that
+# the server's responses cached by clients are not reused.
+CODE_VERSION = 1
+
+# The counters that say best how hot a function is, in order of preference
+# (see rankingCounter()).
+PREFERRED_COUNTERS = ('cycles', 'cpu-clock', 'task-clock')
+
+
+def rankingCounter(counters, absolute=()):
+    """
+    Return the counter of counters (names) that functions are best compared
+    by: the first of PREFERRED_COUNTERS, ignoring event modifiers such as
+    ':u', or else the first counter by name. Counters in absolute (see
+    ProfileImpl.getAbsoluteCounters()), such as latencies and IPC, are not
+    percentages and are never chosen. Return None if there is none left.
+    """
+    counters = set(counters) - set(absolute)
+    for preferred in PREFERRED_COUNTERS:
+        matches = [c for c in counters if c.split(':')[0] == preferred]
+        if matches:
+            return min(matches)
+    return min(counters) if counters else None
+
+
 class Profile(object):
     """Profile objects hold a performance profile.
 
@@ -33,7 +96,16 @@ class Profile(object):
                         ret = impl.deserialize(
                             fd,
                             objdump=os.getenv('CMAKE_OBJDUMP', 'objdump'),
-                            binaryCacheRoot=os.getenv('LNT_BINARY_CACHE_ROOT', ''))
+                            binaryCacheRoot=os.getenv('LNT_BINARY_CACHE_ROOT', ''),
+                            detail=os.getenv('LNT_PROFILE_DETAIL', 'instructions'),
+                            disassembler=os.getenv('LNT_DISASSEMBLER', 'objdump'),
+                            dataObjects=bool(
+                                os.getenv('LNT_PROFILE_DATA_OBJECTS')),
+                            normalize=bool(
+                                os.getenv('LNT_PROFILE_NORMALIZE')),
+                            kallsyms=os.getenv('LNT_KALLSYMS', ''),
+                            vmlinux=os.getenv('LNT_VMLINUX', ''),
+                            filters=_getPerfFilters())
                     else:
                         ret = impl.deserialize(fd)
                 if ret:
@@ -42,6 +114,59 @@ class Profile(object):
                     return None
         raise RuntimeError('No profile implementations could read this file!')
 
+    @staticmethod
+    def upgradeFile(f, filename):
+        """
+        Load a profile from file f and save it, upgraded to the latest
+        version, in filename. This is Profile.fromFile(f).upgrade().save(
+        filename=filename), except that Linux perf profiles are converted
+        one function at a time and so in bounded memory.
+
+        Returns False if f holds no profile.
+        """
+        perf = lnt.testing.profile.perf.LinuxPerfProfile
+        if perf.checkFile(f):
+            return perf.importToProfileV2(
+                f, filename,
+                objdump=os.getenv('CMAKE_OBJDUMP', 'objdump'),
+                binaryCacheRoot=os.getenv('LNT_BINARY_CACHE_ROOT', ''),
+                detail=os.getenv('LNT_PROFILE_DETAIL', 'instructions'),
+                disassembler=os.getenv('LNT_DISASSEMBLER', 'objdump'),
+                dataObjects=bool(os.getenv('LNT_PROFILE_DATA_OBJECTS')),
+                normalize=bool(os.getenv('LNT_PROFILE_NORMALIZE')),
+                kallsyms=os.getenv('LNT_KALLSYMS', ''),
+                vmlinux=os.getenv('LNT_VMLINUX', ''),
+                filters=_getPerfFilters())
+
+        p = Profile.fromFile(f)
+        if not p:
+            return False
+        p.upgrade().save(filename=filename)
+        return True
+
+    @staticmethod
+    def upgradeDirectory(directory, output, jobs=None):
+        """
+        Upgrade every profile under directory with upgradeFile(), to the same
+        relative path under output, 'jobs' files at a time in separate
+        processes (by default, one per CPU).
+
+        Returns a dict mapping the relative path of each file to True if it
+        was upgraded, False if it holds no profile, or the message of the
+        error it could not be upgraded because of.
+        """
+        paths = sorted(os.path.relpath(os.path.join(root, name), directory)
+                       for root, _, names in os.walk(directory)
+                       for name in names)
+        results = {}
+        with concurrent.futures.ProcessPoolExecutor(jobs) as pool:
+            futures = {pool.submit(_upgradeOne, os.path.join(directory, path),
+                                   os.path.join(output, path)): path
+                       for path in paths}
+            for future in concurrent.futures.as_completed(futures):
+                results[futures[future]] = future.result()
+        return results
+
     @staticmethod
     def fromRendered(s):
         """
@@ -65,6 +190,41 @@ class Profile(object):
                         return None
         raise RuntimeError('No profile implementations could read this file!')
 
+    @staticmethod
+    def ingestRendered(s, profileDir=None, prefix='', functions=False):
+        """
+        Save a profile produced with Profile.render() in a new file inside
+        profileDir, like saveFromRendered(), and return a tuple of the
+        filename written to and the profile's summary, as returned by
+        ProfileImpl.peek().
+
+        The profile is only decoded once, and the summary is read from the
+        file just written without deserializing the whole profile. If
+        profileDir is None, the profile is only kept until its summary has
+        been read and the filename returned is None.
+        """
+        if profileDir is None:
+            with tempfile.NamedTemporaryFile() as fd:
+                fd.write(base64.b64decode(s))
+                fd.flush()
+                return None, Profile.peekFile(fd.name, functions)
+
+        filename = Profile.saveFromRendered(s, profileDir=profileDir,
+                                            prefix=prefix)
+        return filename, Profile.peekFile(filename, functions)
+
+    @staticmethod
+    def peekFile(f, functions=False, detail=False):
+        """
+        Return the summary of the profile in file f, as returned by
+        ProfileImpl.peek(), without loading the whole profile.
+        """
+        for impl in lnt.testing.profile.IMPLEMENTATIONS.values():
+            if impl.checkFile(f):
+                with open(f, 'rb') as fd:
+                    return impl.peek(fd, functions, detail)
+        raise RuntimeError('No profile implementations could read this file!')
+
     @staticmethod
     def saveFromRendered(s, filename=None, profileDir=None, prefix=''):
         """
@@ -84,7 +244,8 @@ class Profile(object):
                                              suffix='.lntprof',
                                              dir=profileDir,
                                              delete=False)
-            tf.write(s)
+            with tf:
+                tf.write(s)
             return tf.name
 
         else:
@@ -153,11 +314,70 @@ class Profile(object):
     def getDisassemblyFormat(self):
         return self.impl.getDisassemblyFormat()
 
+    def getDetail(self):
+        return self.impl.getDetail()
+
     def getFunctions(self):
         return self.impl.getFunctions()
 
-    def getCodeForFunction(self, fname):
-        return self.impl.getCodeForFunction(fname)
+    def getDataObjects(self):
+        return self.impl.getDataObjects()
+
+    def getAbsoluteCounters(self):
+        return self.impl.getAbsoluteCounters()
+
+    def getUnchangedFunctions(self, other):
+        """
+        Return the names of the functions whose code is the same in this
+        profile and in profile 'other', going by the hashes of their
+        normalized code (see ProfileImpl.getFunctions()). Their
+        instruction-level data does not need to be compared. Functions
+        without a hash in either profile are never considered unchanged.
+        """
+        theirs = other.getFunctions()
+        return set(name for name, f in self.getFunctions().items()
+                   if f.get('hash') and
+                   theirs.get(name, {}).get('hash') == f['hash'])
+
+    def getCodeForFunction(self, fname, objdump=None, binaryCacheRoot=None):
+        """
+        Like ProfileImpl.getCodeForFunction, but for profiles whose
+        disassembly was deferred at import time (detail 'addresses') the
+        text is produced here, from the binary the function was sampled in.
+        objdump and binaryCacheRoot default to the CMAKE_OBJDUMP and
+        LNT_BINARY_CACHE_ROOT environment variables, and LNT_DISASSEMBLER
+        selects the disassembler as for perf.disassemble(). Only binaries
+        under binaryCacheRoot are disassembled; without one, the code has no
+        text.
+        """
+        if self.impl.getDetail() != 'addresses':
+            return self.impl.getCodeForFunction(fname)
+        if objdump is None:
+            objdump = os.getenv('CMAKE_OBJDUMP', 'objdump')
+        if binaryCacheRoot is None:
+            binaryCacheRoot = os.getenv('LNT_BINARY_CACHE_ROOT', '')
+        return self._getDeferredCodeForFunction(fname, objdump,
+                                                binaryCacheRoot)
+
+    def _getDeferredCodeForFunction(self, fname, objdump, binaryCacheRoot):
+        rows = list(self.impl.getCodeForFunction(fname))
+        info = self.impl.getBinaryInfo(fname)
+        code = []
+        if info and binaryCacheRoot:
+            code = lnt.testing.profile.perf.disassemble(
+                info['binary'], info['start'], info['end'], objdump,
+                binaryCacheRoot, os.getenv('LNT_DISASSEMBLER', 'objdump'),
+                info['build-id'])
+        if not code:
+            # The binary is not available; fall back to the sampled
+            # addresses without any text.
+            for row in rows:
+                yield row
+            return
+
+        counters = {address: c for c, address, text in rows}
+        for address, text in code:
+            yield (counters.get(address, {}), address, text)
 
 
 class ProfileImpl(object):
@@ -187,6 +407,26 @@ class ProfileImpl(object):
         """
         raise NotImplementedError("Abstract class")
 
+    @classmethod
+    def peek(cls, fobj, functions=False, detail=False):
+        """
+        Return a summary of the profile serialized in 'fobj': a dict with its
+        top-level counters (as returned by getTopLevelCounters()) in
+        ``counters``, if 'functions' is True its functions (as returned by
+        getFunctions()) in ``functions``, and if 'detail' is True its level
+        of detail (as returned by getDetail()) in ``detail``.
+
+        This deserializes the whole profile by default; implementations
+        whose index can be read on its own should override it.
+        """
+        p = cls.deserialize(fobj)
+        summary = {'counters': p.getTopLevelCounters() if p else {}}
+        if functions:
+            summary['functions'] = p.getFunctions() if p else {}
+        if detail:
+            summary['detail'] = p.getDetail() if p else 'instructions'
+        return summary
+
     def serialize(self, fname=None):
         """
         Serializes the profile to the given filename (base). If fname is None,
@@ -218,6 +458,34 @@ class ProfileImpl(object):
         """
         raise NotImplementedError("Abstract class")
 
+    def getDetail(self):
+        """
+        Return the level of detail held by this profile. Possible values are:
+
+        * ``instructions`` - Per-instruction counters and disassembly are
+                             available through getCodeForFunction().
+        * ``addresses``    - Per-instruction counters are available but the
+                             disassembly text is empty; it can be recovered
+                             from the binary described by getBinaryInfo().
+        * ``functions``    - Only per-function counters were imported;
+                             getCodeForFunction() yields nothing.
+        """
+        return 'instructions'
+
+    def getBinaryInfo(self, fname):
+        """
+        For profiles with detail ``addresses``, return a dict describing
+        where the code for 'fname' lives, so it can be disassembled on
+        demand::
+
+          {'binary': '/usr/bin/foo', 'build-id': '52d68e9c...',
+           'start': 0x4006c8, 'end': 0x400700}
+
+        'build-id' is empty if the profiler did not record one. Returns None
+        if the information is not available.
+        """
+        return None
+
     def getFunctions(self):
         """
         Return a dict containing function names to information about that
@@ -228,6 +496,9 @@ class ProfileImpl(object):
         * ``counters`` - counter values for the function.
         * ``length`` - number of times to call getCodeForFunction to obtain all
           instructions.
+        * ``hash`` - only if the profile was imported with normalization: a
+          hash of the function's normalized code. It is the same for
+          functions with the same code, wherever they were loaded.
 
         The dict should *not* contain disassembly / function contents.
         The counter values must be percentages, not absolute numbers.
@@ -242,6 +513,31 @@ class ProfileImpl(object):
         """
         raise NotImplementedError("Abstract class")
 
+    def getDataObjects(self):
+        """
+        Return a dict of the data objects that sampled memory accesses went
+        to, if the profile was imported with data objects, or an empty dict.
+        Data objects are the ``STT_OBJECT`` symbols of binaries, or pages of
+        memory (``[page 0x7f0012345000]``) for heap and other anonymous
+        memory.
+
+        Each data object has ``counters``, the percentages of the profile
+        total that were sampled in it, and ``levels``, the percentages of its
+        samples that were served by each level of the memory hierarchy::
+
+          {'table': {'counters': {'cycles': 12.0},
+                     'levels': {'L1': 75.0, 'L3-miss': 25.0}}}
+        """
+        return {}
+
+    def getAbsoluteCounters(self):
+        """
+        Return the names of the counters whose function and instruction
+        values are not percentages, but absolute values: latencies and
+        metrics derived from other counters, such as ``IPC``.
+        """
+        return []
+
     def getCodeForFunction(self, fname):
         """
         Return a *generator* which will return, for every invocation, a
@@ -17,15 +17,29 @@ The ``self.data`` member has this format::
   {
    counters: {'cycles': 12345.0, 'branch-misses': 200.0}, # absolute values.
    disassembly-format: 'raw',
+   detail: 'instructions', # or 'functions' if there is no 'data', or
+                           # 'addresses' if the text in 'data' is empty.
+   # Only if some counters are not percentages - see
+   # ProfileImpl.getAbsoluteCounters().
+   absolute-counters: ['IPC', 'latency-mean'],
    functions: {
      name: {
        counters: {'cycles': 45.0, ...}, # Note counters are now percentages.
+       # Only for detail 'addresses' - see ProfileImpl.getBinaryInfo().
+       binary: '/usr/bin/foo', build-id: '52d68e9c...',
+       start: 463464, end: 463500,
+       # Only for normalized profiles - see ProfileImpl.getFunctions().
+       hash: '9f4c2e0a17d3b6e5',
        data: [
          [463464, {'cycles': 23.0, ...}, '\tadd r0, r0, r1'}],
          ...
        ]
      }
-    }
+    },
+   # Only if data objects were collected - see ProfileImpl.getDataObjects().
+   data-objects: {
+     name: {counters: {'cycles': 12.0}, levels: {'L1': 80.0, 'RAM': 20.0}}
+   }
   }
     """
 
@@ -73,12 +87,29 @@ The ``self.data`` member has this format::
             return self.data['disassembly-format']
         return 'raw'
 
+    def getDetail(self):
+        return self.data.get('detail', 'instructions')
+
+    def getDataObjects(self):
+        return self.data.get('data-objects', {})
+
+    def getAbsoluteCounters(self):
+        return self.data.get('absolute-counters', [])
+
+    def getBinaryInfo(self, fname):
+        f = self.data['functions'][fname]
+        if 'binary' not in f:
+            return None
+        return {k: f[k] for k in ('binary', 'build-id', 'start', 'end')}
+
     def getFunctions(self):
         d = {}
         for fn in self.data['functions']:
             f = self.data['functions'][fn]
             d[fn] = dict(counters=f.get('counters', {}),
                          length=len(f.get('data', [])))
+            if 'hash' in f:
+                d[fn]['hash'] = f['hash']
         return d
 
     def getCodeForFunction(self, fname):
@@ -3,7 +3,14 @@ import bz2
 import copy
 import io
 import os
+import shutil
 import struct
+import tempfile
+
+try:
+    from . import cPerf  # type: ignore  # mypy cannot process Cython modules
+except Exception:
+    cPerf = None
 
 """
 ProfileV2 is a profile data representation designed to keep the
@@ -20,7 +27,14 @@ The format:
 
 The sections are:
   Header
-      Contains the disassembly format.
+      Contains the disassembly format, optionally followed by the level of
+      detail if the profile does not hold full disassembly. Profiles with
+      deferred disassembly (detail 'addresses') then list the binaries they
+      were sampled from, and the binary and address range of every function.
+      Profiles with data objects always store the level of detail, and
+      continue with the data objects and their counters and memory levels.
+      Normalized profiles always store both, and end with the hash of the
+      code of each function.
 
   Counter name pool
       Contains a list of strings for the counter names ("cycles" etc).
@@ -76,6 +90,13 @@ The sections are:
 
   Not only this, but for the simple task of enumerating the functions in a
   profile we do not need to do any decompression at all.
+
+  Profiles that are too large to hold in memory can be written one function
+  at a time with ProfileV2Writer.
+
+  If cPerf was built with libbz2, ProfileV2.serialize() has
+  cPerf.serializeProfileV2() encode the sections and compress the
+  compressed ones concurrently. The file is the same either way.
 """
 
 ##############################################################################
@@ -229,14 +250,106 @@ class MaybePooledSection(Section):
 
 
 class Header(Section):
+    def __init__(self):
+        self.detail = 'instructions'
+        self.binary_info = {}
+        self.data_objects = {}
+        self.function_hashes = {}
+        self.absolute_counters = []
+
     def serialize(self, fobj):
         writeString(fobj, self.disassembly_format)
+        # Only written when non-default, so that older readers (and older
+        # files) are unaffected.
+        if self.detail != 'instructions' or self.data_objects or \
+                self.function_hashes or self.absolute_counters:
+            writeString(fobj, self.detail)
+        if self.detail == 'addresses':
+            binaries = sorted(set((i['binary'], i['build-id'])
+                                  for i in self.binary_info.values()))
+            binary_idx = {b: n for n, b in enumerate(binaries)}
+            writeNum(fobj, len(binaries))
+            for binary, build_id in binaries:
+                writeString(fobj, binary)
+                writeString(fobj, build_id)
+            writeNum(fobj, len(self.binary_info))
+            for fname, i in sorted(self.binary_info.items()):
+                writeString(fobj, fname)
+                writeNum(fobj, binary_idx[(i['binary'], i['build-id'])])
+                writeNum(fobj, i['start'])
+                writeNum(fobj, i['end'])
+        if self.data_objects or self.function_hashes or \
+                self.absolute_counters:
+            writeNum(fobj, len(self.data_objects))
+            for name, o in sorted(self.data_objects.items()):
+                writeString(fobj, name)
+                for k in ('counters', 'levels'):
+                    writeNum(fobj, len(o[k]))
+                    for key, value in sorted(o[k].items()):
+                        writeString(fobj, key)
+                        writeFloat(fobj, value)
+        if self.function_hashes or self.absolute_counters:
+            writeNum(fobj, len(self.function_hashes))
+            for fname, h in sorted(self.function_hashes.items()):
+                writeString(fobj, fname)
+                writeString(fobj, h)
+        if self.absolute_counters:
+            writeNum(fobj, len(self.absolute_counters))
+            for name in self.absolute_counters:
+                writeString(fobj, name)
 
     def deserialize(self, fobj):
+        end = self.start + self.offset + self.size
         self.disassembly_format = readString(fobj)
+        if fobj.tell() < end:
+            self.detail = readString(fobj)
+        self.binary_info = {}
+        if self.detail == 'addresses':
+            binaries = [(readString(fobj), readString(fobj))
+                        for i in range(readNum(fobj))]
+            for i in range(readNum(fobj)):
+                fname = readString(fobj)
+                binary, build_id = binaries[readNum(fobj)]
+                start = readNum(fobj)
+                fn_end = readNum(fobj)
+                self.binary_info[fname] = {'binary': binary,
+                                           'build-id': build_id,
+                                           'start': start, 'end': fn_end}
+        self.data_objects = {}
+        if fobj.tell() < end:
+            for i in range(readNum(fobj)):
+                name = readString(fobj)
+                o = {}
+                for k in ('counters', 'levels'):
+                    o[k] = {}
+                    for j in range(readNum(fobj)):
+                        key = readString(fobj)
+                        o[k][key] = readFloat(fobj)
+                self.data_objects[name] = o
+        self.function_hashes = {}
+        if fobj.tell() < end:
+            for i in range(readNum(fobj)):
+                fname = readString(fobj)
+                self.function_hashes[fname] = readString(fobj)
+        self.absolute_counters = []
+        if fobj.tell() < end:
+            self.absolute_counters = [readString(fobj)
+                                      for i in range(readNum(fobj))]
 
     def upgrade(self, impl):
         self.disassembly_format = impl.getDisassemblyFormat()
+        self.detail = impl.getDetail()
+        self.binary_info = {}
+        if self.detail == 'addresses':
+            for fname in impl.getFunctions():
+                info = impl.getBinaryInfo(fname)
+                if info:
+                    self.binary_info[fname] = info
+        self.data_objects = impl.getDataObjects()
+        self.function_hashes = {fname: f['hash']
+                                for fname, f in impl.getFunctions().items()
+                                if 'hash' in f}
+        self.absolute_counters = sorted(impl.getAbsoluteCounters())
 
     def __repr__(self):
         pass
@@ -291,7 +404,7 @@ class TopLevelCounters(Section):
             self.counters[self.counter_name_pool.idx_to_name[k]] = v
 
     def upgrade(self, impl):
-        self.counters = impl.data['counters'].copy()
+        self.counters = impl.getTopLevelCounters().copy()
 
     def copy(self, cnp):
         new = copy.copy(self)
@@ -532,6 +645,11 @@ class Functions(Section):
         self.impl = impl
         self.functions = self.impl.getFunctions()
 
+    def setHashes(self, hashes):
+        for fname, h in hashes.items():
+            if fname in self.functions:
+                self.functions[fname]['hash'] = h
+
     def getCodeForFunction(self, fname):
         f = self.functions[fname]
         counter_gen = self.line_counters \
@@ -553,14 +671,7 @@ class Functions(Section):
 
 class ProfileV2(ProfileImpl):
     @staticmethod
-    def checkFile(fn):
-        # The first number is the version (2); ULEB encoded this is simply
-        # 0x02.
-        with open(fn, 'rb') as f:
-            return f.read(1) == b'\x02'
-
-    @staticmethod
-    def deserialize(fobj):
+    def _create():
         p = ProfileV2()
 
         p.h = Header()
@@ -573,6 +684,18 @@ class ProfileV2(ProfileImpl):
         p.f = Functions(p.cnp, p.lc, p.la, p.lt, p)
 
         p.sections = [p.h, p.cnp, p.tlc, p.lc, p.la, p.lt, p.tp, p.f]
+        return p
+
+    @staticmethod
+    def checkFile(fn):
+        # The first number is the version (2); ULEB encoded this is simply
+        # 0x02.
+        with open(fn, 'rb') as f:
+            return f.read(1) == b'\x02'
+
+    @staticmethod
+    def deserialize(fobj):
+        p = ProfileV2._create()
 
         version = readNum(fobj)
         assert version == 2
@@ -583,15 +706,66 @@ class ProfileV2(ProfileImpl):
             section.setStart(fobj.tell())
         for section in p.sections:
             section.read(fobj)
+        p.f.setHashes(p.h.function_hashes)
 
         return p
 
+    @staticmethod
+    def peek(fobj, functions=False, detail=False):
+        # The counter name pool, the top-level counters, the header and the
+        # function index are not compressed, so only they are read.
+        p = ProfileV2._create()
+
+        version = readNum(fobj)
+        assert version == 2
+
+        for section in p.sections:
+            section.readHeader(fobj)
+        for section in p.sections:
+            section.setStart(fobj.tell())
+        p.cnp.read(fobj)
+        p.tlc.read(fobj)
+
+        summary = {'counters': p.getTopLevelCounters()}
+        if functions or detail:
+            p.h.read(fobj)
+        if detail:
+            summary['detail'] = p.h.detail
+        if functions:
+            p.f.read(fobj)
+            p.f.setHashes(p.h.function_hashes)
+            summary['functions'] = p.getFunctions()
+            if p.h.absolute_counters:
+                summary['absolute-counters'] = p.h.absolute_counters
+        return summary
+
     def serialize(self, fname=None):
-        # If we're not writing to a file, emulate a file object instead.
-        if fname is None:
-            fobj = io.BytesIO()
+        if getattr(cPerf, 'serializeProfileV2', None) and \
+                not self.tp.pool_fname:
+            data = self._serializeNative()
         else:
-            fobj = open(fname, 'wb')
+            data = self._serializePython()
+        if fname is None:
+            return data
+        with open(fname, 'wb') as fobj:
+            fobj.write(data)
+
+    def _serializeNative(self):
+        header = io.BytesIO()
+        self.h.copy().write(header)
+        cnp = self.cnp.idx_to_name
+        # The text pool is added to as it would be by a copy of it, from
+        # where its buffer is.
+        return cPerf.serializeProfileV2(
+            header.getvalue(), [cnp[i] for i in range(len(cnp))],
+            self.tlc.counters, self.f.functions,
+            self.lc.impl.getCodeForFunction,
+            textPool=self.tp.data.getvalue(),
+            textPoolPosition=self.tp.data.tell(),
+            textPoolOffsets=self.tp.offsets)
+
+    def _serializePython(self):
+        fobj = io.BytesIO()
 
         # Take a copy of all sections. While writing we may change
         # offsets / indices, and we need to ensure we can modify our
@@ -622,26 +796,13 @@ class ProfileV2(ProfileImpl):
         for section in sections:
             section.writeHeader(fobj, offsets[section], sizes[section])
         fobj.write(tmpio.getvalue())
-
-        if fname is None:
-            return fobj.getvalue()
+        return fobj.getvalue()
 
     @staticmethod
     def upgrade(v1impl):
         assert v1impl.getVersion() == 1
 
-        p = ProfileV2()
-
-        p.h = Header()
-        p.cnp = CounterNamePool()
-        p.tlc = TopLevelCounters(p.cnp)
-        p.lc = LineCounters(p)
-        p.la = LineAddresses(p)
-        p.tp = TextPool()
-        p.lt = LineText(p.tp, p)
-        p.f = Functions(p.cnp, p.lc, p.la, p.lt, p)
-
-        p.sections = [p.h, p.cnp, p.tlc, p.lc, p.la, p.lt, p.tp, p.f]
+        p = ProfileV2._create()
 
         for section in p.sections:
             section.upgrade(v1impl)
@@ -651,6 +812,21 @@ class ProfileV2(ProfileImpl):
     def getVersion(self):
         return 2
 
+    def getDisassemblyFormat(self):
+        return self.h.disassembly_format
+
+    def getDetail(self):
+        return self.h.detail
+
+    def getBinaryInfo(self, fname):
+        return self.h.binary_info.get(fname)
+
+    def getDataObjects(self):
+        return self.h.data_objects
+
+    def getAbsoluteCounters(self):
+        return self.h.absolute_counters
+
     def getFunctions(self):
         return self.f.functions
 
@@ -659,3 +835,158 @@ class ProfileV2(ProfileImpl):
 
     def getCodeForFunction(self, fname):
         return self.f.getCodeForFunction(fname)
+
+
+class _SpooledCompressor(object):
+    """
+    A write-only stream that BZ2 compresses what is written to it into a
+    temporary file. tell() is the uncompressed position, which is what
+    function offsets into compressed sections refer to.
+    """
+    def __init__(self):
+        self.compressor = bz2.BZ2Compressor()
+        self.buffer = io.BytesIO()
+        self.file = tempfile.SpooledTemporaryFile(max_size=1 << 20)
+        self.pos = 0
+
+    def write(self, data):
+        self.buffer.write(data)
+        self.pos += len(data)
+        if self.buffer.tell() >= 1 << 16:
+            self._flushBuffer()
+
+    def tell(self):
+        return self.pos
+
+    def _flushBuffer(self):
+        self.file.write(self.compressor.compress(self.buffer.getvalue()))
+        self.buffer = io.BytesIO()
+
+    def finish(self):
+        """
+        Finish compression and return the temporary file, rewound.
+        """
+        self._flushBuffer()
+        self.file.write(self.compressor.flush())
+        self.file.seek(0)
+        return self.file
+
+
+class ProfileV2Writer(object):
+    """
+    Writes a ProfileV2 file one function at a time, so that profiles of any
+    size can be written without holding all of their functions in memory
+    (see perf.importToProfileV2()).
+
+    The per-instruction sections are compressed as functions are added and
+    spilled to temporary files; only the text pool and the per-function
+    binary information are kept in memory. As functions refer to counters by
+    index, every counter name they use must be given up front.
+    """
+    def __init__(self, counters, counter_names, disassembly_format='raw',
+                 detail='instructions', data_objects=None):
+        self.h = Header()
+        self.h.disassembly_format = disassembly_format
+        self.h.detail = detail
+        self.h.data_objects = data_objects or {}
+
+        names = sorted(set(counter_names) | set(counters))
+        self.cnp = CounterNamePool()
+        self.cnp.idx_to_name = {k: v for k, v in enumerate(names)}
+        self.cnp.name_to_idx = {v: k for k, v in enumerate(names)}
+        self.tlc = TopLevelCounters(self.cnp)
+        self.tlc.counters = counters
+        self.tp = TextPool()
+
+        self.lc = _SpooledCompressor()
+        self.la = _SpooledCompressor()
+        self.lt = _SpooledCompressor()
+        self.functions = tempfile.SpooledTemporaryFile(max_size=1 << 20)
+        self.num_functions = 0
+
+    def addFunction(self, name, counters, code, binary_info=None, hash=None):
+        """
+        Add function 'name', with counters as in ProfileImpl.getFunctions()
+        and code an iterable of (counters, address, text) tuples as returned
+        by ProfileImpl.getCodeForFunction(). binary_info is as returned by
+        ProfileImpl.getBinaryInfo(), and hash is the function's 'hash' in
+        ProfileImpl.getFunctions(), if it has one.
+        """
+        lc_offset = self.lc.tell()
+        la_offset = self.la.tell()
+        lt_offset = self.lt.tell()
+
+        # This mirrors LineCounters, LineAddresses and LineText.serialize().
+        all_counters = sorted(counters.keys())
+        prev_address = 0
+        length = 0
+        for line_counters, address, text in code:
+            for k in all_counters:
+                writeFloat(self.lc, line_counters.get(k, 0))
+            writeNum(self.la, max(0, address - prev_address))
+            prev_address = address
+            writeNum(self.lt, self.tp.getOrCreate(text))
+            length += 1
+        writeNum(self.lt, 0)  # Write sequence terminator
+
+        # And this Functions.serialize().
+        writeString(self.functions, name)
+        writeNum(self.functions, length)
+        writeNum(self.functions, lc_offset)
+        writeNum(self.functions, la_offset)
+        writeNum(self.functions, lt_offset)
+        writeNum(self.functions, len(counters))
+        for k, v in sorted(counters.items()):
+            writeNum(self.functions, self.cnp.name_to_idx[k])
+            writeFloat(self.functions, v)
+        self.num_functions += 1
+
+        if binary_info and self.h.detail == 'addresses':
+            self.h.binary_info[name] = binary_info
+        if hash:
+            self.h.function_hashes[name] = hash
+
+    def write(self, fname=None):
+        """
+        Write the profile to fname, or return it as bytes if fname is None.
+        No functions can be added afterwards.
+        """
+        def serialized(section):
+            _io = io.BytesIO()
+            section.write(_io)
+            _io.seek(0)
+            return _io
+
+        functions = tempfile.SpooledTemporaryFile(max_size=1 << 20)
+        writeNum(functions, self.num_functions)
+        self.functions.seek(0)
+        shutil.copyfileobj(self.functions, functions)
+        functions.seek(0)
+
+        # In the order of ProfileV2.sections.
+        sections = [(self.h, serialized(self.h)),
+                    (self.cnp, serialized(self.cnp)),
+                    (self.tlc, serialized(self.tlc)),
+                    (Section(), self.lc.finish()),
+                    (Section(), self.la.finish()),
+                    (Section(), self.lt.finish()),
+                    (self.tp, serialized(self.tp)),
+                    (Section(), functions)]
+
+        fobj = io.BytesIO() if fname is None else open(fname, 'wb')
+        writeNum(fobj, 2)  # Version
+        offset = 0
+        for section, body in sections:
+            body.seek(0, os.SEEK_END)
+            size = body.tell()
+            body.seek(0)
+            section.writeHeader(fobj, offset, size)
+            offset += size
+        for section, body in sections:
+            shutil.copyfileobj(body, fobj)
+            body.close()
+        self.functions.close()
+
+        if fname is None:
+            return fobj.getvalue()
+        fobj.close()
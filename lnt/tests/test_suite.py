@@ -1,4 +1,5 @@
 """LLVM test-suite"""
+import base64
 import subprocess
 import tempfile
 import json
@@ -104,12 +105,13 @@ def _importProfile(name_filename):
         logger.warning('Profile %s does not exist' % filename)
         return None
 
-    pf = lnt.testing.profile.profile.Profile.fromFile(filename)
-    if not pf:
-        return None
-
-    pf.upgrade()
-    profilefile = pf.render()
+    # Convert the profile through a file rather than in memory, as profiles
+    # can be very large.
+    with tempfile.NamedTemporaryFile(suffix='.lntprof') as tf:
+        if not lnt.testing.profile.profile.Profile.upgradeFile(filename,
+                                                               tf.name):
+            return None
+        profilefile = base64.b64encode(tf.read()).decode('ascii')
     return lnt.testing.TestSamples(name + '.profile',
                                    [profilefile],
                                    {},
@@ -146,6 +146,14 @@ def import_and_report(config, db_name, db, session, file, format, ts_name,
     result['run_id'] = run.id
     session.commit()
 
+    # Make the functions of the profiles submitted searchable. The run is
+    # already committed, so this must not fail the submission. The index is
+    # merged later, by a deferred rule.
+    try:
+        ts.indexProfiles(session, run.id)
+    except Exception:
+        logger.exception("Could not index the profiles of run %d", run.id)
+
     if ignore_regressions:
         logger.info("Regenerating regressions skipped")
     else:
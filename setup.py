@@ -1,5 +1,6 @@
 import lnt
 import os
+import subprocess
 from sys import platform as _platform
 import sys
 from setuptools import setup, find_packages, Extension
@@ -20,9 +21,76 @@ if _platform == "darwin":
 # to work (for scripts, etc.)
 os.chdir(os.path.dirname(os.path.abspath(__file__)))
 
+
+def llvm_disassembler_options():
+    """
+    Find LLVM's C disassembler API with llvm-config (or $LLVM_CONFIG), so that
+    cPerf can disassemble in-process instead of running objdump. Returns the
+    extra Extension arguments, or nothing if LLVM is not available. Set
+    LLVM_CONFIG to an empty string to build without it.
+    """
+    llvm_config = os.environ.get('LLVM_CONFIG', 'llvm-config')
+    if not llvm_config:
+        return {}
+    try:
+        def query(*args):
+            out = subprocess.check_output([llvm_config] + list(args),
+                                          stderr=subprocess.DEVNULL)
+            return out.decode().split()
+        include_dir = query('--includedir')[0]
+        lib_dir = query('--libdir')[0]
+        libs = [lib[2:] for lib in query('--libs') if lib.startswith('-l')]
+    except (OSError, IndexError, subprocess.CalledProcessError):
+        return {}
+    if not os.path.exists(os.path.join(include_dir, 'llvm-c',
+                                       'Disassembler.h')):
+        return {}
+    return dict(define_macros=[('HAVE_LLVM_DISASSEMBLER', '1')],
+                include_dirs=[include_dir],
+                library_dirs=[lib_dir],
+                runtime_library_dirs=[lib_dir],
+                libraries=libs)
+
+
+def bzip2_options():
+    """
+    Find libbz2, so that cPerf can write ProfileV2 files natively (see
+    cPerf.serializeProfileV2). Returns the extra Extension arguments, or
+    nothing if it is not available; profiles are then written in Python.
+    """
+    # distutils is gone from Python 3.12; setuptools ships its own copy.
+    try:
+        from setuptools._distutils.ccompiler import new_compiler
+        from setuptools._distutils.sysconfig import customize_compiler
+    except ImportError:
+        from distutils.ccompiler import new_compiler
+        from distutils.sysconfig import customize_compiler
+    compiler = new_compiler()
+    customize_compiler(compiler)
+    # has_function() returns False if the test program fails to compile or
+    # link.
+    if not compiler.has_function('BZ2_bzlibVersion', includes=['bzlib.h'],
+                                 libraries=['bz2']):
+        print("warning: libbz2 not found, cPerf will not write ProfileV2 "
+              "files natively", file=sys.stderr)
+        return {}
+    return dict(define_macros=[('HAVE_BZLIB', '1')], libraries=['bz2'])
+
+
+def extension_options(*options):
+    """Merge the Extension arguments of each of options."""
+    merged = {}
+    for option in options:
+        for key, value in option.items():
+            merged.setdefault(key, []).extend(value)
+    return merged
+
+
 cPerf = Extension('lnt.testing.profile.cPerf',
                   sources=['lnt/testing/profile/cPerf.cpp'],
-                  extra_compile_args=['-std=c++11'] + cflags)
+                  extra_compile_args=['-std=c++11'] + cflags,
+                  **extension_options(llvm_disassembler_options(),
+                                      bzip2_options()))
 
 if "--server" in sys.argv:
     sys.argv.remove("--server")
@@ -2,3 +2,11 @@
 # RUN: lnt convert --to=json < %S/Inputs/test.json | FileCheck %s
 
 # CHECK: {"a": 1}
+
+# RUN: lnt convert --to=json %S/Inputs/report.json \
+# RUN:     | FileCheck --check-prefix=REPORT %s
+
+# REPORT: {"format_version": "2", "machine": {"name": "m"},
+# REPORT-SAME: "run": {"start_time": "2017-05-01 10:00:00"},
+# REPORT-SAME: "tests": [{"name": "t1", "execution_time": [0.5, 0.25]},
+# REPORT-SAME: {"name": "t2", "execution_time": 12}]}
@@ -14,3 +14,15 @@
 # RUN: rm -rf %t/non_existing_output.lnt
 # RUN: lnt profile upgrade %S/Inputs/test.lntprof %t/non_existing_output.lnt
 # RUN: cat %t/non_existing_output.lnt
+
+# A directory of profiles is upgraded file by file, keeping its layout. Files
+# that are not profiles are skipped.
+# RUN: rm -rf %t/profiles %t/upgraded
+# RUN: mkdir -p %t/profiles/sub
+# RUN: cp %S/Inputs/test.lntprof %t/profiles/a.lntprof
+# RUN: cp %S/Inputs/test.lntprof %t/profiles/sub/b.lntprof
+# RUN: echo hello > %t/profiles/README
+# RUN: lnt profile upgrade --jobs 2 %t/profiles %t/upgraded | FileCheck --check-prefix=CHECK-UPGRADEDIR %s
+# CHECK-UPGRADEDIR: upgraded 2 profiles, skipped 1 other files
+# RUN: lnt profile getVersion %t/upgraded/sub/b.lntprof | FileCheck --check-prefix=CHECK-UPGRADED %s
+# CHECK-UPGRADED: 2
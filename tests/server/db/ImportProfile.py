@@ -10,9 +10,22 @@
 # RUN: ls %t.install/data/profiles
 # RUN: python %s %t.install
 
+import os
 import sys
 import glob
+from lnt.server.db.profileindex import ProfileIndex
+from lnt.server.db.profiletimeseries import ProfileTimeSeries
 from lnt.testing.profile.profilev1impl import ProfileV1
 
 profile = glob.glob('%s/data/profiles/*.lntprof' % sys.argv[1])[0]
 assert ProfileV1.checkFile(profile)
+
+# The profile's functions were added to the profile index.
+index = ProfileIndex(os.path.join(sys.argv[1], 'data/profiles/_index/lnt.db/nts'))
+assert index.search('fn1', 'cycles', 40, 50) == {'cycles': {1: 45.0}}
+assert index.search('fn1', 'cycles', 50) == {}
+
+timeseries = ProfileTimeSeries(
+    os.path.join(sys.argv[1], 'data/profiles/_timeseries/lnt.db/nts'))
+assert timeseries.functions(1, 1) == ['fn1']
+assert timeseries.get(1, 1, 'fn1', 'cycles') == [(1, 45.0)]
@@ -0,0 +1,85 @@
+# Check the attribution of changes to the functions of profiles.
+#
+# RUN: python %s
+
+import time
+import unittest
+from unittest import mock
+
+from lnt.server.db.profileattribution import attribute, \
+    attribute_field_change
+
+
+def _functions(**cycles):
+    return {name: {'counters': {'cycles': value, 'branch-misses': 50.0}}
+            for name, value in cycles.items()}
+
+
+class ProfileAttributionTest(unittest.TestCase):
+    def test_attribute(self):
+        before = _functions(main=50.0, foo=50.0)
+        after = _functions(main=25.0, foo=50.0, bar=25.0)
+        # The test got twice as slow: foo doubled, bar is new, main did not
+        # change and is left out.
+        result = attribute(before, after, 10.0, 20.0)
+        self.assertEqual(result['counter'], 'cycles')
+        self.assertTrue(result['complete'])
+        self.assertEqual(result['functions'], [
+            {'function': 'bar', 'before': 0.0, 'after': 25.0, 'delta': 5.0},
+            {'function': 'foo', 'before': 50.0, 'after': 50.0, 'delta': 5.0},
+        ])
+
+        result = attribute(before, _functions(main=10.0, foo=90.0),
+                           10.0, 20.0, top=1)
+        self.assertEqual(result['functions'], [
+            {'function': 'foo', 'before': 50.0, 'after': 90.0,
+             'delta': 13.0}])
+
+    def test_counter(self):
+        before = {'main': {'counters': {'instructions': 100.0}}}
+        after = {'main': {'counters': {'instructions': 100.0}}}
+        result = attribute(before, after, 1.0, 2.0)
+        self.assertEqual(result['counter'], 'instructions')
+        self.assertEqual(result['functions'][0]['delta'], 1.0)
+        self.assertEqual(attribute({}, {}, 1.0, 2.0),
+                         {'counter': None, 'complete': True, 'functions': []})
+
+    def test_counter_choice(self):
+        # cycles with a modifier is still preferred, absolute counters are
+        # never compared, and neither are counters only one profile has.
+        before = {'main': {'counters': {'cycles:u': 50.0, 'IPC': 1.5,
+                                        'latency-mean': 3.0}}}
+        after = {'main': {'counters': {'cycles:u': 100.0, 'IPC': 2.0,
+                                       'latency-mean': 9.0}}}
+        self.assertEqual(attribute(before, after, 1.0, 2.0,
+                                   absolute=['IPC', 'latency-mean'])['counter'],
+                         'cycles:u')
+        del before['main']['counters']['cycles:u']
+        self.assertEqual(attribute(before, after, 1.0, 2.0,
+                                   absolute=['IPC', 'latency-mean']),
+                         {'counter': None, 'complete': True, 'functions': []})
+        before['main']['counters']['branch-misses'] = 10.0
+        after['main']['counters']['branch-misses'] = 20.0
+        self.assertEqual(attribute(before, after, 1.0, 2.0,
+                                   absolute=['IPC', 'latency-mean'])['counter'],
+                         'branch-misses')
+
+    def test_deadline(self):
+        result = attribute(_functions(main=100.0), _functions(main=100.0),
+                           1.0, 2.0, deadline=time.time() - 1)
+        self.assertFalse(result['complete'])
+        self.assertEqual(result['functions'], [])
+
+    def test_field(self):
+        # Only changes of the execution time are explained by profiles; the
+        # database is not even looked at for the others.
+        for name in ('compile_time', 'code_size', 'hash', 'mem_bytes'):
+            fc = mock.Mock()
+            fc.field.name = name
+            fc.attribution = None
+            self.assertFalse(attribute_field_change(None, None, fc, 1.0))
+            self.assertIsNone(fc.attribution)
+
+
+if __name__ == '__main__':
+    unittest.main(argv=[__file__])
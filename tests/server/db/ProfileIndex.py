@@ -0,0 +1,94 @@
+# Check the on-disk index of profile functions.
+#
+# RUN: python %s
+
+import os
+import shutil
+import tempfile
+import unittest
+
+from lnt.server.db import profileindex
+from lnt.server.db.profileindex import ProfileIndex
+
+
+class ProfileIndexTest(unittest.TestCase):
+    def setUp(self):
+        self.path = tempfile.mkdtemp()
+
+    def tearDown(self):
+        shutil.rmtree(self.path)
+
+    def _functions(self, i):
+        return {
+            'main': {'counters': {'cycles': float(i), 'branch-misses': 1.5}},
+            'llvm::DenseMap::grow': {'counters': {'cycles': 100.0 - i}},
+        }
+
+    def test_search(self):
+        index = ProfileIndex(self.path)
+        self.assertEqual(index.search('main'), {})
+
+        index.add([(1, self._functions(10)), (2, self._functions(20))])
+        index.add([(3, self._functions(30))])
+        self.assertEqual(index.search('main', 'cycles', 15, 30),
+                         {'cycles': {2: 20.0, 3: 30.0}})
+        self.assertEqual(index.search('main', 'cycles', 10.5),
+                         {'cycles': {2: 20.0, 3: 30.0}})
+        self.assertEqual(index.search('main', max_percentage=10),
+                         {'cycles': {1: 10.0},
+                          'branch-misses': {1: 1.5, 2: 1.5, 3: 1.5}})
+        self.assertEqual(index.search('llvm::DenseMap::grow', 'cycles', 75),
+                         {'cycles': {1: 90.0, 2: 80.0}})
+        self.assertEqual(index.search('foo'), {})
+
+        # The index can be read by another instance.
+        self.assertEqual(ProfileIndex(self.path).search('main', 'cycles'),
+                         {'cycles': {1: 10.0, 2: 20.0, 3: 30.0}})
+
+    def test_function_order(self):
+        # Functions are found by a binary search of the names, whatever
+        # their characters.
+        names = ['main', 'Zeta', u'\u00e9t\u00e9', u'\U0001f600', 'a' * 300,
+                 '_Z3fooi', '']
+        index = ProfileIndex(self.path)
+        index.add([(i, {name: {'counters': {'cycles': float(i)}}})
+                   for i, name in enumerate(names)])
+        for i, name in enumerate(names):
+            self.assertEqual(index.search(name), {'cycles': {i: float(i)}})
+        self.assertEqual(index.search('mai'), {})
+        self.assertEqual(index.search('mainx'), {})
+
+    def _segments(self):
+        return sorted(name for name in os.listdir(self.path)
+                      if name.endswith('.idx'))
+
+    def test_merge(self):
+        index = ProfileIndex(self.path)
+        index.merge()
+        n = profileindex.FANOUT * profileindex.FANOUT + 3
+        for i in range(n):
+            index.add([(i, self._functions(i % 100))])
+
+        # Segments are only merged when asked to, a level at a time.
+        self.assertEqual(len(self._segments()), n)
+        index.merge()
+        segments = self._segments()
+        self.assertEqual(len(segments), 4)
+        self.assertEqual(sum(name.startswith('L2-') for name in segments), 1)
+
+        hits = index.search('main', 'cycles')['cycles']
+        self.assertEqual(hits, {i: float(i % 100) for i in range(n)})
+        self.assertEqual(ProfileIndex(self.path).search('main', 'cycles'),
+                         {'cycles': hits})
+
+    def test_add_while_merging(self):
+        # Segments are added while a merge holds its lock.
+        index = ProfileIndex(self.path)
+        with profileindex.FileLock(os.path.join(self.path, 'merge.lock')):
+            index.add([(1, self._functions(10))])
+        self.assertEqual(index.search('main', 'cycles'),
+                         {'cycles': {1: 10.0}})
+
+
+if __name__ == '__main__':
+    unittest.main(argv=[__file__])
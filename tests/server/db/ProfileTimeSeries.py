@@ -0,0 +1,96 @@
+# Check the per-function time series of profile hotness.
+#
+# RUN: python %s
+
+import os
+import shutil
+import tempfile
+import unittest
+
+from lnt.server.db import profiletimeseries
+from lnt.server.db.profiletimeseries import ProfileTimeSeries, downsample
+
+
+class ProfileTimeSeriesTest(unittest.TestCase):
+    def setUp(self):
+        self.path = tempfile.mkdtemp()
+
+    def tearDown(self):
+        shutil.rmtree(self.path)
+
+    def test_add(self):
+        ts = ProfileTimeSeries(self.path)
+        self.assertEqual(ts.functions(1, 2), [])
+        self.assertEqual(ts.get(1, 2, 'main', 'cycles'), [])
+
+        ts.add(1, 2, 10, {'main': {'counters': {'cycles': 25.0,
+                                                'branch-misses': 2.5}},
+                          'foo/bar': {'counters': {'cycles': 75.0}}})
+        ts.add(1, 2, 11, {'main': {'counters': {'cycles': 50.0}}})
+        ts.add(1, 3, 11, {'baz': {'counters': {'cycles': 50.0}}})
+        self.assertEqual(ts.functions(1, 2), ['foo/bar', 'main'])
+        self.assertEqual(ts.get(1, 2, 'main', 'cycles'),
+                         [(10, 25.0), (11, 50.0)])
+        self.assertEqual(ts.get(1, 2, 'main', 'branch-misses'), [(10, 2.5)])
+        self.assertEqual(ts.get(1, 2, 'foo/bar', 'cycles'), [(10, 75.0)])
+        self.assertEqual(ts.get(1, 2, 'baz', 'cycles'), [])
+
+    def test_compact(self):
+        ts = ProfileTimeSeries(self.path)
+        old_size = profiletimeseries.COMPACT_SIZE
+        profiletimeseries.COMPACT_SIZE = 100
+        self.addCleanup(setattr, profiletimeseries, 'COMPACT_SIZE', old_size)
+        for run in range(20):
+            ts.add(1, 2, run, {'f%d' % (run % 3): {
+                'counters': {'cycles': float(run)}}, 'main': {
+                'counters': {'cycles': 100.0 - run, 'branch-misses': 1.0}}})
+            self.assertEqual(ts.get(1, 2, 'main', 'cycles'),
+                             [(r, 100.0 - r) for r in range(run + 1)])
+        self.assertEqual(ts.functions(1, 2), ['f0', 'f1', 'f2', 'main'])
+        self.assertEqual(ts.get(1, 2, 'f1', 'cycles'),
+                         [(r, float(r)) for r in range(1, 20, 3)])
+        self.assertEqual(len(ts.get(1, 2, 'main', 'branch-misses')), 20)
+        # All the series of a test are kept in two files.
+        self.assertEqual(sorted(os.listdir(os.path.join(self.path, '1'))),
+                         ['2.log', '2.ts'])
+        self.assertLess(os.path.getsize(os.path.join(self.path, '1', '2.log')),
+                        200)
+
+    def test_top_functions(self):
+        ts = ProfileTimeSeries(self.path)
+        n = profiletimeseries.TOP_FUNCTIONS
+        ts.add(1, 1, 1, {'f%d' % i: {'counters': {'cycles': float(i)}}
+                         for i in range(n + 5)})
+        self.assertEqual(ts.functions(1, 1),
+                         sorted('f%d' % i for i in range(5, n + 5)))
+
+    def test_ranking_counter(self):
+        ts = ProfileTimeSeries(self.path)
+        n = profiletimeseries.TOP_FUNCTIONS
+        # Absolute counters and counters other than cycles don't decide
+        # which functions are hottest.
+        ts.add(1, 1, 1, {'f%d' % i: {'counters': {'branch-misses': 100.0 - i,
+                                                  'cycles:u': float(i),
+                                                  'IPC': 100.0 - i}}
+                         for i in range(n + 5)}, ['IPC'])
+        self.assertEqual(ts.functions(1, 1),
+                         sorted('f%d' % i for i in range(5, n + 5)))
+        ts.add(1, 2, 1, {'f%d' % i: {'counters': {'branch-misses': float(i),
+                                                  'latency-mean': 100.0 - i}}
+                         for i in range(n + 5)}, ['latency-mean'])
+        self.assertEqual(ts.functions(1, 2),
+                         sorted('f%d' % i for i in range(5, n + 5)))
+        ts.add(1, 3, 1, {'f': {'counters': {'IPC': 1.5}}}, ['IPC'])
+        self.assertEqual(ts.functions(1, 3), [])
+
+    def test_downsample(self):
+        points = [[i, float(i), {'runID': str(i)}] for i in range(10)]
+        self.assertEqual(downsample(points, 0), points)
+        self.assertEqual(downsample(points, 20), points)
+        self.assertEqual(downsample(points, 2), [
+            [4, 2.0, {'runID': '4', 'min': 0.0, 'max': 4.0, 'count': 5}],
+            [9, 7.0, {'runID': '9', 'min': 5.0, 'max': 9.0, 'count': 5}]])
+
+
+if __name__ == '__main__':
+    unittest.main(argv=[__file__])
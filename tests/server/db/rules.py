@@ -4,6 +4,7 @@
 import unittest
 import logging
 import sys
+from unittest import mock
 
 logging.basicConfig(level=logging.DEBUG)
 
@@ -29,6 +30,38 @@ class RuleProcssingTests(unittest.TestCase):
         self.assertEqual(ret, "Foo.")
         self.assertIn('testhook', rules.DESCRIPTIONS)
 
+    @mock.patch.dict(rules.RULES)
+    def test_schedule(self):
+        """Are post submission hooks run after those they depend on?"""
+        def hook(name, depends_on=()):
+            def func(session, ts, run_id):
+                pass
+            rules.RULES[func] = {'name': name, 'depends_on': list(depends_on),
+                                 'deferrable': False}
+            return func
+        a = hook('a')
+        b = hook('b', ['a'])
+        c = hook('c', ['a', 'unknown'])
+        d = hook('d', ['b', 'c'])
+        self.assertEqual(rules._schedule([d, c, b, a]), [[a], [c, b], [d]])
+
+        # Hooks that depend on each other are run one at a time.
+        e = hook('e', ['f'])
+        f = hook('f', ['e'])
+        self.assertEqual(rules._schedule([a, e, f]), [[a], [e], [f]])
+
+    @mock.patch.dict(rules.STATS)
+    def test_stats(self):
+        """Is the time taken by post submission hooks recorded?"""
+        calls = []
+
+        def timed_hook(session, ts, run_id):
+            calls.append(run_id)
+        rules._run_hook(timed_hook, None, None, 3)
+        rules._run_hook(timed_hook, None, None, 4)
+        self.assertEqual(calls, [3, 4])
+        self.assertEqual(rules.STATS['timed_hook']['calls'], 2)
+
 
 if __name__ == '__main__':
     unittest.main(argv=[sys.argv[0], ])
@@ -0,0 +1,60 @@
+# Check the binary encoding of the code of profiled functions.
+#
+# RUN: python %s
+
+import struct
+import unittest
+
+from lnt.server.ui import profile_wire
+from lnt.server.ui.profile_wire import encodeCode, decodeCode
+
+
+class ProfileWireTest(unittest.TestCase):
+    code = [
+        ({'cycles': 1.5, 'branch-misses': 0.0}, 0x1000, 'add r0, r1'),
+        ({}, 0x1004, 'mov r2, é'),
+        ({'cycles': 3.25}, 0x1002, 'add r0, r1'),
+        ({'cycles': 0.5}, 0xffffffff81000000, 'ret'),
+    ]
+
+    def _flags(self, data):
+        return struct.unpack_from('<B', data, 5)[0]
+
+    def test_roundtrip(self):
+        for delta in (False, True):
+            data = encodeCode(iter(self.code), delta)
+            self.assertEqual(decodeCode(data), self.code)
+            self.assertEqual(self._flags(data), 0)
+
+    def test_delta(self):
+        code = self.code[:3]
+        plain = encodeCode(code)
+        data = encodeCode(code, delta=True)
+        self.assertEqual(self._flags(data), profile_wire.FLAG_DELTA)
+        self.assertEqual(len(plain) - len(data), 2 * 8 - 2 * 4)
+        self.assertEqual(decodeCode(data), code)
+
+    def test_layout(self):
+        data = encodeCode(self.code)
+        self.assertEqual(data[:4], profile_wire.MAGIC)
+        # Two counters, and 'add r0, r1' stored once.
+        n, n_counters, n_texts = struct.unpack_from('<3I', data, 8)
+        self.assertEqual((n, n_counters, n_texts), (4, 2, 3))
+        # The names are padded so that the values are 8-byte aligned.
+        self.assertEqual(data[24:48],
+                         b'\x0d\x00branch-misses\x06\x00cycles\x00')
+        # One column per counter, with NaN where there is no value.
+        values = struct.unpack_from('<8d', data, 48)
+        self.assertEqual([v if v == v else None for v in values],
+                         [0.0, None, None, None, 1.5, None, 3.25, 0.5])
+        self.assertEqual(struct.unpack_from('<4Q', data, 112),
+                         (0x1000, 0x1004, 0x1002, 0xffffffff81000000))
+
+    def test_empty(self):
+        self.assertEqual(decodeCode(encodeCode([], delta=True)), [])
+        with self.assertRaises(ValueError):
+            decodeCode(b'LNTX' + encodeCode([])[4:])
+
+
+if __name__ == '__main__':
+    unittest.main(argv=[__file__])
@@ -30,6 +30,7 @@ from flask import session
 import lnt.server.db.migrate
 import lnt.server.ui.app
 import json
+from lnt.server.ui import profile_wire
 
 # We can validate html if pytidylib is available and tidy-html5 is installed.
 # The user can indicate this by passing --use-tidylib to the script (triggered
@@ -635,6 +636,19 @@ def main():
     lines_in_function = len(code_for_fn)
     assert 2 == lines_in_function
 
+    # The binary encoding carries the same code, and both can be cached.
+    resp = check_code(client, 'v4/nts/profile/ajax/getCodeForFunction?runid=10&testid=10&f=fn1&format=binary&delta=1')
+    assert resp.mimetype == profile_wire.MIME_TYPE
+    assert [list(x) for x in profile_wire.decodeCode(resp.data)] == code_for_fn
+    assert 'immutable' in resp.headers['Cache-Control']
+    etag = resp.headers['ETag']
+    resp = client.get('v4/nts/profile/ajax/getCodeForFunction?runid=10&testid=10&f=fn1&format=binary&delta=1',
+                      headers={'If-None-Match': etag})
+    assert resp.status_code == 304
+    resp = client.get('v4/nts/profile/ajax/getCodeForFunction?runid=10&testid=10&f=fn1',
+                      headers={'If-None-Match': etag})
+    assert resp.status_code == HTTP_OK
+
     # Make sure the new option does not break anything
     check_html(client, '/db_default/v4/nts/graph?switch_min_mean=yes&plot.0=1.3.2&submit=Update')
     check_json(client, '/db_default/v4/nts/graph?switch_min_mean=yes&plot.0=1.3.2&json=true&submit=Update')
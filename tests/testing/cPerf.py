@@ -1,10 +1,22 @@
 # RUN: python %s
 
 import unittest
+import base64
+from array import array
+import io
 import sys
 import os
+import shutil
+import struct
+import subprocess
 import tempfile
+from unittest import mock
+from lnt.testing.profile import cPerf
+from lnt.testing.profile import perf
 from lnt.testing.profile.perf import LinuxPerfProfile
+from lnt.testing.profile.profile import Profile
+from lnt.testing.profile.profilev1impl import ProfileV1
+from lnt.testing.profile.profilev2impl import ProfileV2
 
 
 class CPerfTest(unittest.TestCase):
@@ -170,12 +182,22 @@ class CPerfTest(unittest.TestCase):
     def _getInput(self, fname):
         return os.path.join(self.inputs, fname)
 
-    def _loadPerfDataInput(self, fname):
+    def _binaryCacheRoot(self, *paths):
+        # A binary cache root, removed after the test, holding an empty file
+        # at each of paths.
+        root = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, root)
+        for path in paths:
+            os.makedirs(os.path.dirname(root + path), exist_ok=True)
+            open(root + path, 'w').close()
+        return root
+
+    def _loadPerfDataInput(self, fname, **kwargs):
         perf_data = self._getInput(fname)
         fake_objdump = self._getObjdump(perf_data)
         with open(perf_data, 'rb') as f:
             return LinuxPerfProfile.deserialize(
-                f, objdump=fake_objdump, propagateExceptions=True)
+                f, objdump=fake_objdump, propagateExceptions=True, **kwargs)
 
     def test_check_file(self):
         self.assertTrue(LinuxPerfProfile.checkFile(self._getInput('fib-aarch64.perf_data')))
@@ -190,11 +212,262 @@ class CPerfTest(unittest.TestCase):
 
         self.assertEqual(p.data, self.expected_data['fib2-aarch64'])
 
+    def test_aarch64_fib2_out_of_order(self):
+        # Move the mappings after all the samples, as if they had been in
+        # the buffer of a CPU written out last. Their times still put them
+        # before the samples, which must be attributed as before.
+        with open(self._getInput('fib2-aarch64.perf_data'), 'rb') as f:
+            data = bytearray(f.read())
+        data_offset, data_size = struct.unpack_from('<QQ', data, 40)
+        maps, others = [], []
+        offset = data_offset
+        while offset < data_offset + data_size:
+            type, _, size = struct.unpack_from('<IHH', data, offset)
+            record = bytes(data[offset:offset + size])
+            (maps if type in (1, 10) else others).append(record)
+            offset += size
+        data[data_offset:data_offset + data_size] = b''.join(others + maps)
+
+        with tempfile.NamedTemporaryFile() as fd:
+            fd.write(data)
+            fd.flush()
+            fd.seek(0)
+            p = LinuxPerfProfile.deserialize(
+                fd, objdump=self._getObjdump(
+                    self._getInput('fib2-aarch64.perf_data')),
+                propagateExceptions=True)
+
+        self.assertEqual(p.data, self.expected_data['fib2-aarch64'])
+
+    def test_aarch64_fib2_inputs(self):
+        perf_data = self._getInput('fib2-aarch64.perf_data')
+        for kind in ('mmap', 'pread', 'pipe'):
+            with mock.patch.dict(os.environ, {'LNT_PERF_INPUT': kind}):
+                p = self._loadPerfDataInput('fib2-aarch64.perf_data')
+            self.assertEqual(p.data, self.expected_data['fib2-aarch64'])
+        with mock.patch.dict(os.environ, {'LNT_PERF_INPUT': 'mapped'}):
+            with self.assertRaises(ValueError):
+                cPerf.readTopLevelCounters(perf_data)
+
+        # A named pipe is read as a pipe whatever the file is called.
+        root = tempfile.mkdtemp()
+        try:
+            fifo = os.path.join(root, 'perf.data')
+            os.mkfifo(fifo)
+            writer = subprocess.Popen([
+                sys.executable, '-c',
+                'import sys; open(sys.argv[2], "wb").write('
+                'open(sys.argv[1], "rb").read())', perf_data, fifo])
+            counters = cPerf.readTopLevelCounters(fifo)
+            writer.wait()
+        finally:
+            shutil.rmtree(root)
+        self.assertEqual(counters, cPerf.readTopLevelCounters(perf_data))
+
+    def test_pread_chunks(self):
+        # A data section of several chunks, whose records straddle their
+        # boundaries: the records of fib2 64 times over. The feature sections
+        # after it move with it.
+        with open(self._getInput('fib2-aarch64.perf_data'), 'rb') as f:
+            data = f.read()
+        data_offset, data_size = struct.unpack_from('<QQ', data, 40)
+        flags, = struct.unpack_from('<Q', data, 72)
+        end = data_offset + data_size
+        shift = 63 * data_size
+        features = bytearray(data[end:])
+        for i in range(bin(flags).count('1')):
+            offset, = struct.unpack_from('<Q', features, 16 * i)
+            struct.pack_into('<Q', features, 16 * i, offset + shift)
+        header = bytearray(data[:data_offset])
+        struct.pack_into('<Q', header, 48, 64 * data_size)
+
+        with tempfile.NamedTemporaryFile() as fd:
+            fd.write(header + data[data_offset:end] * 64 + features)
+            fd.flush()
+            with mock.patch.dict(os.environ, {'LNT_PERF_INPUT': 'pread'}):
+                counters = cPerf.readTopLevelCounters(fd.name)
+        once = cPerf.readTopLevelCounters(
+            self._getInput('fib2-aarch64.perf_data'))
+        self.assertEqual(counters, {k: 64 * v for k, v in once.items()})
+
     def test_aarch64_fib2_nondynamic(self):
         p = self._loadPerfDataInput('fib2-aarch64.perf_data')
 
         self.assertEqual(p.data, self.expected_data['fib2-aarch64'])
 
+    def test_aarch64_fib2_columnar(self):
+        p = self._loadPerfDataInput('fib2-aarch64.perf_data')
+        expected = self.expected_data['fib2-aarch64']['functions']['fib']
+
+        # The per-instruction data is held in contiguous buffers.
+        f = p.result['functions']['fib']
+        names = p.result['counter-names']
+        self.assertEqual(sorted(names),
+                         ['branch-misses', 'cache-misses', 'cycles'])
+        addresses = memoryview(f['addresses'])
+        self.assertEqual((addresses.format, addresses.shape), ('Q', (14,)))
+        self.assertEqual(addresses.tolist(), [x[1] for x in expected['data']])
+        matrix = memoryview(f['counter-matrix'])
+        self.assertEqual(matrix.shape, (14, 3))
+        self.assertEqual(matrix.tolist()[2], [0, 0, 0])
+        self.assertEqual(len(f['text-offsets']), 14)
+
+        # Querying the profile does not build the ProfileV1 dict.
+        self.assertEqual(p.getFunctions()['fib'],
+                         {'counters': expected['counters'], 'length': 14})
+        self.assertEqual([list(x) for x in p.getCodeForFunction('fib')],
+                         expected['data'])
+        self.assertIsNone(p._data)
+
+    def test_aarch64_fib2_streaming(self):
+        perf_data = self._getInput('fib2-aarch64.perf_data')
+        fake_objdump = self._getObjdump(perf_data)
+
+        # cPerf emits one function at a time.
+        functions = cPerf.iterFunctions(perf_data, fake_objdump)
+        expected = self.expected_data['fib2-aarch64']
+        self.assertEqual(functions.info, {'counters': expected['counters']})
+        self.assertEqual([name for name, f in functions], ['fib'])
+
+        # Streaming it into a ProfileV2 gives the same profile as upgrading
+        # the whole profile.
+        with tempfile.NamedTemporaryFile() as tf:
+            self.assertTrue(LinuxPerfProfile.importToProfileV2(
+                perf_data, tf.name, objdump=fake_objdump,
+                propagateExceptions=True))
+            with open(tf.name, 'rb') as f:
+                streamed = ProfileV2.deserialize(f)
+                upgraded = ProfileV2.deserialize(io.BytesIO(ProfileV2.upgrade(
+                    self._loadPerfDataInput('fib2-aarch64.perf_data'))
+                    .serialize()))
+                self.assertEqual(streamed.getTopLevelCounters(),
+                                 upgraded.getTopLevelCounters())
+                self.assertEqual(streamed.getFunctions(),
+                                 upgraded.getFunctions())
+                self.assertEqual(list(streamed.getCodeForFunction('fib')),
+                                 list(upgraded.getCodeForFunction('fib')))
+
+    def test_aarch64_fib2_peek(self):
+        perf_data = self._getInput('fib2-aarch64.perf_data')
+        expected = self.expected_data['fib2-aarch64']['counters']
+        self.assertEqual(cPerf.readTopLevelCounters(perf_data), expected)
+
+        # Rendered perf data is saved and summarized in one go.
+        with open(perf_data, 'rb') as f:
+            rendered = base64.b64encode(f.read())
+        profileDir = tempfile.mkdtemp()
+        try:
+            filename, summary = Profile.ingestRendered(
+                rendered, profileDir=profileDir, prefix='t-')
+            self.assertEqual(summary, {'counters': expected})
+            self.assertTrue(LinuxPerfProfile.checkFile(filename))
+        finally:
+            shutil.rmtree(profileDir)
+
+    def test_aarch64_fib2_functions_only(self):
+        p = self._loadPerfDataInput('fib2-aarch64.perf_data',
+                                    detail='functions')
+
+        expected = self.expected_data['fib2-aarch64']
+        self.assertEqual(p.getDetail(), 'functions')
+        self.assertEqual(p.data['counters'], expected['counters'])
+        self.assertEqual(p.data['functions'],
+                         {'fib': {'counters':
+                                  expected['functions']['fib']['counters']}})
+        self.assertEqual(p.getFunctions()['fib']['length'], 0)
+        self.assertEqual(list(p.getCodeForFunction('fib')), [])
+
+    def test_aarch64_fib2_kernel(self):
+        kallsyms = self._getInput('fib2-aarch64.kallsyms')
+        p = self._loadPerfDataInput('fib2-aarch64.perf_data',
+                                    kallsyms=kallsyms)
+
+        # The kernel samples go through the same thresholds as user code,
+        # without changing the totals or the user functions.
+        expected = self.expected_data['fib2-aarch64']
+        self.assertEqual(p.data['counters'], expected['counters'])
+        self.assertEqual(sorted(p.data['functions']),
+                         ['clear_page', 'fib', 'handle_mm_fault'])
+        self.assertEqual(p.data['functions']['fib'],
+                         expected['functions']['fib'])
+
+        # There is no code for the kernel, only the sampled addresses.
+        self.assertIsNone(p.getBinaryInfo('handle_mm_fault'))
+        code = list(p.getCodeForFunction('handle_mm_fault'))
+        self.assertEqual([x[1] for x in code],
+                         [0xffffffc000161df8, 0xffffffc000161e0c,
+                          0xffffffc0001631f0, 0xffffffc000168808])
+        self.assertEqual(set(x[2] for x in code), {''})
+
+    def test_aarch64_fib2_filters(self):
+        perf_data = self._getInput('fib2-aarch64.perf_data')
+        total = self.expected_data['fib2-aarch64']['counters']
+
+        def counters(**kwargs):
+            return cPerf.importPerf(perf_data, detail='functions',
+                                    **kwargs)['counters']
+
+        # Filtered out samples do not count towards the totals.
+        self.assertEqual(counters(pids=[0]), {})
+        self.assertEqual(counters(comm='^perf$'), {})
+        fib = counters(comm='fib')
+        self.assertEqual(sorted(fib), sorted(total))
+        self.assertTrue(all(0 < fib[k] < total[k] for k in total))
+
+        # Time windows split the samples between them.
+        before = counters(timeRange=(None, 0.05))
+        after = counters(timeRange=(0.05, None))
+        self.assertEqual({k: before[k] + after[k] for k in total}, total)
+        self.assertTrue(0 < before['cycles'] < after['cycles'])
+
+        # The profile does not record the CPU of samples.
+        with self.assertRaises(AssertionError):
+            counters(cpus=[0])
+        with self.assertRaises(ValueError):
+            counters(comm='(')
+
+    def test_aarch64_fib2_deferred_disassembly(self):
+        p = self._loadPerfDataInput('fib2-aarch64.perf_data',
+                                    detail='addresses')
+
+        expected = self.expected_data['fib2-aarch64']
+        self.assertEqual(p.getDetail(), 'addresses')
+        self.assertEqual(p.getBinaryInfo('fib'),
+                         {'binary': '/root/fib',
+                          'build-id': '52d68e9c60a5ae9ba972e8f20444fcba9401ad33',
+                          'start': 0x4006c8, 'end': 0x400700})
+        # Only the sampled addresses are stored, without any text.
+        sampled = [x for x in expected['functions']['fib']['data'] if x[0]]
+        self.assertEqual(list(p.getCodeForFunction('fib')),
+                         [(c, a, '') for c, a, t in sampled])
+
+        # Disassembly is produced when the code is asked for, if the binary
+        # is in the binary cache.
+        fake_objdump = self._getObjdump(self._getInput('fib2-aarch64.perf_data'))
+        self.assertEqual(list(Profile(p).getCodeForFunction(
+            'fib', objdump=fake_objdump, binaryCacheRoot='')), list(
+            p.getCodeForFunction('fib')))
+        root = self._binaryCacheRoot('/root/fib')
+        code = Profile(p).getCodeForFunction('fib', objdump=fake_objdump,
+                                             binaryCacheRoot=root)
+        self.assertEqual([list(x) for x in code],
+                         expected['functions']['fib']['data'])
+
+        # And survives the upgrade to the latest profile version, and
+        # being stored and read back as the server does.
+        p2 = Profile(p).upgrade()
+        serialized = p2.impl.serialize()
+        p3 = ProfileV2.deserialize(io.BytesIO(serialized))
+        self.assertEqual(p3.getDetail(), 'addresses')
+        self.assertEqual(p3.getBinaryInfo('fib'), p.getBinaryInfo('fib'))
+        code = Profile(p3).getCodeForFunction('fib', objdump=fake_objdump,
+                                              binaryCacheRoot=root)
+        # ProfileV2 stores counters as float32s.
+        self.assertEqual(
+            [[{k: array('f', [v])[0] for k, v in c.items()}, a, t]
+             for c, a, t in expected['functions']['fib']['data']],
+            [list(x) for x in code])
+
     def _check_segment_layout(self, suffix):
         counter_name = 'cpu-clock'
         p = self._loadPerfDataInput('segments-%s.perf_data' % suffix)
@@ -228,6 +501,423 @@ class CPerfTest(unittest.TestCase):
         # violated by some ELF files.
         self._check_segment_layout('shifted')
 
+    @unittest.skipUnless(getattr(cPerf, 'NATIVE_DISASSEMBLER', 0),
+                         'cPerf was built without the LLVM disassembler')
+    def test_normalized_segment_layouts(self):
+        # The same code, loaded at different addresses, is normalized to the
+        # same instructions and hash.
+        profiles = [Profile(self._loadPerfDataInput(
+            'segments-%s.perf_data' % suffix, normalize=True))
+            for suffix in ('dyn', 'exec', 'shifted')]
+        code = [list(p.getCodeForFunction('correct')) for p in profiles]
+        self.assertEqual([a for c, a, t in code[0]],
+                         [0x0, 0x3, 0x5, 0xb, 0xe, 0x10])
+        self.assertEqual([t for c, a, t in code[0]][1:3],
+                         ['\tjle\t0x10 <correct+0x10>',
+                          '\tincl\t(%rip) # <n>'])
+        for p, c in zip(profiles[1:], code[1:]):
+            self.assertEqual([t for _, _, t in c], [t for _, _, t in code[0]])
+            self.assertEqual(p.getUnchangedFunctions(profiles[0]),
+                             set(['correct']))
+
+        # The hash survives the upgrade to the latest profile version.
+        h = profiles[0].getFunctions()['correct']['hash']
+        upgraded = ProfileV2.deserialize(io.BytesIO(
+            profiles[0].upgrade().impl.serialize()))
+        self.assertEqual(upgraded.getFunctions()['correct']['hash'], h)
+        self.assertEqual(
+            ProfileV2.peek(io.BytesIO(upgraded.serialize()),
+                           functions=True)['functions']['correct']['hash'], h)
+
+        # Profiles without hashes have no unchanged functions.
+        p = Profile(self._loadPerfDataInput('segments-dyn.perf_data'))
+        self.assertNotIn('hash', p.getFunctions()['correct'])
+        self.assertEqual(p.getUnchangedFunctions(profiles[0]), set())
+
+    def test_native_disassembler(self):
+        # A minimal x86-64 ELF executable with a single PT_LOAD segment
+        # holding: push %rbp; mov %rsp,%rbp; pop %rbp; ret
+        code = b'\x55\x48\x89\xe5\x5d\xc3'
+        base, offset = 0x400000, 64 + 56
+        ehdr = struct.pack('<4sBBBBB7sHHIQQQIHHHHHH', b'\x7fELF', 2, 1, 1,
+                           0, 0, b'', 2, 62, 1, base + offset, 64, 0, 0,
+                           64, 56, 1, 64, 0, 0)
+        phdr = struct.pack('<IIQQQQQQ', 1, 5, 0, base, base,
+                           offset + len(code), offset + len(code), 0x1000)
+        root = self._binaryCacheRoot()
+        with open(os.path.join(root, 'f'), 'wb') as fd:
+            fd.write(ehdr + phdr + code)
+        # objdump is 'false' so that only the native path can succeed, and
+        # it is only taken when asked for.
+        self.assertEqual(cPerf.disassemble('/f', base + offset,
+                                           base + offset + len(code),
+                                           'false', root), [])
+        code = cPerf.disassemble('/f', base + offset,
+                                 base + offset + len(code), 'false', root,
+                                 'auto')
+        self.assertEqual([a - base - offset for a, _ in code], [0, 1, 4, 5])
+        self.assertEqual([t.split()[0] for _, t in code],
+                         ['pushq', 'movq', 'popq', 'retq'])
+
+    def _writeELF(self, fd, machine, base, code, symbols):
+        # A minimal 64-bit ELF executable with a single PT_LOAD segment
+        # holding code at base + 120, and a symbol table of functions given
+        # as (name, address, size).
+        offset = 64 + 56
+        strtab = b'\0'
+        symtab = b'\0' * 24
+        for name, address, size in symbols:
+            symtab += struct.pack('<IBBHQQ', len(strtab), 0x12, 0, 0xfff1,
+                                  address, size)
+            strtab += name.encode() + b'\0'
+        shoff = offset + len(code) + len(strtab) + len(symtab)
+        ehdr = struct.pack('<4sBBBBB7sHHIQQQIHHHHHH', b'\x7fELF', 2, 1, 1,
+                           0, 0, b'', 2, machine, 1, base + offset, 64, shoff,
+                           0, 64, 56, 1, 64, 3, 0)
+        phdr = struct.pack('<IIQQQQQQ', 1, 5, 0, base, base,
+                           offset + len(code), offset + len(code), 0x1000)
+        shdrs = (b'\0' * 64 +
+                 struct.pack('<IIQQQQIIQQ', 0, 2, 0, 0,
+                             offset + len(code) + len(strtab), len(symtab),
+                             2, 1, 8, 24) +
+                 struct.pack('<IIQQQQIIQQ', 0, 3, 0, 0, offset + len(code),
+                             len(strtab), 0, 0, 1, 0))
+        fd.write(ehdr + phdr + code + strtab + symtab + shdrs)
+        fd.flush()
+        return base + offset
+
+    @unittest.skipUnless(getattr(cPerf, 'NATIVE_DISASSEMBLER', 0),
+                         'cPerf was built without LLVM')
+    def test_native_branch_targets(self):
+        # Branch targets are printed as objdump does, as absolute addresses
+        # with the function they are in, and not as offsets.
+        base, bar = 0x400000, 0x402000
+        start = base + 120
+        x86 = (b'\x74\x02\x90\x90\xeb\xfa\xe8' +
+               struct.pack('<i', bar - (start + 11)) + b'\xc3')
+        a64 = struct.pack('<6I', 0x54000041, 0xd503201f, 0x17fffffe,
+                          0x94000000 | (bar - (start + 12)) // 4,
+                          0xd0000000, 0xd65f03c0)
+        expected = {
+            62: [['je', '%x' % (start + 4), '<f+0x4>'],
+                 ['nop'],
+                 ['nop'],
+                 ['jmp', '%x' % start, '<f>'],
+                 ['callq', '%x' % bar, '<bar>'],
+                 ['retq']],
+            183: [['b.ne', '%x' % (start + 8), '<f+0x8>'],
+                  ['nop'],
+                  ['b', '%x' % start, '<f>'],
+                  ['bl', '%x' % bar, '<bar>'],
+                  ['adrp', 'x0,', '%x' % bar, '<bar>'],
+                  ['ret']],
+        }
+        root = self._binaryCacheRoot()
+        for machine, code in ((62, x86), (183, a64)):
+            with open(os.path.join(root, 'f'), 'wb') as fd:
+                self._writeELF(fd, machine, base, code,
+                               [('f', start, len(code)), ('bar', bar, 16)])
+            lines = cPerf.disassemble('/f', start, start + len(code), 'false',
+                                      root, 'auto')
+            self.assertEqual([t.split() for _, t in lines], expected[machine])
+
+    def test_objdump_long_lines(self):
+        # Lines longer than the line buffer, and a last line without a
+        # newline, are read whole.
+        long_text = 'x' * 200000
+        prog = ("import sys; sys.stdout.write('1000:%s\\n1001:last' % ('x' * "
+                "200000))")
+        code = cPerf.disassemble('/root/fib', 0x1000, 0x1002,
+                                 '%s -c "%s"' % (sys.executable, prog),
+                                 self._binaryCacheRoot('/root/fib'))
+        self.assertEqual(code, [(0x1000, long_text), (0x1001, 'last')])
+
+    def test_build_id_store(self):
+        # An "objdump" that prints its arguments as disassembly, to see which
+        # file cPerf asked for.
+        echo = "printf '1000:%s\\n'"
+        build_id = '52d68e9c60a5ae9ba972e8f20444fcba9401ad33'
+
+        def resolve(root):
+            code = cPerf.disassemble('/root/fib', 0x1000, 0x1001, echo, root,
+                                     'objdump', build_id)
+            return code[-1][1]
+
+        root = self._binaryCacheRoot('/root/fib')
+        # Without a store, the path is looked for under the root.
+        self.assertEqual(resolve(root), root + '/root/fib')
+
+        # A debuginfod client cache.
+        os.makedirs(os.path.join(root, build_id))
+        open(os.path.join(root, build_id, 'executable'), 'w').close()
+        self.assertEqual(resolve(root),
+                         '%s/%s/executable' % (root, build_id))
+
+        # perf's build-id cache, which takes precedence.
+        os.makedirs(os.path.join(root, '.build-id', build_id[:2],
+                                 build_id[2:]))
+        open(os.path.join(root, '.build-id', build_id[:2], build_id[2:],
+                          'elf'), 'w').close()
+        self.assertEqual(resolve(root), '%s/.build-id/%s/%s/elf' %
+                         (root, build_id[:2], build_id[2:]))
+
+    def test_binary_cache_confinement(self):
+        # The paths and build-ids of submitted profiles cannot name files
+        # outside of the binary cache root.
+        echo = "printf '1000:%s\n'"
+        root = self._binaryCacheRoot('/root/fib')
+        os.symlink(os.path.dirname(os.path.abspath(__file__)),
+                   os.path.join(root, 'link'))
+        self.assertEqual(cPerf.disassemble('/root/fib', 0x1000, 0x1001, echo,
+                                           root)[-1],
+                         (0x1000, root + '/root/fib'))
+        for binary, cache_root, build_id in (
+                ('/root/fib', '', ''),
+                ('root/fib', root, ''),
+                ('/root/../root/fib', root, ''),
+                ('/../' + os.path.basename(root) + '/root/fib', root, ''),
+                ('/link/cPerf.py', root, ''),
+                ('/root/missing', root, ''),
+                ('/root/fib', root, '../../root/fib')):
+            with self.assertRaises(ValueError):
+                cPerf.disassemble(binary, 0x1000, 0x1001, echo, cache_root,
+                                  'objdump', build_id)
+            self.assertEqual(perf.disassemble(binary, 0x1000, 0x1001, echo,
+                                              cache_root, 'objdump',
+                                              build_id), ())
+
+    def _write_jit_profile(self, root, pid, weights=None, accesses=None):
+        # A perf.data file for a process that ran two JIT-compiled functions:
+        # jit_fn, described with its code in jit-<pid>.dump, and perf_map_fn,
+        # only named in /tmp/perf-<pid>.map. If weights are given, samples
+        # carry PERF_SAMPLE_WEIGHT. If accesses are given, samples carry
+        # PERF_SAMPLE_ADDR and PERF_SAMPLE_DATA_SRC, and /data.bin is mapped
+        # for data.
+        jit_code = b'\x55\x48\x89\xe5\x5d\xc3'
+        jit_addr, map_addr = 0x7f0000001000, 0x7f0000002000
+
+        os.mkdir(os.path.join(root, 'tmp'))
+        with open(os.path.join(root, 'tmp', 'perf-%d.map' % pid), 'w') as f:
+            f.write('%x 40 perf_map_fn\n' % map_addr)
+
+        name = b'jit_fn\0'
+        load = struct.pack('<IIQQQQ', pid, pid, jit_addr, jit_addr,
+                           len(jit_code), 1) + name + jit_code
+        with open(os.path.join(root, 'jit-%d.dump' % pid), 'wb') as f:
+            f.write(struct.pack('<IIIIIIQQ', 0x4A695444, 1, 40, 62, 0, pid,
+                                0, 0))
+            f.write(struct.pack('<IIQ', 0, 16 + len(load), 1) + load)
+
+        # Sample layout: IP, TID, TIME and PERIOD (and WEIGHT), with
+        # sample_id_all.
+        sample_type = 0x107 if weights is None else 0x4107
+        if accesses is not None:
+            sample_type |= 0x8008
+        mappings = [(0, 0x7f0000100000, b'/jit-%d.dump\0\0\0\0' % pid)]
+        if accesses is not None:
+            # PERF_RECORD_MISC_MMAP_DATA
+            mappings.append((0x2000, 0x600000000000, b'/data.bin\0\0\0\0\0\0\0'))
+        events = []
+        for misc, start, filename in mappings:
+            events.append(struct.pack('<IHHIIQQQ', 1, misc,
+                                      8 + 32 + len(filename) + 16, pid, pid,
+                                      start, 0x3000, 0) +
+                          filename + struct.pack('<IIQ', pid, pid, 1))
+        for time, ip in enumerate([jit_addr, jit_addr, jit_addr,
+                                   jit_addr + 4, map_addr + 0x10,
+                                   map_addr + 0x10, 0x1234]):
+            sample = struct.pack('<QIIQ', ip, pid, pid, 10 + time)
+            if accesses is not None:
+                sample += struct.pack('<Q', accesses[time][0])
+            sample += struct.pack('<Q', 1)
+            if weights is not None:
+                sample += struct.pack('<Q', weights[time])
+            if accesses is not None:
+                sample += struct.pack('<Q', accesses[time][1])
+            events.append(struct.pack('<IHH', 9, 0, 8 + len(sample)) +
+                          sample)
+        data = b''.join(events)
+
+        attr = struct.pack('<IIQQQQQIIQQQ', 0, 80, 0, 0, sample_type, 0, 0,
+                           0, 0, 0, 0, 0)
+        attrs = attr + struct.pack('<QQ', 0, 0)
+        header = struct.pack('<8sQQQQQQQQQQQQ', b'PERFILE2', 104, len(attrs),
+                             104, len(attrs), 104 + len(attrs), len(data),
+                             0, 0, 0, 0, 0, 0)
+        perf_data = os.path.join(root, 'perf.data')
+        with open(perf_data, 'wb') as f:
+            f.write(header + attrs + data)
+        return perf_data
+
+    def test_jit_code(self):
+        root = tempfile.mkdtemp()
+        try:
+            perf_data = self._write_jit_profile(root, 4242)
+            p = cPerf.importPerf(perf_data, 'false', root,
+                                 disassembler='auto')
+        finally:
+            shutil.rmtree(root)
+
+        # The sample outside any mapping or JIT function is dropped.
+        self.assertEqual(p['counters'], {'cycles': 6})
+        fns = p['functions']
+        self.assertEqual(sorted(fns.keys()), ['jit_fn', 'perf_map_fn'])
+        self.assertEqual(fns['jit_fn']['counters'], {'cycles': 4})
+        self.assertEqual(fns['perf_map_fn']['counters'], {'cycles': 2})
+        # There is no code for perf_map_fn, so only its sampled addresses
+        # are listed.
+        self.assertEqual(fns['perf_map_fn']['data'],
+                         [[{'cycles': 2}, 0x7f0000002010, '']])
+        if getattr(cPerf, 'NATIVE_DISASSEMBLER', 0):
+            self.assertEqual([(c, a - 0x7f0000001000, t.split()[0])
+                              for c, a, t in fns['jit_fn']['data']],
+                             [({'cycles': 3}, 0, 'pushq'),
+                              ({}, 1, 'movq'),
+                              ({'cycles': 1}, 4, 'popq'),
+                              ({}, 5, 'retq')])
+
+    def test_sample_weights(self):
+        root = tempfile.mkdtemp()
+        try:
+            perf_data = self._write_jit_profile(
+                root, 4242, weights=[0, 0, 0, 0, 30, 400, 0])
+            with open(perf_data, 'rb') as f:
+                p = LinuxPerfProfile.deserialize(f, objdump='false',
+                                                 binaryCacheRoot=root,
+                                                 propagateExceptions=True)
+        finally:
+            shutil.rmtree(root)
+
+        # Latencies are absolute (in cycles, to within the histogram's 25%
+        # buckets) rather than percentages.
+        counters = {'latency-mean': 215, 'latency-p50': 30,
+                    'latency-p99': 416}
+        self.assertEqual(p.getTopLevelCounters(),
+                         dict(counters, cycles=6))
+        self.assertEqual(p.getFunctions()['perf_map_fn']['counters'],
+                         dict(counters, cycles=100.0 * 2 / 6))
+        self.assertEqual(list(p.getCodeForFunction('perf_map_fn')),
+                         [(dict(counters, cycles=100.0), 0x7f0000002010, '')])
+        # Functions without weighted samples have no latency counters.
+        self.assertEqual(p.getFunctions()['jit_fn']['counters'],
+                         {'cycles': 100.0 * 4 / 6})
+
+    def test_data_objects(self):
+        # An "objdump" for /data.bin, which has a 'table' object at
+        # 0x10100-0x10200 in a segment loaded from offset 0 at 0x10000.
+        objdump = """#!/bin/sh
+case "$1" in
+-p) printf '    LOAD off    0x0000000000000000 vaddr 0x0000000000010000 '
+    printf 'paddr 0x0000000000010000 align 2**12\\n'
+    printf '         filesz 0x0000000000002000 memsz 0x0000000000003000 '
+    printf 'flags rw-\\n' ;;
+-t) printf '0000000000010100 g     O .data\\t0000000000000100 table\\n' ;;
+*) exit 1 ;;
+esac
+"""
+        # PERF_MEM_LVL_* (shifted to mem_lvl) for hits and misses.
+        l1_hit, l3_miss, ram_hit = 0x0a << 5, 0x44 << 5, 0x82 << 5
+        accesses = [(0x600000000110, l1_hit), (0x600000000120, l3_miss),
+                    (0x600000000800, ram_hit), (0x555500000010, 0),
+                    (0, 0), (0, 0), (0, 0)]
+        root = tempfile.mkdtemp()
+        try:
+            objdump_path = os.path.join(root, 'objdump')
+            with open(objdump_path, 'w') as f:
+                f.write(objdump)
+            os.chmod(objdump_path, 0o755)
+            perf_data = self._write_jit_profile(root, 4242,
+                                                accesses=accesses)
+            with open(perf_data, 'rb') as f:
+                p = LinuxPerfProfile.deserialize(f, objdump=objdump_path,
+                                                 binaryCacheRoot=root,
+                                                 propagateExceptions=True,
+                                                 dataObjects=True)
+        finally:
+            shutil.rmtree(root)
+
+        # Addresses in /data.bin outside 'table', and anonymous memory, are
+        # grouped by page. Memory levels are percentages of each object's
+        # samples.
+        expected = {
+            'table': {'counters': {'cycles': 100.0 * 2 / 6},
+                      'levels': {'L1': 50.0, 'L3-miss': 50.0}},
+            '[page 0x600000000000]': {'counters': {'cycles': 100.0 / 6},
+                                      'levels': {'RAM': 100.0}},
+            '[page 0x555500000000]': {'counters': {'cycles': 100.0 / 6},
+                                      'levels': {'unknown': 100.0}},
+        }
+        self.assertEqual(p.getDataObjects(), expected)
+
+        # Data objects survive the upgrade to, and a round trip through,
+        # ProfileV2.
+        v2 = ProfileV2.upgrade(ProfileV1(p.data))
+        v2 = ProfileV2.deserialize(io.BytesIO(v2.serialize()))
+        self.assertEqual(v2.getDataObjects().keys(), expected.keys())
+        for name, o in expected.items():
+            for k in ('counters', 'levels'):
+                for key, value in o[k].items():
+                    self.assertAlmostEqual(v2.getDataObjects()[name][k][key],
+                                           value, places=4)
+
+    def test_group_read(self):
+        # Two functions named in a perf map, sampled with the group
+        # {cycles, instructions} read on every sample (PERF_SAMPLE_READ with
+        # PERF_FORMAT_GROUP | PERF_FORMAT_ID).
+        pid, fn_a, fn_b = 4242, 0x7f0000002000, 0x7f0000003000
+        samples = [(fn_a, 100, 200), (fn_a + 4, 200, 300), (fn_b, 400, 350)]
+
+        # Sample layout: IP, TID, TIME, ID, PERIOD and READ.
+        attrs = b''.join(struct.pack('<IIQQQQQIIQQQ', 0, 80, config, 0, 0x157,
+                                     0xc, 0, 0, 0, 0, 0, 0) +
+                         struct.pack('<QQ', 104 + 2 * 96 + 8 * config, 8)
+                         for config in (0, 1))
+        ids = struct.pack('<QQ', 1, 2)
+        events = []
+        for time, (ip, cycles, instructions) in enumerate(samples):
+            # The period is ignored in favour of the counter values.
+            sample = struct.pack('<QIIQQQQQQQQ', ip, pid, pid, 10 + time, 1,
+                                 1, 2, cycles, 1, instructions, 2)
+            events.append(struct.pack('<IHH', 9, 0, 8 + len(sample)) +
+                          sample)
+        data = b''.join(events)
+        header = struct.pack('<8sQQQQQQQQQQQQ', b'PERFILE2', 104, 96, 104,
+                             len(attrs), 104 + len(attrs) + len(ids),
+                             len(data), 0, 0, 0, 0, 0, 0)
+
+        root = tempfile.mkdtemp()
+        try:
+            os.mkdir(os.path.join(root, 'tmp'))
+            with open(os.path.join(root, 'tmp', 'perf-%d.map' % pid),
+                      'w') as f:
+                f.write('%x 40 fn_a\n%x 40 fn_b\n' % (fn_a, fn_b))
+            perf_data = os.path.join(root, 'perf.data')
+            with open(perf_data, 'wb') as f:
+                f.write(header + attrs + ids + data)
+            with open(perf_data, 'rb') as f:
+                p = LinuxPerfProfile.deserialize(f, objdump='false',
+                                                 binaryCacheRoot=root,
+                                                 propagateExceptions=True)
+        finally:
+            shutil.rmtree(root)
+
+        # Each sample gets what every member counted since the previous one.
+        self.assertEqual(p.getTopLevelCounters(),
+                         {'cycles': 400, 'instructions': 350})
+        fns = p.getFunctions()
+        self.assertEqual(fns['fn_a']['counters'],
+                         {'cycles': 50.0, 'instructions': 100.0 * 300 / 350,
+                          'IPC': 1.5})
+        self.assertEqual(fns['fn_b']['counters'],
+                         {'cycles': 50.0, 'instructions': 100.0 * 50 / 350,
+                          'IPC': 0.25})
+        self.assertEqual(list(p.getCodeForFunction('fn_a')),
+                         [({'cycles': 50.0, 'instructions': 100.0 * 2 / 3,
+                            'IPC': 2.0}, fn_a, ''),
+                          ({'cycles': 50.0, 'instructions': 100.0 / 3,
+                            'IPC': 1.0}, fn_a + 4, '')])
+        self.assertIn('IPC', p.data['absolute-counters'])
+
     def test_random_guff(self):
         # Create complete rubbish and throw it at cPerf, expecting an
         # AssertionError.
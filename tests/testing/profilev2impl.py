@@ -6,8 +6,11 @@ import sys
 import copy
 import tempfile
 import io
+import itertools
+from lnt.testing.profile import profilev2impl
 from lnt.testing.profile.profilev2impl import ProfileV2
 from lnt.testing.profile.profilev1impl import ProfileV1
+from lnt.testing.profile.profile import Profile
 
 
 logging.basicConfig(level=logging.DEBUG)
@@ -35,6 +38,26 @@ class ProfileV2Test(unittest.TestCase):
             p.serialize(f.name)
             self.assertTrue(ProfileV2.checkFile(f.name))
 
+    @unittest.skipUnless(getattr(profilev2impl.cPerf, 'serializeProfileV2',
+                                 None), 'cPerf was built without libbz2')
+    def test_native_serialize(self):
+        # cPerf writes the same bytes as the Python serializer.
+        data = copy.deepcopy(self.test_data)
+        data['functions']['fn0'] = {
+            'counters': {'cycles': 1.5},
+            'data': [({'cycles': 1.5}, 0x2000, 'add r0, r0, r0'),
+                     ({}, 0x1ffc, u'b \u00e9t\u00e9')]
+        }
+        p = ProfileV2.upgrade(ProfileV1(data))
+        s = p._serializePython()
+        self.assertEqual(p._serializeNative(), s)
+        self.assertEqual(p.serialize(), s)
+
+        # Including for a profile that was read back.
+        self.assertEqual(
+            ProfileV2.deserialize(io.BytesIO(s))._serializeNative(),
+            ProfileV2.deserialize(io.BytesIO(s))._serializePython())
+
     def test_deserialize(self):
         p = ProfileV2.upgrade(ProfileV1(copy.deepcopy(self.test_data)))
         s = p.serialize()
@@ -45,6 +68,78 @@ class ProfileV2Test(unittest.TestCase):
         l2 = self.test_data['functions']['fn1']['data']
         self.assertEqual(l1, l2)
 
+    def test_function_level(self):
+        data = copy.deepcopy(self.test_data)
+        data['detail'] = 'functions'
+        del data['functions']['fn1']['data']
+        p = ProfileV2.upgrade(ProfileV1(data))
+        p2 = ProfileV2.deserialize(io.BytesIO(p.serialize()))
+        self.assertEqual(p2.getDetail(), 'functions')
+        self.assertEqual(p2.getFunctions()['fn1']['length'], 0)
+        self.assertEqual(list(p2.getCodeForFunction('fn1')), [])
+
+        # Instruction-level profiles keep the original header layout.
+        p = ProfileV2.upgrade(ProfileV1(copy.deepcopy(self.test_data)))
+        p2 = ProfileV2.deserialize(io.BytesIO(p.serialize()))
+        self.assertEqual(p2.getDetail(), 'instructions')
+
+    def test_header_tables(self):
+        # Each optional table of the header is read back, alone and
+        # together with the others.
+        info = {'binary': '/usr/bin/fib', 'build-id': 'abcd',
+                'start': 0x100000, 'end': 0x100008}
+        objects = {'buf': {'counters': {'cycles': 5.0},
+                           'levels': {'L1': 2.0}}}
+        for addresses, with_objects, hashes, absolute in \
+                itertools.product((False, True), repeat=4):
+            data = copy.deepcopy(self.test_data)
+            fn1 = data['functions']['fn1']
+            if addresses:
+                data['detail'] = 'addresses'
+                fn1.update(info)
+            if with_objects:
+                data['data-objects'] = objects
+            if hashes:
+                fn1['hash'] = '0123abcd'
+            if absolute:
+                data['absolute-counters'] = ['branch-misses']
+            p = ProfileV2.upgrade(ProfileV1(data))
+            s = p.serialize()
+            p2 = ProfileV2.deserialize(io.BytesIO(s))
+            self.assertEqual(p2.getDetail(), 'addresses'
+                             if addresses else 'instructions')
+            self.assertEqual(p2.getBinaryInfo('fn1'),
+                             info if addresses else None)
+            self.assertEqual(p2.getDataObjects(),
+                             objects if with_objects else {})
+            self.assertEqual(p2.getFunctions()['fn1'].get('hash'),
+                             '0123abcd' if hashes else None)
+            self.assertEqual(p2.getAbsoluteCounters(),
+                             ['branch-misses'] if absolute else [])
+            self.assertEqual(list(p2.getCodeForFunction('fn1')),
+                             fn1['data'])
+            summary = ProfileV2.peek(io.BytesIO(s), functions=True)
+            self.assertEqual(summary.get('absolute-counters'),
+                             ['branch-misses'] if absolute else None)
+            self.assertEqual(ProfileV2.peek(io.BytesIO(s), detail=True),
+                             {'counters': p.getTopLevelCounters(),
+                              'detail': p2.getDetail()})
+
+    def test_peek(self):
+        p = ProfileV2.upgrade(ProfileV1(copy.deepcopy(self.test_data)))
+        s = p.serialize()
+        self.assertEqual(ProfileV2.peek(io.BytesIO(s)),
+                         {'counters': {'cycles': 12345, 'branch-misses': 200}})
+
+        # Only the uncompressed index is read.
+        summary = ProfileV2.peek(io.BytesIO(s), functions=True)
+        self.assertEqual(summary['functions'],
+                         ProfileV2.deserialize(io.BytesIO(s)).getFunctions())
+
+        _, summary = Profile.ingestRendered(Profile(p).render())
+        self.assertEqual(summary['counters'],
+                         {'cycles': 12345, 'branch-misses': 200})
+
     def test_getFunctions(self):
         p = ProfileV2.upgrade(ProfileV1(copy.deepcopy(self.test_data)))
         self.assertEqual(p.getFunctions(),